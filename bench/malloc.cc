@@ -0,0 +1,446 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+// Measures the cost of the allocation hooks: allocation workloads
+// run by 1 to N threads, each one in three configurations: plain
+// libc, libleaktracer.so loaded but idle, and monitoring all
+// threads. Each run is a child process (this program, executed
+// again with "--run"), so that configurations don't share a heap.
+//
+// This program is not linked with LeakTracer, the runs which need
+// it preload the library (found in LD_LIBRARY_PATH, as "make bench"
+// sets it, unless a path is given). Writes CSV on stdout.
+//
+// usage: malloc.bin [-t max threads] [-n operations per thread]
+//                   [-w workload] [-l libleaktracer.so path]
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include "leaktracer.h"
+
+
+#define DEFAULT_LIBRARY			"libleaktracer.so"
+#define DEFAULT_MAX_THREADS		4
+#define DEFAULT_OPERATIONS		100000
+#define LIVE_BLOCKS				1024	// per thread, at most
+#define CROSS_BATCH				64		// blocks handed over at once
+
+// allocation workload: sizes are uniform in [minSize, maxSize], or
+// log-uniform (as many blocks of 16-32 bytes as of 16-32 KB) if
+// logSizes is set. An operation is an allocation with probability
+// allocPercent (if the thread has less than LIVE_BLOCKS blocks),
+// or a release. A release hands the block to the next thread,
+// which releases it, with probability crossPercent
+typedef struct {
+	const char *name;
+	size_t minSize;
+	size_t maxSize;
+	bool logSizes;
+	unsigned int allocPercent;
+	unsigned int crossPercent;
+} workload_t;
+
+static const workload_t workloads[] = {
+	{ "small",   16, 256,   false, 50, 0 },
+	{ "mixed",   16, 65536, true,  50, 0 },
+	{ "growing", 16, 256,   false, 75, 0 },
+	{ "cross",   16, 256,   false, 50, 50 },
+};
+#define NUM_OF_WORKLOADS	(sizeof(workloads) / sizeof(workloads[0]))
+
+enum { CONFIG_LIBC, CONFIG_IDLE, CONFIG_MONITORING, NUM_OF_CONFIGS };
+static const char *configNames[] = { "libc", "idle", "monitoring" };
+
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static inline uint64_t nextRandom(uint64_t &state)
+{
+	// xorshift64*
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+
+// blocks released by other threads, see workload_t::crossPercent
+typedef struct {
+	pthread_mutex_t mutex;
+	void **blocks;
+	unsigned int size;
+	unsigned int capacity;
+} inbox_t;
+
+typedef struct {
+	const workload_t *workload;
+	unsigned int index;
+	unsigned int numOfThreads;
+	unsigned long operations;
+	inbox_t *inboxes;
+	pthread_barrier_t *barrier;
+	void **live;		// LIVE_BLOCKS slots, kept after the run
+	unsigned int numOfLive;
+	uint64_t start;
+	uint64_t end;
+} thread_arg_t;
+
+
+static size_t drawSize(const workload_t &workload, uint64_t &random)
+{
+	if (!workload.logSizes)
+		return workload.minSize + nextRandom(random) % (workload.maxSize - workload.minSize + 1);
+	double ratio = (double)workload.maxSize / workload.minSize;
+	double fraction = (nextRandom(random) >> 11) * (1.0 / 9007199254740992.0);
+	size_t size = (size_t)(workload.minSize * pow(ratio, fraction));
+	return (size < workload.maxSize) ? size : workload.maxSize;
+}
+
+
+// releases the blocks handed over by other threads, returns
+// their number
+static unsigned int releaseInbox(inbox_t &inbox, void **batch)
+{
+	unsigned int n;
+	pthread_mutex_lock(&inbox.mutex);
+	n = inbox.size;
+	memcpy(batch, inbox.blocks, n * sizeof(void*));
+	inbox.size = 0;
+	pthread_mutex_unlock(&inbox.mutex);
+	for (unsigned int i = 0; i < n; i++)
+		free(batch[i]);
+	return n;
+}
+
+
+// hands blocks over to another thread, or releases them if its
+// inbox is full
+static void handOver(inbox_t &inbox, void **blocks, unsigned int n)
+{
+	unsigned int handed;
+	pthread_mutex_lock(&inbox.mutex);
+	handed = inbox.capacity - inbox.size;
+	if (handed > n)
+		handed = n;
+	memcpy(inbox.blocks + inbox.size, blocks, handed * sizeof(void*));
+	inbox.size += handed;
+	pthread_mutex_unlock(&inbox.mutex);
+	for (unsigned int i = handed; i < n; i++)
+		free(blocks[i]);
+}
+
+
+static void *runThread(void *ptr)
+{
+	thread_arg_t &arg = *static_cast<thread_arg_t*>(ptr);
+	const workload_t &workload = *arg.workload;
+	uint64_t random = 0x9E3779B97F4A7C15ULL * (arg.index + 1);
+	inbox_t &next = arg.inboxes[(arg.index + 1) % arg.numOfThreads];
+	void *outbox[CROSS_BATCH];
+	unsigned int numOfOut = 0;
+	void **batch = static_cast<void**>(malloc(CROSS_BATCH * arg.numOfThreads * sizeof(void*)));
+	unsigned long done = 0;
+
+	pthread_barrier_wait(arg.barrier);
+	arg.start = now();
+	for (unsigned long iteration = 0; done < arg.operations; iteration++) {
+		if ((iteration % CROSS_BATCH) == 0 && workload.crossPercent != 0)
+			done += releaseInbox(arg.inboxes[arg.index], batch);
+
+		bool allocate = (arg.numOfLive == 0) ||
+			(arg.numOfLive < LIVE_BLOCKS && nextRandom(random) % 100 < workload.allocPercent);
+		if (allocate) {
+			void *p = malloc(drawSize(workload, random));
+			// touches the block, as a program would
+			*static_cast<volatile char*>(p) = 0;
+			arg.live[arg.numOfLive++] = p;
+		} else {
+			// releases a random block
+			unsigned int slot = nextRandom(random) % arg.numOfLive;
+			void *p = arg.live[slot];
+			arg.live[slot] = arg.live[--arg.numOfLive];
+			if (workload.crossPercent != 0 && nextRandom(random) % 100 < workload.crossPercent) {
+				outbox[numOfOut++] = p;
+				if (numOfOut == CROSS_BATCH) {
+					handOver(next, outbox, numOfOut);
+					numOfOut = 0;
+				}
+			} else {
+				free(p);
+			}
+		}
+		done++;
+	}
+	if (numOfOut != 0)
+		handOver(next, outbox, numOfOut);
+	arg.end = now();
+	free(batch);
+	return NULL;
+}
+
+
+static long readStatusKb(const char *field)
+{
+	FILE *file = fopen("/proc/self/status", "r");
+	char line[256];
+	long value = -1;
+	size_t length = strlen(field);
+	if (file == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, field, length) == 0 && line[length] == ':') {
+			value = atol(line + length + 1);
+			break;
+		}
+	}
+	fclose(file);
+	return value;
+}
+
+
+// runs a workload in this process, writes "<operations>
+// <elapsed ns> <peak RSS kB> <LeakTracer metadata bytes>"
+static int runWorkload(const workload_t &workload, int config, unsigned int numOfThreads, unsigned long operations)
+{
+	void (*getStats)(leaktracer_stats_t*) = (void (*)(leaktracer_stats_t*))dlsym(RTLD_DEFAULT, "leaktracer_getStats");
+	if ((getStats != NULL) != (config != CONFIG_LIBC)) {
+		fprintf(stderr, "libleaktracer.so is %s in the %s run\n", (getStats != NULL) ? "loaded" : "not loaded", configNames[config]);
+		return 1;
+	}
+
+	pthread_t *threads = new pthread_t[numOfThreads];
+	thread_arg_t *args = new thread_arg_t[numOfThreads];
+	inbox_t *inboxes = new inbox_t[numOfThreads];
+	pthread_barrier_t barrier;
+
+	pthread_barrier_init(&barrier, NULL, numOfThreads);
+	for (unsigned int i = 0; i < numOfThreads; i++) {
+		pthread_mutex_init(&inboxes[i].mutex, NULL);
+		inboxes[i].capacity = CROSS_BATCH * numOfThreads;
+		inboxes[i].blocks = new void*[inboxes[i].capacity];
+		inboxes[i].size = 0;
+		args[i].workload = &workload;
+		args[i].index = i;
+		args[i].numOfThreads = numOfThreads;
+		args[i].operations = operations;
+		args[i].inboxes = inboxes;
+		args[i].barrier = &barrier;
+		args[i].live = new void*[LIVE_BLOCKS];
+		args[i].numOfLive = 0;
+		if (pthread_create(&threads[i], NULL, runThread, &args[i]) != 0) {
+			fprintf(stderr, "failed to create thread\n");
+			return 1;
+		}
+	}
+
+	// from the first thread starting to the last one ending
+	uint64_t start = UINT64_MAX, end = 0;
+	for (unsigned int i = 0; i < numOfThreads; i++) {
+		pthread_join(threads[i], NULL);
+		if (args[i].start < start)
+			start = args[i].start;
+		if (args[i].end > end)
+			end = args[i].end;
+	}
+	uint64_t elapsed = end - start;
+
+	// before the live blocks are released
+	unsigned long long metadataBytes = 0;
+	if (getStats != NULL) {
+		leaktracer_stats_t stats;
+		getStats(&stats);
+		metadataBytes = stats.metadataBytes;
+	}
+	printf("%lu %llu %ld %llu\n", operations * numOfThreads, (unsigned long long)elapsed,
+		readStatusKb("VmHWM"), metadataBytes);
+
+	for (unsigned int i = 0; i < numOfThreads; i++) {
+		while (inboxes[i].size > 0)
+			free(inboxes[i].blocks[--inboxes[i].size]);
+		while (args[i].numOfLive > 0)
+			free(args[i].live[--args[i].numOfLive]);
+		delete[] args[i].live;
+		delete[] inboxes[i].blocks;
+	}
+	delete[] inboxes;
+	delete[] args;
+	delete[] threads;
+	return 0;
+}
+
+
+// environment of the runs of a configuration: LeakTracer settings
+// and LD_PRELOAD are replaced by those of the configuration
+static char **configEnvironment(int config, char *preload)
+{
+	extern char **environ;
+	unsigned int n = 0;
+	while (environ[n] != NULL)
+		n++;
+	char **env = new char*[n + 3];
+	unsigned int size = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		if (strncmp(environ[i], "LEAKTRACER_", 11) == 0 && strcmp(environ[i], "LEAKTRACER_NOBANNER=1") != 0)
+			continue;
+		if (strncmp(environ[i], "LD_PRELOAD=", 11) == 0)
+			continue;
+		env[size++] = environ[i];
+	}
+	if (config != CONFIG_LIBC)
+		env[size++] = preload;
+	if (config == CONFIG_MONITORING)
+		env[size++] = const_cast<char*>("LEAKTRACER_ONSTART_STARTALLTHREAD=1");
+	env[size] = NULL;
+	return env;
+}
+
+
+// runs a workload in a child process, returns false if it failed
+static bool runChild(char **env, unsigned int workload, int config, unsigned int numOfThreads, unsigned long operations,
+	unsigned long *totalOperations, uint64_t *elapsed, long *rss, unsigned long long *metadataBytes)
+{
+	char workloadArg[16], configArg[16], threadsArg[16], operationsArg[32];
+	int fds[2];
+	pid_t pid;
+	int status;
+
+	snprintf(workloadArg, sizeof(workloadArg), "%u", workload);
+	snprintf(configArg, sizeof(configArg), "%d", config);
+	snprintf(threadsArg, sizeof(threadsArg), "%u", numOfThreads);
+	snprintf(operationsArg, sizeof(operationsArg), "%lu", operations);
+	char *argv[] = { const_cast<char*>("/proc/self/exe"), const_cast<char*>("--run"),
+		workloadArg, configArg, threadsArg, operationsArg, NULL };
+
+	if (pipe(fds) != 0)
+		return false;
+	pid = fork();
+	if (pid == 0) {
+		dup2(fds[1], 1);
+		close(fds[0]);
+		close(fds[1]);
+		execve(argv[0], argv, env);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return false;
+	}
+
+	FILE *result = fdopen(fds[0], "r");
+	int n = fscanf(result, "%lu %llu %ld %llu", totalOperations, (unsigned long long*)elapsed, rss, metadataBytes);
+	fclose(result);
+	waitpid(pid, &status, 0);
+	return n == 4 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+// 1, 2, 4... and maxThreads, 0 after it
+static unsigned int nextNumOfThreads(unsigned int numOfThreads, unsigned int maxThreads)
+{
+	if (numOfThreads == maxThreads)
+		return 0;
+	return (numOfThreads * 2 < maxThreads) ? numOfThreads * 2 : maxThreads;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned int maxThreads = DEFAULT_MAX_THREADS;
+	unsigned long operations = DEFAULT_OPERATIONS;
+	const char *onlyWorkload = NULL;
+	const char *library = DEFAULT_LIBRARY;
+	int opt;
+
+	if (argc == 6 && strcmp(argv[1], "--run") == 0) {
+		unsigned int workload = atoi(argv[2]);
+		int config = atoi(argv[3]);
+		if (workload >= NUM_OF_WORKLOADS || config < 0 || config >= NUM_OF_CONFIGS)
+			return 1;
+		return runWorkload(workloads[workload], config, atoi(argv[4]), strtoul(argv[5], NULL, 0));
+	}
+
+	while ((opt = getopt(argc, argv, "t:n:w:l:")) != -1) {
+		switch (opt) {
+		case 't': maxThreads = atoi(optarg); break;
+		case 'n': operations = strtoul(optarg, NULL, 0); break;
+		case 'w': onlyWorkload = optarg; break;
+		case 'l': library = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-t max threads] [-n operations per thread] [-w workload] [-l libleaktracer.so path]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (maxThreads == 0 || operations == 0) {
+		fprintf(stderr, "threads and operations must not be 0\n");
+		return 1;
+	}
+	char *preload = new char[strlen("LD_PRELOAD=") + strlen(library) + 1];
+	strcpy(preload, "LD_PRELOAD=");
+	strcat(preload, library);
+
+	printf("workload,min_size,max_size,alloc_percent,cross_percent,threads,config,"
+		"operations,ops_per_sec,ns_per_op,rss_kb,tracer_rss_kb,metadata_bytes\n");
+	for (unsigned int w = 0; w < NUM_OF_WORKLOADS; w++) {
+		const workload_t &workload = workloads[w];
+		if (onlyWorkload != NULL && strcmp(onlyWorkload, workload.name) != 0)
+			continue;
+		for (unsigned int numOfThreads = 1; numOfThreads != 0; numOfThreads = nextNumOfThreads(numOfThreads, maxThreads)) {
+			// frees by other threads need other threads
+			if (workload.crossPercent != 0 && numOfThreads == 1)
+				continue;
+			long libcRss = 0;
+			for (int config = CONFIG_LIBC; config < NUM_OF_CONFIGS; config++) {
+				char **env = configEnvironment(config, preload);
+				unsigned long totalOperations;
+				uint64_t elapsed;
+				long rss;
+				unsigned long long metadataBytes;
+				bool ok = runChild(env, w, config, numOfThreads, operations, &totalOperations, &elapsed, &rss, &metadataBytes);
+				delete[] env;
+				if (!ok) {
+					fprintf(stderr, "%s run of workload %s with %u threads failed\n", configNames[config], workload.name, numOfThreads);
+					return 1;
+				}
+				if (config == CONFIG_LIBC)
+					libcRss = rss;
+
+				// ns per operation of a thread
+				printf("%s,%lu,%lu,%u,%u,%u,%s,%lu,%.0f,%.1f,%ld,", workload.name,
+					(unsigned long)workload.minSize, (unsigned long)workload.maxSize,
+					workload.allocPercent, workload.crossPercent, numOfThreads, configNames[config],
+					totalOperations, totalOperations * 1e9 / elapsed,
+					(double)elapsed * numOfThreads / totalOperations, rss);
+				printf("%ld,%llu\n", rss - libcRss, metadataBytes);
+				fflush(stdout);
+			}
+		}
+	}
+	delete[] preload;
+	return 0;
+}
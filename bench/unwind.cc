@@ -0,0 +1,100 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+// Compares the cost of capturing a stack with glibc backtrace()
+// and with the frame pointer unwinder, per capture and per frame
+
+
+#include <stdio.h>
+#include <time.h>
+#include <execinfo.h>
+#include "StackUnwinder.hpp"
+
+
+#define CAPTURES		100000
+#define MAX_DEPTH		64
+
+enum { METHOD_GLIBC, METHOD_FRAME_POINTER };
+static const char *methodNames[] = { "glibc", "framepointer" };
+
+static void *stackLow, *stackHigh;
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// captures CAPTURES stacks of depth frames, returns the
+// number of frames of the last one
+static unsigned int __attribute__ ((noinline)) capture(int method, unsigned int depth, double *elapsed)
+{
+	void *frames[MAX_DEPTH];
+	unsigned int n = 0;
+
+	double start = now();
+	for (int i = 0; i < CAPTURES; i++) {
+		if (method == METHOD_GLIBC)
+			n = backtrace(frames, depth);
+#ifdef LEAKTRACER_FRAME_POINTER_UNWINDER
+		else
+			n = leaktracer::unwindFramePointers(frames, depth, stackLow, stackHigh);
+#endif
+	}
+	*elapsed = now() - start;
+	return n;
+}
+
+
+// recurses, so that there are enough frames to capture
+static unsigned int __attribute__ ((noinline)) recurse(int level, int method, unsigned int depth, double *elapsed)
+{
+	unsigned int n;
+	if (level == 0)
+		n = capture(method, depth, elapsed);
+	else
+		n = recurse(level - 1, method, depth, elapsed);
+	// prevents tail call
+	__asm__ __volatile__ ("" ::: "memory");
+	return n;
+}
+
+
+int main()
+{
+	static const unsigned int depths[] = { 5, 10, 32, 64 };
+	int methods = 1;
+
+#ifdef LEAKTRACER_FRAME_POINTER_UNWINDER
+	if (leaktracer::getThreadStackBounds(&stackLow, &stackHigh))
+		methods = 2;
+#endif
+
+	// first call of backtrace() loads libgcc_s
+	void *frame;
+	backtrace(&frame, 1);
+
+	printf("method,depth,frames,ns_per_capture,ns_per_frame\n");
+	for (int method = 0; method < methods; method++) {
+		for (unsigned int i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+			double elapsed;
+			unsigned int n = recurse(depths[i], method, depths[i], &elapsed);
+			printf("%s,%u,%u,%.1f,%.1f\n", methodNames[method], depths[i], n,
+				elapsed / CAPTURES, (n != 0) ? elapsed / CAPTURES / n : 0.0);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __ADDRESS_FILTER_h_included__
+#define __ADDRESS_FILTER_h_included__
+
+#include "ObjectsPool.hpp"
+#include "PointerHash.hpp"
+
+
+namespace leaktracer {
+
+/**
+ * Counting filter of addresses (a counting Bloom filter with a
+ * single hash): tells without locking that an address was
+ * certainly not added, or may have been.
+ *
+ * Each address selects one of (1 << BITS) counters. Counters
+ * saturate, a saturated counter is never decremented again, so
+ * counts may only be too high: mayContain() may be wrong when it
+ * returns true, never when it returns false, as long as remove()
+ * is only called for addresses that were added. Addresses of a
+ * saturated counter always "may be contained" until clear(),
+ * which only costs their releases a lookup: getSaturated()
+ * counts them.
+ *
+ * Counters are allocated by allocate(), before the filter is used.
+ */
+template <unsigned int BITS>
+class TAddressFilter {
+public:
+	TAddressFilter(void) : __counters(NULL), __saturated(0) {}
+	virtual ~TAddressFilter(void) {
+		if (__counters != NULL)
+			LT_FREE(__counters);
+	}
+
+	/** allocates counters, returns false on failure */
+	bool allocate(void) {
+		if (__counters == NULL)
+			__counters = static_cast<unsigned char*>(LT_CALLOC(1 << BITS, sizeof(unsigned char)));
+		return __counters != NULL;
+	}
+
+	inline void add(void *ptr);
+	inline void remove(void *ptr);
+	inline bool mayContain(void *ptr);
+
+	/** zeroes all counters, when none of the addresses added
+	 *  before will be removed. Addresses added meanwhile may be
+	 *  forgotten */
+	void clear(void) {
+		if (__counters == NULL)
+			return;
+		for (unsigned long i = 0; i < (1UL << BITS); i++)
+			__atomic_store_n(&__counters[i], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&__saturated, 0, __ATOMIC_RELAXED);
+	}
+
+	/** number of saturated counters */
+	inline unsigned long getSaturated(void) { return __atomic_load_n(&__saturated, __ATOMIC_RELAXED); }
+
+	/** bytes allocated for the counters */
+	inline size_t getMemoryUsage(void) { return (__counters != NULL) ? (1 << BITS) : 0; }
+
+private:
+	inline unsigned char * counter(void *ptr)
+	{ return &__counters[hashPointer(ptr) >> (64 - BITS)]; }
+
+#define ADDRESS_FILTER_COUNTER_MAX	0xff
+	unsigned char *__counters;
+	unsigned long __saturated;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+//
+// IMPLEMENTATION: TAddressFilter
+// (inline template functions)
+//
+//////////////////////////////////////////////////////////////////////
+
+template <unsigned int BITS>
+inline void TAddressFilter<BITS>::add(void *ptr)
+{
+	unsigned char *pCounter = counter(ptr);
+	unsigned char value = __atomic_load_n(pCounter, __ATOMIC_RELAXED);
+	while (value != ADDRESS_FILTER_COUNTER_MAX) {
+		if (__atomic_compare_exchange_n(pCounter, &value, value + 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			if (value + 1 == ADDRESS_FILTER_COUNTER_MAX)
+				__atomic_add_fetch(&__saturated, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+}
+
+template <unsigned int BITS>
+inline void TAddressFilter<BITS>::remove(void *ptr)
+{
+	unsigned char *pCounter = counter(ptr);
+	unsigned char value = __atomic_load_n(pCounter, __ATOMIC_RELAXED);
+	while (value != ADDRESS_FILTER_COUNTER_MAX && value != 0 &&
+		   !__atomic_compare_exchange_n(pCounter, &value, value - 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+template <unsigned int BITS>
+inline bool TAddressFilter<BITS>::mayContain(void *ptr)
+{
+	return __atomic_load_n(counter(ptr), __ATOMIC_ACQUIRE) != 0;
+}
+
+
+}  // end namespace
+
+
+#endif  // include once
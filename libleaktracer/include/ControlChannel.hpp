@@ -0,0 +1,71 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __CONTROL_CHANNEL_h_included__
+#define __CONTROL_CHANNEL_h_included__
+
+#include <iostream>
+#include <string>
+
+
+namespace leaktracer {
+
+/**
+ * Control of LeakTracer through an abstract Unix socket (see
+ * LEAKTRACER_CONTROL_SOCKET and helpers/leak-control), instead
+ * of signals: a detached service thread accepts connections one
+ * at a time, reads one command line, writes the reply and closes
+ * the connection. Only processes of the same user (or root) are
+ * served.
+ *
+ * The reply is "ok" or "error <reason>" on the first line,
+ * followed by the output of the command:
+ *
+ * start                  starts monitoring all threads
+ * stop                   stops all monitoring
+ * report [<path>]        writes the report to path (as on exit),
+ *                        or the text report on the socket
+ * stats                  writes "name=value" lines
+ * mark-generation        starts a new generation, writes
+ *                        "generation=<number>"
+ * sample-bytes <bytes>   changes the sampling rate
+ *
+ * Replies are written in memory, then sent with no LeakTracer lock
+ * held: a client which doesn't read them only delays the next
+ * ones, up to the send timeout. Allocations of the service thread
+ * are never monitored.
+ */
+class ControlChannel {
+public:
+	ControlChannel(void);
+	virtual ~ControlChannel(void);
+
+	/** listens on the abstract socket of given name, and starts
+	 *  the service thread. Returns false if it could not */
+	bool start(const char *name);
+
+private:
+	int __socket;
+
+	static void *serviceThread(void *);
+	void serve(int connection);
+	bool readCommand(int connection, std::string &command);
+	void sendReply(int connection, const std::string &reply);
+	void runCommand(const std::string &command, std::ostream &out);
+};
+
+
+}  // end namespace
+
+
+#endif  // include once
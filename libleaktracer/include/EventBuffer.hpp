@@ -0,0 +1,105 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __EVENT_BUFFER_h_included__
+#define __EVENT_BUFFER_h_included__
+
+#include "Mutex.hpp"
+#include "MutexLock.hpp"
+#include "ObjectsPool.hpp"
+
+
+namespace leaktracer {
+
+/**
+ * Per-thread buffer of events of type E. The owning thread
+ * appends events, they are consumed in batches by the thread
+ * flushing all buffers, which then empties the buffer, or by the
+ * owning thread, which may keep some of them.
+ *
+ * The mutex is taken by the owner for each append, and by the
+ * flushing thread for the whole flush, so it is only contended
+ * while a flush is running.
+ */
+template <typename E>
+class TEventBuffer {
+public:
+	explicit TEventBuffer(unsigned int capacity);
+	~TEventBuffer(void);
+
+	Mutex mutex;
+
+	/** returns false if the events storage could not be allocated */
+	inline bool valid(void) { return __events != NULL; }
+
+	/** following functions must be called with mutex locked */
+	inline bool full(void) { return __count >= __capacity; }
+	inline bool empty(void) { return __count == 0; }
+	inline unsigned int size(void) { return __count; }
+
+	/** returns the slot for a new event, buffer must not be full */
+	inline E * append(void) { return &__events[__count++]; }
+
+	/** Following 3 functions are used to drain the buffer:
+	 *  rewind() moves to the first event, peek() returns the
+	 *  current event (NULL at the end), next() moves to the
+	 *  following one. clear() drops all events. keep() keeps
+	 *  the current event, before next(), compact() then drops
+	 *  all the others. */
+	inline void rewind(void) { __cursor = 0; __kept = 0; }
+	inline E * peek(void) { return (__cursor < __count) ? &__events[__cursor] : NULL; }
+	inline void next(void) { __cursor++; }
+	inline void clear(void) { __count = 0; __cursor = 0; }
+	inline void keep(void) { __events[__kept++] = __events[__cursor]; }
+	inline void compact(void) { __count = __kept; __cursor = 0; }
+
+	/** bytes allocated for the events */
+	inline size_t getMemoryUsage(void) { return (size_t)__capacity * sizeof(E); }
+
+private:
+	E *__events;
+	unsigned int __capacity;
+	unsigned int __count;
+	unsigned int __cursor;
+	unsigned int __kept;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+//
+// IMPLEMENTATION: TEventBuffer
+// (inline template functions)
+//
+//////////////////////////////////////////////////////////////////////
+
+template <typename E>
+TEventBuffer<E>::TEventBuffer(unsigned int capacity)
+: __events(NULL), __capacity(0), __count(0), __cursor(0), __kept(0)
+{
+	__events = static_cast<E*>(LT_MALLOC(capacity * sizeof(E)));
+	if (__events != NULL)
+		__capacity = capacity;
+}
+
+template <typename E>
+TEventBuffer<E>::~TEventBuffer(void)
+{
+	if (__events != NULL)
+		LT_FREE(__events);
+}
+
+
+}  // end namespace
+
+
+#endif  // include once
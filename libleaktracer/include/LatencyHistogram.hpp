@@ -0,0 +1,152 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __LATENCY_HISTOGRAM_h_included__
+#define __LATENCY_HISTOGRAM_h_included__
+
+#include <stdint.h>
+#include <string.h>
+
+
+namespace leaktracer {
+
+/**
+ * Log-linear histogram of durations: each power of 2 is split in
+ * (1 << LATENCY_HISTOGRAM_SUB_BITS) buckets of equal width, so
+ * that a percentile is known within 1/8 of its value, whatever
+ * its magnitude. Values below (1 << LATENCY_HISTOGRAM_SUB_BITS)
+ * have their own bucket, longer ones than the last bucket are
+ * counted in it.
+ *
+ * A histogram is written by one thread only, with relaxed atomic
+ * stores (no read-modify-write), and may be read by others at any
+ * time.
+ */
+class LatencyHistogram {
+public:
+#define LATENCY_HISTOGRAM_SUB_BITS	3
+#define LATENCY_HISTOGRAM_MAX_BITS	36
+#define LATENCY_HISTOGRAM_BUCKETS	((LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BITS + 1) << LATENCY_HISTOGRAM_SUB_BITS)
+
+	LatencyHistogram(void) { memset(this, 0, sizeof(*this)); }
+
+	/** counts a duration, only by the thread owning the histogram */
+	inline void add(uint64_t value);
+
+	/** adds the counts of another histogram to this one, which
+	 *  must not be written concurrently */
+	inline void merge(const LatencyHistogram &other);
+
+	/** number of durations counted */
+	inline uint64_t count(void) const;
+
+	/** longest duration counted */
+	inline uint64_t max(void) const { return __atomic_load_n(&__max, __ATOMIC_RELAXED); }
+
+	/** duration below which a fraction q of the durations are, the
+	 *  upper bound of its bucket (0 if none was counted) */
+	inline uint64_t percentile(double q) const;
+
+private:
+	uint64_t __counts[LATENCY_HISTOGRAM_BUCKETS];
+	uint64_t __max;
+
+	static inline unsigned int bucket(uint64_t value);
+	static inline uint64_t bucketUpperBound(unsigned int bucket);
+};
+
+
+//////////////////////////////////////////////////////////////////////
+//
+// IMPLEMENTATION: LatencyHistogram
+// (inline functions)
+//
+//////////////////////////////////////////////////////////////////////
+
+inline unsigned int LatencyHistogram::bucket(uint64_t value)
+{
+	if (value < (1 << LATENCY_HISTOGRAM_SUB_BITS))
+		return (unsigned int)value;
+	// highest bit, and the next SUB_BITS ones
+	unsigned int bit = 63 - __builtin_clzll(value);
+	unsigned int index = ((bit - LATENCY_HISTOGRAM_SUB_BITS + 1) << LATENCY_HISTOGRAM_SUB_BITS) +
+		(unsigned int)((value >> (bit - LATENCY_HISTOGRAM_SUB_BITS)) & ((1 << LATENCY_HISTOGRAM_SUB_BITS) - 1));
+	return (index < LATENCY_HISTOGRAM_BUCKETS) ? index : LATENCY_HISTOGRAM_BUCKETS - 1;
+}
+
+
+inline uint64_t LatencyHistogram::bucketUpperBound(unsigned int bucket)
+{
+	if (bucket < (1 << LATENCY_HISTOGRAM_SUB_BITS))
+		return bucket;
+	unsigned int shift = (bucket >> LATENCY_HISTOGRAM_SUB_BITS) - 1;
+	uint64_t first = (uint64_t)((1 << LATENCY_HISTOGRAM_SUB_BITS) + (bucket & ((1 << LATENCY_HISTOGRAM_SUB_BITS) - 1))) << shift;
+	return first + ((uint64_t)1 << shift) - 1;
+}
+
+
+inline void LatencyHistogram::add(uint64_t value)
+{
+	uint64_t *pCount = &__counts[bucket(value)];
+	__atomic_store_n(pCount, __atomic_load_n(pCount, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	if (value > __atomic_load_n(&__max, __ATOMIC_RELAXED))
+		__atomic_store_n(&__max, value, __ATOMIC_RELAXED);
+}
+
+
+inline void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+	for (unsigned int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+		__counts[i] += __atomic_load_n(&other.__counts[i], __ATOMIC_RELAXED);
+	if (other.max() > __max)
+		__max = other.max();
+}
+
+
+inline uint64_t LatencyHistogram::count(void) const
+{
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+		total += __atomic_load_n(&__counts[i], __ATOMIC_RELAXED);
+	return total;
+}
+
+
+inline uint64_t LatencyHistogram::percentile(double q) const
+{
+	uint64_t total = count();
+	if (total == 0)
+		return 0;
+	// rank of the duration, from 1
+	uint64_t rank = (uint64_t)(q * total);
+	if (rank < q * total)
+		rank++;
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+		seen += __atomic_load_n(&__counts[i], __ATOMIC_RELAXED);
+		if (seen >= rank) {
+			uint64_t bound = bucketUpperBound(i);
+			return (bound < max()) ? bound : max();
+		}
+	}
+	return max();
+}
+
+
+}  // end namespace
+
+
+#endif  // include once
@@ -11,4 +11,11 @@
 
 #define LEAKTRACER_VERSION "3.0.0"
 
+#ifdef USE_TLS
+// initial-exec model: access is a single load from the thread
+// pointer, the library must be loaded at program start (linked or
+// LD_PRELOAD)
+#	define LEAKTRACER_TLS __thread __attribute__ ((tls_model ("initial-exec")))
+#endif
+
 #endif /* __LEAKTRACE_L_h_included__ */
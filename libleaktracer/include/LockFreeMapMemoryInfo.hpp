@@ -0,0 +1,658 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __LOCK_FREE_MAP_MEMORY_INFO_h_included__
+#define __LOCK_FREE_MAP_MEMORY_INFO_h_included__
+
+#include <stdint.h>
+#include <sched.h>
+#include "ObjectsPool.hpp"
+#include "PointerHash.hpp"
+
+
+namespace leaktracer {
+
+// number of tables of the map, each one twice as big as the
+// previous one
+#ifndef LOCKFREE_MAP_MAX_TABLES
+#	define LOCKFREE_MAP_MAX_TABLES 16
+#endif
+
+// longest probe of an insert in a table but the last one, before
+// it goes on to the next table
+#ifndef LOCKFREE_MAP_INSERT_PROBES
+#	define LOCKFREE_MAP_INSERT_PROBES 64
+#endif
+
+/**
+ * Same interface as TMapMemoryInfo, but open-addressing tables
+ * (linear probing) with the T objects stored inline in the slots.
+ * insert(), find() and release() can be called concurrently
+ * without any lock:
+ *  - insert claims a never used or released slot with a CAS on
+ *    its key, the element is only seen by release() and by
+ *    iterations once the caller has filled it and called
+ *    publish(),
+ *  - release marks the slot released (tombstone), it is reused
+ *    by later inserts,
+ *  - find and release probe at most as far as the longest probe
+ *    an insert has done, so missing pointers (releases of
+ *    untracked blocks) don't walk over the tombstones.
+ *
+ * The map grows without moving any element: an insert which
+ * finds no free slot within LOCKFREE_MAP_INSERT_PROBES of its
+ * hash goes on to the next table, twice as big, allocated by the
+ * first insert reaching it. Finds and releases probe each
+ * allocated table in turn. Tables are only freed with the map.
+ *
+ * Tombstones and the longest probes are only reclaimed by
+ * cleanUp(), when cleanUpDue() says the longest probe of a table
+ * has grown well beyond what it was after the last clean up.
+ * Inserts wait while it runs (it scans the whole tables), finds
+ * and releases don't.
+ *
+ * Only one iteration or clean up may run at a time (callers
+ * serialize them). The element returned by getNextPair() is
+ * pinned until the next call: a concurrent release() of it waits,
+ * so its T object and the memory block itself can be read safely.
+ * findAndPin() pins an element the same way, for the caller to
+ * modify it, until unpin(): releases and the iteration wait for
+ * it (the iteration doesn't skip it). endIteration() unpins the
+ * last element of an iteration stopped before its end.
+ *
+ * freeze() waits for the inserts, releases and pins running to
+ * end, and makes new ones wait until thaw(), so that the map can
+ * be copied (fork) with no slot half modified.
+ *
+ * The capacity of the first table is set by setCapacity() before
+ * the first insert. insert() returns NULL when the last table is
+ * full, and counts it (getOverflows()).
+ */
+template <typename T>
+class TLockFreeMapMemoryInfo {
+public:
+	TLockFreeMapMemoryInfo(void);
+	virtual ~TLockFreeMapMemoryInfo(void);
+
+	/** Sets number of slots of the first table (rounded up to a
+	 *  power of 2), has no effect once it is allocated */
+	void setCapacity(unsigned long capacity);
+
+	/** Allocates sizeof(T) buffer, and associates it with given
+	 *  poiter */
+	inline T * insert(void *ptr);
+
+	/** Makes an element returned by insert() visible to release()
+	 *  and to iterations, once its T object is filled */
+	inline void publish(T *pObject);
+
+	/** Returns pointer to T object, associated with given pointer */
+	inline T * find(void *ptr);
+
+	/** Same as find(), the element is pinned until unpin(), so
+	 *  that it can be modified while no one else reads it */
+	inline T * findAndPin(void *ptr);
+	inline void unpin(T *pObject);
+
+	/** Releases a buffer, associated with given pointer. */
+	inline void release(void *ptr);
+
+	/** Following 2 functions used for iteration over all
+	 *  elements */
+	void beginIteration(void);
+	bool getNextPair(T **ppObject, void **pptr);
+	/** Unpins the last element, when the iteration stops before
+	 *  the end */
+	void endIteration(void);
+	bool empty(void);
+
+	void clearAllInfo(void);
+
+	/** Reclaims the tombstones which no probe goes through, and
+	 *  the longest probes */
+	void cleanUp(void);
+	inline bool cleanUpDue(void);
+
+	/** Keeps the map from being modified, until thaw() */
+	void freeze(void);
+	void thaw(void);
+
+	/** number of inserts which found all tables full */
+	inline unsigned long getOverflows(void) { return __atomic_load_n(&__overflows, __ATOMIC_RELAXED); }
+
+	/** bytes allocated for the slots */
+	size_t getMemoryUsage(void);
+
+private:
+	// special keys
+#define LOCKFREE_MAP_KEY_EMPTY		((void*)0)
+#define LOCKFREE_MAP_KEY_RELEASED	((void*)1)
+
+	// slot state: a slot is FREE until published LIVE, a LIVE slot
+	// is PINNED by the iteration, and BUSY while being released or
+	// pinned by findAndPin()
+	enum { SLOT_FREE = 0, SLOT_LIVE, SLOT_PINNED, SLOT_BUSY };
+
+	// info is first, publish() finds the slot from it
+	typedef struct _slot_struct {
+		T info;
+		void *ptr;
+		int state;
+	} slot_t;
+
+	typedef struct _table_struct {
+		slot_t *slots;				// allocated on first insert
+		unsigned long capacity;			// power of 2
+		unsigned long maxProbe;			// longest probe done by an insert
+		unsigned long maxProbeAfterCleanUp;
+	} table_t;
+
+	// hash function from pointer to slot index
+	static inline unsigned long hash(const table_t &table, void *ptr);
+
+	static inline slot_t * allocateTable(table_t &table);
+	inline void beginInsert(void);
+	inline void endInsert(void);
+	inline void beginWrite(void);
+	inline void endWrite(void);
+	static inline T * insertInTable(table_t &table, slot_t *slots, void *ptr, unsigned long probes);
+	inline slot_t * findSlot(void *ptr);
+	static inline bool lockSlot(slot_t *slot, void *ptr);
+	static inline void releaseSlot(slot_t *slot, void *ptr);
+	static void cleanUpTable(table_t &table, slot_t *slots);
+
+	table_t __tables[LOCKFREE_MAP_MAX_TABLES];
+	unsigned long __overflows;
+	unsigned long __inserters;		// inserts running
+	unsigned long __writers;		// releases and pins running
+	bool __cleaningUp;
+	bool __frozen;
+
+	// current position in iteration
+	unsigned int __uiIterationTable;
+	unsigned long __ulIterationIndex;
+	slot_t *__pIterationPinned;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+//
+// IMPLEMENTATION: TLockFreeMapMemoryInfo
+// (inline template functions)
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef DEFAULT_LOCKFREE_MAP_CAPACITY
+#	define DEFAULT_LOCKFREE_MAP_CAPACITY (1 << 14)
+#endif
+
+// growth of the longest probe since the last clean up which makes
+// the next one due
+#ifndef LOCKFREE_MAP_CLEANUP_PROBE
+#	define LOCKFREE_MAP_CLEANUP_PROBE 16
+#endif
+
+template <typename T>
+inline bool TLockFreeMapMemoryInfo<T>::cleanUpDue(void)
+{
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		const table_t &table = __tables[i];
+		if (__atomic_load_n(&table.slots, __ATOMIC_ACQUIRE) == NULL)
+			break;
+		if (__atomic_load_n(&table.maxProbe, __ATOMIC_RELAXED) > 2 * table.maxProbeAfterCleanUp + LOCKFREE_MAP_CLEANUP_PROBE)
+			return true;
+	}
+	return false;
+}
+
+template <typename T>
+TLockFreeMapMemoryInfo<T>::TLockFreeMapMemoryInfo(void)
+: __overflows(0), __inserters(0), __writers(0), __cleaningUp(false), __frozen(false),
+  __uiIterationTable(0), __ulIterationIndex(0), __pIterationPinned(NULL)
+{
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		__tables[i].slots = NULL;
+		__tables[i].maxProbe = 0;
+		__tables[i].maxProbeAfterCleanUp = 0;
+	}
+	setCapacity(DEFAULT_LOCKFREE_MAP_CAPACITY);
+}
+
+template <typename T>
+TLockFreeMapMemoryInfo<T>::~TLockFreeMapMemoryInfo(void)
+{
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		if (__tables[i].slots != NULL)
+			LT_FREE(__tables[i].slots);
+	}
+}
+
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::setCapacity(unsigned long capacity)
+{
+	if (__tables[0].slots != NULL)
+		return;
+	unsigned long firstCapacity = 1;
+	while (firstCapacity < capacity)
+		firstCapacity <<= 1;
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++)
+		__tables[i].capacity = firstCapacity << i;
+}
+
+template <typename T>
+inline unsigned long TLockFreeMapMemoryInfo<T>::hash(const table_t &table, void *ptr)
+{
+	return (unsigned long)hashPointer(ptr) & (table.capacity - 1);
+}
+
+// allocates table on first use, several threads may race here
+template <typename T>
+inline typename TLockFreeMapMemoryInfo<T>::slot_t * TLockFreeMapMemoryInfo<T>::allocateTable(table_t &table)
+{
+	slot_t *slots = static_cast<slot_t*>(LT_CALLOC(table.capacity, sizeof(slot_t)));
+	if (slots == NULL)
+		return NULL;
+	if (!__sync_bool_compare_and_swap(&table.slots, (slot_t*)NULL, slots)) {
+		LT_FREE(slots);
+		slots = __atomic_load_n(&table.slots, __ATOMIC_ACQUIRE);
+	}
+	return slots;
+}
+
+// inserts wait while a clean up runs or the map is frozen, which
+// waits for those already running to end
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::beginInsert(void)
+{
+	for (;;) {
+		__sync_fetch_and_add(&__inserters, 1);
+		if (!__atomic_load_n(&__cleaningUp, __ATOMIC_SEQ_CST) && !__atomic_load_n(&__frozen, __ATOMIC_SEQ_CST))
+			return;
+		__sync_fetch_and_sub(&__inserters, 1);
+		while (__atomic_load_n(&__cleaningUp, __ATOMIC_ACQUIRE) || __atomic_load_n(&__frozen, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+}
+
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::endInsert(void)
+{
+	__sync_fetch_and_sub(&__inserters, 1);
+}
+
+// same for releases and pins, which only wait while the map is
+// frozen
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::beginWrite(void)
+{
+	for (;;) {
+		__sync_fetch_and_add(&__writers, 1);
+		if (!__atomic_load_n(&__frozen, __ATOMIC_SEQ_CST))
+			return;
+		__sync_fetch_and_sub(&__writers, 1);
+		while (__atomic_load_n(&__frozen, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+}
+
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::endWrite(void)
+{
+	__sync_fetch_and_sub(&__writers, 1);
+}
+
+// claims a slot within probes of the hash of ptr
+template <typename T>
+inline T * TLockFreeMapMemoryInfo<T>::insertInTable(table_t &table, slot_t *slots, void *ptr, unsigned long probes)
+{
+	unsigned long index = hash(table, ptr);
+	for (unsigned long probe = 0; probe < probes; probe++) {
+		slot_t *slot = &slots[(index + probe) & (table.capacity - 1)];
+		void *key = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+		if ((key == LOCKFREE_MAP_KEY_EMPTY || key == LOCKFREE_MAP_KEY_RELEASED) &&
+			__sync_bool_compare_and_swap(&slot->ptr, key, ptr)) {
+			// finds must look at least that far
+			unsigned long maxProbe = __atomic_load_n(&table.maxProbe, __ATOMIC_RELAXED);
+			while (probe > maxProbe && !__sync_bool_compare_and_swap(&table.maxProbe, maxProbe, probe))
+				maxProbe = __atomic_load_n(&table.maxProbe, __ATOMIC_RELAXED);
+			return &slot->info;
+		}
+	}
+	return NULL;
+}
+
+template <typename T>
+inline T * TLockFreeMapMemoryInfo<T>::insert(void *ptr)
+{
+	beginInsert();
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		table_t &table = __tables[i];
+		slot_t *slots = __atomic_load_n(&table.slots, __ATOMIC_ACQUIRE);
+		if (slots == NULL && (slots = allocateTable(table)) == NULL)
+			break;
+		// the last table has no next one to go on to
+		unsigned long probes = table.capacity;
+		if (i + 1 < LOCKFREE_MAP_MAX_TABLES && probes > LOCKFREE_MAP_INSERT_PROBES)
+			probes = LOCKFREE_MAP_INSERT_PROBES;
+		T *pObject = insertInTable(table, slots, ptr, probes);
+		if (pObject != NULL) {
+			endInsert();
+			return pObject;
+		}
+	}
+	endInsert();
+
+	// all tables are full
+	__sync_fetch_and_add(&__overflows, 1);
+	return NULL;
+}
+
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::publish(T *pObject)
+{
+	slot_t *slot = reinterpret_cast<slot_t*>(pObject);
+	__atomic_store_n(&slot->state, (int)SLOT_LIVE, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+inline typename TLockFreeMapMemoryInfo<T>::slot_t * TLockFreeMapMemoryInfo<T>::findSlot(void *ptr)
+{
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		table_t &table = __tables[i];
+		slot_t *slots = __atomic_load_n(&table.slots, __ATOMIC_ACQUIRE);
+		if (slots == NULL)
+			break;
+
+		unsigned long index = hash(table, ptr);
+		unsigned long maxProbe = __atomic_load_n(&table.maxProbe, __ATOMIC_ACQUIRE);
+		for (unsigned long probe = 0; probe <= maxProbe; probe++) {
+			slot_t *slot = &slots[(index + probe) & (table.capacity - 1)];
+			void *key = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+			if (key == ptr)
+				return slot;
+			if (key == LOCKFREE_MAP_KEY_EMPTY)
+				break;
+		}
+	}
+
+	// not found
+	return NULL;
+}
+
+template <typename T>
+inline T * TLockFreeMapMemoryInfo<T>::find(void *ptr)
+{
+	slot_t *slot = findSlot(ptr);
+	return (slot != NULL) ? &slot->info : NULL;
+}
+
+// waits for the iteration or findAndPin() to unpin the slot, then
+// makes it BUSY if it still holds ptr (clearAllInfo may have
+// released it, and an insert reused it meanwhile)
+template <typename T>
+inline bool TLockFreeMapMemoryInfo<T>::lockSlot(slot_t *slot, void *ptr)
+{
+	for (;;) {
+		int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == SLOT_PINNED || state == SLOT_BUSY) {
+			sched_yield();
+			continue;
+		}
+		if (state != SLOT_LIVE)
+			return false;
+		if (__sync_bool_compare_and_swap(&slot->state, state, (int)SLOT_BUSY))
+			break;
+	}
+	if (__atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE) != ptr) {
+		__atomic_store_n(&slot->state, (int)SLOT_LIVE, __ATOMIC_RELEASE);
+		return false;
+	}
+	return true;
+}
+
+// the map can't be frozen until unpin()
+template <typename T>
+inline T * TLockFreeMapMemoryInfo<T>::findAndPin(void *ptr)
+{
+	beginWrite();
+	slot_t *slot = findSlot(ptr);
+	if (slot != NULL && lockSlot(slot, ptr))
+		return &slot->info;
+	endWrite();
+	return NULL;
+}
+
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::unpin(T *pObject)
+{
+	slot_t *slot = reinterpret_cast<slot_t*>(pObject);
+	__atomic_store_n(&slot->state, (int)SLOT_LIVE, __ATOMIC_RELEASE);
+	endWrite();
+}
+
+// State is FREE before the key is released, so that an insert
+// reusing the slot always finds it FREE
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::releaseSlot(slot_t *slot, void *ptr)
+{
+	if (!lockSlot(slot, ptr))
+		return;
+	__atomic_store_n(&slot->state, (int)SLOT_FREE, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->ptr, LOCKFREE_MAP_KEY_RELEASED, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+inline void TLockFreeMapMemoryInfo<T>::release(void *ptr)
+{
+	beginWrite();
+	slot_t *slot = findSlot(ptr);
+	if (slot != NULL)
+		releaseSlot(slot, ptr);
+	endWrite();
+}
+
+
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::beginIteration(void)
+{
+	__uiIterationTable = 0;
+	__ulIterationIndex = 0;
+	__pIterationPinned = NULL;
+}
+
+
+//---------------------------------
+// returns next pair (element, pointer) as output parameters
+// returns false if no more elements
+template <typename T>
+bool TLockFreeMapMemoryInfo<T>::getNextPair(T **ppObject, void **pptr)
+{
+	endIteration();
+
+	while (__uiIterationTable < LOCKFREE_MAP_MAX_TABLES) {
+		table_t &table = __tables[__uiIterationTable];
+		slot_t *slots = __atomic_load_n(&table.slots, __ATOMIC_ACQUIRE);
+		if (slots == NULL)
+			break;
+		if (__ulIterationIndex >= table.capacity) {
+			__uiIterationTable++;
+			__ulIterationIndex = 0;
+			continue;
+		}
+
+		slot_t *slot = &slots[__ulIterationIndex];
+		int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == SLOT_BUSY) {
+			// being released, or modified: it must not be missed
+			sched_yield();
+			continue;
+		}
+		if (state == SLOT_LIVE) {
+			if (!__sync_bool_compare_and_swap(&slot->state, (int)SLOT_LIVE, (int)SLOT_PINNED))
+				continue;
+			__ulIterationIndex++;
+			__pIterationPinned = slot;
+			*ppObject = &slot->info;
+			*pptr = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+			return true;
+		}
+		__ulIterationIndex++;
+	}
+
+	// reached the end of the tables
+	*ppObject = NULL;
+	*pptr = NULL;
+	return false;
+}
+
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::endIteration(void)
+{
+	if (__pIterationPinned != NULL) {
+		__atomic_store_n(&__pIterationPinned->state, (int)SLOT_LIVE, __ATOMIC_RELEASE);
+		__pIterationPinned = NULL;
+	}
+}
+
+// scans the tables, elements are not counted to keep the hooks
+// from updating a shared counter
+template <typename T>
+bool TLockFreeMapMemoryInfo<T>::empty(void)
+{
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		slot_t *slots = __atomic_load_n(&__tables[i].slots, __ATOMIC_ACQUIRE);
+		if (slots == NULL)
+			break;
+		for (unsigned long l = 0; l < __tables[i].capacity; l++) {
+			void *ptr = __atomic_load_n(&slots[l].ptr, __ATOMIC_ACQUIRE);
+			if (ptr != LOCKFREE_MAP_KEY_EMPTY && ptr != LOCKFREE_MAP_KEY_RELEASED)
+				return false;
+		}
+	}
+	return true;
+}
+
+
+// releases all elements, then cleans up their tombstones
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::clearAllInfo(void)
+{
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		slot_t *slots = __atomic_load_n(&__tables[i].slots, __ATOMIC_ACQUIRE);
+		if (slots == NULL)
+			break;
+		for (unsigned long l = 0; l < __tables[i].capacity; l++) {
+			void *ptr = __atomic_load_n(&slots[l].ptr, __ATOMIC_ACQUIRE);
+			if (ptr != LOCKFREE_MAP_KEY_EMPTY && ptr != LOCKFREE_MAP_KEY_RELEASED)
+				releaseSlot(&slots[l], ptr);
+		}
+	}
+	cleanUp();
+}
+
+
+template <typename T>
+size_t TLockFreeMapMemoryInfo<T>::getMemoryUsage(void)
+{
+	size_t bytes = 0;
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		if (__atomic_load_n(&__tables[i].slots, __ATOMIC_ACQUIRE) == NULL)
+			break;
+		bytes += __tables[i].capacity * sizeof(slot_t);
+	}
+	return bytes;
+}
+
+
+//---------------------------------
+// Inserts are the only operations using tombstones or never used
+// slots, they wait while the tables are cleaned up (no table is
+// allocated meanwhile): as no live element moves, finds and
+// releases keep running.
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::cleanUp(void)
+{
+	if (__atomic_load_n(&__tables[0].slots, __ATOMIC_ACQUIRE) == NULL)
+		return;
+
+	__atomic_store_n(&__cleaningUp, true, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&__inserters, __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+
+	for (unsigned int i = 0; i < LOCKFREE_MAP_MAX_TABLES; i++) {
+		slot_t *slots = __atomic_load_n(&__tables[i].slots, __ATOMIC_ACQUIRE);
+		if (slots == NULL)
+			break;
+		cleanUpTable(__tables[i], slots);
+	}
+
+	__atomic_store_n(&__cleaningUp, false, __ATOMIC_SEQ_CST);
+}
+
+// no iteration may run meanwhile, a release waiting for its pinned
+// element would never end
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::freeze(void)
+{
+	__atomic_store_n(&__frozen, true, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&__inserters, __ATOMIC_SEQ_CST) != 0 || __atomic_load_n(&__writers, __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+}
+
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::thaw(void)
+{
+	__atomic_store_n(&__frozen, false, __ATOMIC_SEQ_CST);
+}
+
+// A tombstone followed by a never used slot is on no probe
+// sequence of a live element (all slots between the hash and the
+// element of a probe are used), so it can be made "never used",
+// and so on backwards.
+// The longest probe is then the one of the live elements.
+template <typename T>
+void TLockFreeMapMemoryInfo<T>::cleanUpTable(table_t &table, slot_t *slots)
+{
+	// walks backwards from a never used slot, all around
+	unsigned long mask = table.capacity - 1;
+	unsigned long end = 0;
+	while (end < table.capacity && __atomic_load_n(&slots[end].ptr, __ATOMIC_ACQUIRE) != LOCKFREE_MAP_KEY_EMPTY)
+		end++;
+	if (end < table.capacity) {
+		bool nextEmpty = true;
+		for (unsigned long l = 1; l < table.capacity; l++) {
+			slot_t *slot = &slots[(end - l) & mask];
+			void *ptr = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+			if (ptr == LOCKFREE_MAP_KEY_RELEASED && nextEmpty) {
+				__atomic_store_n(&slot->ptr, LOCKFREE_MAP_KEY_EMPTY, __ATOMIC_RELEASE);
+				ptr = LOCKFREE_MAP_KEY_EMPTY;
+			}
+			nextEmpty = (ptr == LOCKFREE_MAP_KEY_EMPTY);
+		}
+	}
+
+	unsigned long maxProbe = 0;
+	for (unsigned long l = 0; l < table.capacity; l++) {
+		void *ptr = __atomic_load_n(&slots[l].ptr, __ATOMIC_ACQUIRE);
+		if (ptr != LOCKFREE_MAP_KEY_EMPTY && ptr != LOCKFREE_MAP_KEY_RELEASED && ((l - hash(table, ptr)) & mask) > maxProbe)
+			maxProbe = (l - hash(table, ptr)) & mask;
+	}
+	__atomic_store_n(&table.maxProbe, maxProbe, __ATOMIC_RELEASE);
+	table.maxProbeAfterCleanUp = maxProbe;
+}
+
+
+}  // end namespace
+
+
+#endif  // include once
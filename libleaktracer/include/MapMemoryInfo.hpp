@@ -14,7 +14,9 @@
 #ifndef __MAP_MEMORY_INFO_h_included__
 #define __MAP_MEMORY_INFO_h_included__
 
-#include "ObjectsPool.hpp"
+#include <stdint.h>
+#include "ThreadCachingObjectsPool.hpp"
+#include "PointerHash.hpp"
 
 
 namespace leaktracer {
@@ -23,60 +25,145 @@ namespace leaktracer {
  * Help class, holds all relevant information for each
  * allocation (logically it's a map of void* address to
  * structure with required info)
+ *
+ * The number of lists follows the number of elements: the map
+ * grows when there is more than one element per list, and
+ * shrinks below one element for 8 lists. Elements are moved to
+ * the new lists a few lists at a time, by each insert and
+ * release, so no single call pays for the whole rehash.
+ *
+ * Non-empty lists are marked in a two-level bitmap (a bit per
+ * list, and a bit per non-zero bitmap word), so that iteration,
+ * clearAllInfo() and rehash only visit non-empty lists, skipping
+ * 64 (or 4096) empty lists per word. release() leaves the bit of
+ * a list it empties, the next scan clears it.
+ *
+ * Elements are also linked in insertion order, so that the newest
+ * ones can be iterated over without visiting the others.
  */
 template <typename T>
 class TMapMemoryInfo {
 public:
 	TMapMemoryInfo(void);
-	virtual ~TMapMemoryInfo(void) {}
+	virtual ~TMapMemoryInfo(void);
 
 	/** Allocates sizeof(T) buffer, and associates it with given
 	 *  poiter */
 	inline T * insert(void *ptr);
 
+	/** Elements are seen as soon as inserted, under the lock of
+	 *  the caller (same interface as TLockFreeMapMemoryInfo) */
+	inline void publish(T *) {}
+
 	/** Returns pointer to T object, associated with given pointer */
 	inline T * find(void *ptr);
 
+	/** Same as find(), the element is modified under the lock
+	 *  of the caller, which keeps others from reading it (same
+	 *  interface as TLockFreeMapMemoryInfo) */
+	inline T * findAndPin(void *ptr) { return find(ptr); }
+	inline void unpin(T *) {}
+
 	/** Releases a buffer, associated with given pointer. */
 	inline void release(void *ptr);
 
 	/** Following 2 functions used for iteration over all
-	 *  elements */
+	 *  elements, the map must not be modified meanwhile */
 	void beginIteration(void);
 	bool getNextPair(T **ppObject, void **pptr);
+	/** nothing is pinned (same interface as TLockFreeMapMemoryInfo) */
+	inline void endIteration(void) {}
+
+	/** Same, from the newest element to the oldest one */
+	void beginNewestIteration(void);
+	bool getNextOlderPair(T **ppObject, void **pptr);
 	bool empty(void);
 
 	void clearAllInfo(void);
 
-private:
-	// hash function from pointer to int (range is defined by POINTER_HASH_LENGTH static)
-	inline unsigned long hash(void *ptr);
+	/** bytes allocated for the lists, the nodes are counted by
+	 *  their pool. May be called without locking the map, while
+	 *  it grows: the result is then approximate */
+	size_t getMemoryUsage(void);
 
+private:
 	// defines single pointer's info
 	typedef struct _pointer_info_struct {
 		void *ptr;
 		T info;
 	} pointer_info_t;
 
-	// list node - to hold list of all info's having same hash value
+	// list node - to hold list of all info's having same hash value,
+	// and linked to the nodes inserted just before and after it
 	typedef struct _list_node_struct {
 		pointer_info_t pinfo;
 		struct _list_node_struct *next;
+		struct _list_node_struct *older;
+		struct _list_node_struct *newer;
 	} list_node_t;
 
-	// array of lists (according to hash function)
-#define POINTER_HASH_LENGTH				16
-#define NUMBER_OF_MEMORY_INFO_LISTS		(1 << POINTER_HASH_LENGTH)
-	list_node_t * __info_lists[NUMBER_OF_MEMORY_INFO_LISTS];
+	// array of lists (according to hash function),
+	// numOfLists is a power of 2, at least 64. Bit i of
+	// bitmap is set when list i is not empty, bit i of
+	// summary when bitmap word i is not zero. All three are
+	// allocated together.
+	typedef struct _lists_table_struct {
+		list_node_t **lists;
+		uint64_t *bitmap;
+		uint64_t *summary;
+		unsigned long numOfLists;
+	} lists_table_t;
+
+	static bool allocateLists(lists_table_t &table, unsigned long numOfLists);
+	static void freeLists(lists_table_t &table);
+	static inline void markNonEmpty(lists_table_t &table, unsigned long index);
+	static inline void markEmpty(lists_table_t &table, unsigned long index);
+	static inline unsigned long nextMarked(const lists_table_t &table, unsigned long index);
+	static inline unsigned long nextNonEmpty(lists_table_t &table, unsigned long index);
+
+#define MIN_NUMBER_OF_MEMORY_INFO_LISTS		(1 << 6)
+	// number of non-empty lists moved by each rehash step
+#define MEMORY_INFO_REHASH_STEP				4
+
+	// while rehashing, lists of __tables[0] from __lRehashIndex
+	// are still to be moved to __tables[1], new elements go to
+	// __tables[1]
+	lists_table_t __tables[2];
+	long __lRehashIndex;		// -1 when not rehashing
+	unsigned long __count;
+	list_node_t *__pNewest;		// end of insertion order
+
+	// hash function from pointer to list index in table
+	inline unsigned long hash(void *ptr, const lists_table_t &table)
+	{ return (unsigned long)hashPointer(ptr) & (table.numOfLists - 1); }
+
+	inline bool rehashing(void) { return __lRehashIndex >= 0; }
+	inline list_node_t ** findLink(void *ptr);
+	inline void rehashStep(void);
+	inline void checkNumOfLists(void);
+	void startRehash(unsigned long numOfLists);
+	void endRehash(void);
 
-	// memory allocation - using a pool
+public:
+	// memory allocation - using a pool shared by several maps,
+	// each pool holds a pthread key for its thread caches
 #define DEFAULT_NUMBER_OF_ELEMENTS_IN_CHUNK (1 << 12)
-	typedef TObjectsPool<list_node_t, DEFAULT_NUMBER_OF_ELEMENTS_IN_CHUNK> nodes_pool_t;
-	nodes_pool_t __pool;
+	typedef TThreadCachingObjectsPool<list_node_t, DEFAULT_NUMBER_OF_ELEMENTS_IN_CHUNK,
+		TMmapChunkAllocator< t_list_element<list_node_t>, DEFAULT_NUMBER_OF_ELEMENTS_IN_CHUNK > > nodes_pool_t;
+
+	/** sets the pool of the nodes, must be called before the
+	 *  first insert (maps are members of arrays, so the pool
+	 *  can't be a constructor argument) */
+	void setNodesPool(nodes_pool_t *pool) { __pool = pool; }
+
+private:
+	nodes_pool_t *__pool;
 
 	// current position in iteration
+	int __iIterationTable;
 	long __lIterationCurrentListIndex;
 	list_node_t *__pIterationCurrentElement;
+	list_node_t *__pIterationOlderElement;
 };
 
 
@@ -90,45 +177,142 @@ private:
 template <typename T>
 TMapMemoryInfo<T>::TMapMemoryInfo(void)
 {
-	// initializes all lists to be empty
-	for( int i = 0; i < NUMBER_OF_MEMORY_INFO_LISTS; i++ )
-		__info_lists[i] = NULL;
+	// lists are allocated on first insert
+	for (int i = 0; i < 2; i++) {
+		__tables[i].lists = NULL;
+		freeLists(__tables[i]);
+	}
+	__lRehashIndex = -1;
+	__count = 0;
+	__pNewest = NULL;
+	__pool = NULL;
 
 	// members used for iteration
+	__iIterationTable = 0;
 	__lIterationCurrentListIndex = -1;
 	__pIterationCurrentElement = NULL;
+	__pIterationOlderElement = NULL;
 }
 
 template <typename T>
-inline unsigned long TMapMemoryInfo<T>::hash(void *ptr)
-{ return (reinterpret_cast<unsigned long>(ptr) & (NUMBER_OF_MEMORY_INFO_LISTS - 1)); }
+TMapMemoryInfo<T>::~TMapMemoryInfo(void)
+{
+	for (int i = 0; i < 2; i++)
+		freeLists(__tables[i]);
+}
+
 
 template <typename T>
-inline T * TMapMemoryInfo<T>::insert(void *ptr)
+bool TMapMemoryInfo<T>::allocateLists(lists_table_t &table, unsigned long numOfLists)
 {
-	list_node_t * pNew = static_cast<list_node_t*>(__pool.allocate());
-	if( !pNew )
-		return NULL;
+	unsigned long numOfWords = numOfLists / 64;
+	unsigned long numOfSummaryWords = (numOfWords + 63) / 64;
+	char *memory = static_cast<char*>(LT_CALLOC(1, numOfLists * sizeof(list_node_t*) +
+		(numOfWords + numOfSummaryWords) * sizeof(uint64_t)));
+	if (memory == NULL)
+		return false;
+
+	table.lists = reinterpret_cast<list_node_t**>(memory);
+	table.bitmap = reinterpret_cast<uint64_t*>(memory + numOfLists * sizeof(list_node_t*));
+	table.summary = table.bitmap + numOfWords;
+	table.numOfLists = numOfLists;
+	return true;
+}
 
-	// insert to the "hash(ptr)" list
-	long key = hash(ptr);
-	pNew->next = __info_lists[key];
-	__info_lists[key] = pNew;
 
-	(pNew->pinfo).ptr = ptr;
-	return &((pNew->pinfo).info);
+// may be called on a table already freed
+template <typename T>
+void TMapMemoryInfo<T>::freeLists(lists_table_t &table)
+{
+	if (table.lists != NULL)
+		LT_FREE(table.lists);
+	table.lists = NULL;
+	table.bitmap = NULL;
+	table.summary = NULL;
+	table.numOfLists = 0;
 }
 
 
 template <typename T>
-inline T * TMapMemoryInfo<T>::find(void *ptr)
+inline void TMapMemoryInfo<T>::markNonEmpty(lists_table_t &table, unsigned long index)
 {
-	list_node_t * pNext = __info_lists[hash(ptr)];
-	while( pNext != NULL )
-	{
-		if( (pNext->pinfo).ptr == ptr )
-			return &((pNext->pinfo).info);
-		pNext = pNext->next;
+	uint64_t &word = table.bitmap[index >> 6];
+	if (word == 0)
+		table.summary[index >> 12] |= (uint64_t)1 << ((index >> 6) & 63);
+	word |= (uint64_t)1 << (index & 63);
+}
+
+
+template <typename T>
+inline void TMapMemoryInfo<T>::markEmpty(lists_table_t &table, unsigned long index)
+{
+	uint64_t &word = table.bitmap[index >> 6];
+	word &= ~((uint64_t)1 << (index & 63));
+	if (word == 0)
+		table.summary[index >> 12] &= ~((uint64_t)1 << ((index >> 6) & 63));
+}
+
+
+// returns the index of the first list marked non-empty from
+// index, numOfLists if none
+template <typename T>
+inline unsigned long TMapMemoryInfo<T>::nextMarked(const lists_table_t &table, unsigned long index)
+{
+	if (index >= table.numOfLists)
+		return table.numOfLists;
+
+	// rest of the word of index
+	uint64_t word = table.bitmap[index >> 6] & (~(uint64_t)0 << (index & 63));
+	if (word != 0)
+		return (index & ~63UL) + __builtin_ctzll(word);
+
+	// next non-zero word, found in the summary
+	unsigned long numOfWords = table.numOfLists / 64;
+	for (unsigned long iWord = (index >> 6) + 1; iWord < numOfWords; ) {
+		uint64_t summary = table.summary[iWord >> 6] & (~(uint64_t)0 << (iWord & 63));
+		if (summary == 0) {
+			iWord = (iWord & ~63UL) + 64;
+			continue;
+		}
+		iWord = (iWord & ~63UL) + __builtin_ctzll(summary);
+		return (iWord << 6) + __builtin_ctzll(table.bitmap[iWord]);
+	}
+	return table.numOfLists;
+}
+
+
+// returns the index of the first non-empty list from index,
+// numOfLists if none, clearing the marks of lists emptied
+// by release() on the way
+template <typename T>
+inline unsigned long TMapMemoryInfo<T>::nextNonEmpty(lists_table_t &table, unsigned long index)
+{
+	for (;;) {
+		index = nextMarked(table, index);
+		if (index >= table.numOfLists || table.lists[index] != NULL)
+			return index;
+		markEmpty(table, index);
+		index++;
+	}
+}
+
+
+// returns the link (list head or "next" member of previous node)
+// pointing to the node of ptr, or NULL if not found
+template <typename T>
+inline typename TMapMemoryInfo<T>::list_node_t ** TMapMemoryInfo<T>::findLink(void *ptr)
+{
+	for (int i = 0; i < 2; i++) {
+		lists_table_t &table = __tables[i];
+		if (table.lists == NULL)
+			continue;
+
+		list_node_t **ppLink = &table.lists[hash(ptr, table)];
+		while (*ppLink != NULL) {
+			if( ((*ppLink)->pinfo).ptr == ptr )
+				return ppLink;
+			ppLink = &((*ppLink)->next);
+		}
 	}
 
 	// not found
@@ -136,46 +320,155 @@ inline T * TMapMemoryInfo<T>::find(void *ptr)
 }
 
 
+// moves a few lists of the old table to the new one
 template <typename T>
-inline void TMapMemoryInfo<T>::release(void *ptr)
+inline void TMapMemoryInfo<T>::rehashStep(void)
 {
-	long key = hash(ptr);
-	list_node_t * pNext = __info_lists[key];
-	if( NULL == pNext )
-		// list is empty
-		return;
-
-	if( (pNext->pinfo).ptr == ptr )
-	{
-		// found: is a first element
-		__info_lists[key] = pNext->next;
-		__pool.release(pNext);
-		return;
+	lists_table_t &oldTable = __tables[0];
+	lists_table_t &newTable = __tables[1];
+
+	for (int iMoved = 0; iMoved < MEMORY_INFO_REHASH_STEP; iMoved++) {
+		__lRehashIndex = nextNonEmpty(oldTable, __lRehashIndex);
+		if ((unsigned long)__lRehashIndex >= oldTable.numOfLists)
+			break;
+
+		list_node_t *pNode = oldTable.lists[__lRehashIndex];
+		while (pNode != NULL) {
+			list_node_t *pNext = pNode->next;
+			unsigned long key = hash((pNode->pinfo).ptr, newTable);
+			pNode->next = newTable.lists[key];
+			newTable.lists[key] = pNode;
+			if (pNode->next == NULL)
+				markNonEmpty(newTable, key);
+			pNode = pNext;
+		}
+		oldTable.lists[__lRehashIndex] = NULL;
+		markEmpty(oldTable, __lRehashIndex);
+		__lRehashIndex++;
 	}
 
-	// searching in other elements
-	list_node_t * pPrev = pNext;
-	pNext = pNext->next;
+	if ((unsigned long)__lRehashIndex >= oldTable.numOfLists)
+		endRehash();
+}
 
-	while( pNext != NULL)
-	{
-		if( (pNext->pinfo).ptr == ptr )
-		{
-			pPrev->next = pNext->next;
-			__pool.release( pNext );
-			return;
-		}
-		pPrev = pNext;
-		pNext = pNext->next;
+
+// starts a rehash if the number of lists doesn't fit the
+// number of elements anymore
+template <typename T>
+inline void TMapMemoryInfo<T>::checkNumOfLists(void)
+{
+	unsigned long numOfLists = __tables[0].numOfLists;
+
+	if (__count > numOfLists) {
+		startRehash(numOfLists * 2);
+	} else if (numOfLists > MIN_NUMBER_OF_MEMORY_INFO_LISTS && __count < numOfLists / 8) {
+		unsigned long newNumOfLists = MIN_NUMBER_OF_MEMORY_INFO_LISTS;
+		while (newNumOfLists < __count * 2)
+			newNumOfLists *= 2;
+		startRehash(newNumOfLists);
 	}
 }
 
 
+template <typename T>
+void TMapMemoryInfo<T>::startRehash(unsigned long numOfLists)
+{
+	if (!allocateLists(__tables[1], numOfLists))
+		// keep the current lists, it is just slower
+		return;
+	__lRehashIndex = 0;
+}
+
+
+template <typename T>
+void TMapMemoryInfo<T>::endRehash(void)
+{
+	freeLists(__tables[0]);
+	__tables[0] = __tables[1];
+	__tables[1].lists = NULL;
+	__tables[1].bitmap = NULL;
+	__tables[1].summary = NULL;
+	__tables[1].numOfLists = 0;
+	__lRehashIndex = -1;
+}
+
+
+template <typename T>
+inline T * TMapMemoryInfo<T>::insert(void *ptr)
+{
+	if (__tables[0].lists == NULL && !allocateLists(__tables[0], MIN_NUMBER_OF_MEMORY_INFO_LISTS))
+		return NULL;
+
+	list_node_t * pNew = static_cast<list_node_t*>(__pool->allocate());
+	if( !pNew )
+		return NULL;
+
+	(pNew->pinfo).ptr = ptr;
+
+	// insert to the "hash(ptr)" list of the newest table
+	lists_table_t &table = rehashing() ? __tables[1] : __tables[0];
+	unsigned long key = hash(ptr, table);
+	pNew->next = table.lists[key];
+	table.lists[key] = pNew;
+	if (pNew->next == NULL)
+		markNonEmpty(table, key);
+	pNew->older = __pNewest;
+	pNew->newer = NULL;
+	if (__pNewest != NULL)
+		__pNewest->newer = pNew;
+	__pNewest = pNew;
+	__count++;
+
+	if (rehashing())
+		rehashStep();
+	else
+		checkNumOfLists();
+
+	return &((pNew->pinfo).info);
+}
+
+
+template <typename T>
+inline T * TMapMemoryInfo<T>::find(void *ptr)
+{
+	list_node_t **ppLink = findLink(ptr);
+	if (ppLink == NULL)
+		return NULL;
+	return &(((*ppLink)->pinfo).info);
+}
+
+
+template <typename T>
+inline void TMapMemoryInfo<T>::release(void *ptr)
+{
+	list_node_t **ppLink = findLink(ptr);
+	if (ppLink == NULL)
+		return;
+
+	list_node_t *pNode = *ppLink;
+	*ppLink = pNode->next;
+	if (pNode->older != NULL)
+		pNode->older->newer = pNode->newer;
+	if (pNode->newer != NULL)
+		pNode->newer->older = pNode->older;
+	else
+		__pNewest = pNode->older;
+	__pool->release(pNode);
+	__count--;
+
+	if (rehashing())
+		rehashStep();
+	else
+		checkNumOfLists();
+}
+
+
 template <typename T>
 void TMapMemoryInfo<T>::beginIteration(void)
 {
-	__lIterationCurrentListIndex = 0;
-	__pIterationCurrentElement = __info_lists[0];
+	__iIterationTable = 0;
+	__lIterationCurrentListIndex = -1;
+	__pIterationCurrentElement = NULL;
 }
 
 
@@ -185,24 +478,26 @@ void TMapMemoryInfo<T>::beginIteration(void)
 template <typename T>
 bool TMapMemoryInfo<T>::getNextPair(T **ppObject, void **pptr)
 {
-	if( NULL == __pIterationCurrentElement )
+	while( NULL == __pIterationCurrentElement )
 	{
-		// current list ended, should find next non-empty list
-		while (__lIterationCurrentListIndex < NUMBER_OF_MEMORY_INFO_LISTS &&
-			   NULL == __pIterationCurrentElement)
+		// current list ended, should find next non-empty list,
+		// in the old then in the new table
+		__lIterationCurrentListIndex = nextNonEmpty(__tables[__iIterationTable], __lIterationCurrentListIndex + 1);
+		if ((unsigned long)__lIterationCurrentListIndex >= __tables[__iIterationTable].numOfLists)
 		{
-			__lIterationCurrentListIndex ++;
-			__pIterationCurrentElement = __info_lists[__lIterationCurrentListIndex];
+			if (__iIterationTable == 1 || !rehashing())
+			{
+				// reached the end of the lists
+				*ppObject = NULL;
+				*pptr = NULL;
+				return false;
+			}
+			__iIterationTable = 1;
+			__lIterationCurrentListIndex = nextNonEmpty(__tables[1], 0);
+			if ((unsigned long)__lIterationCurrentListIndex >= __tables[1].numOfLists)
+				continue;
 		}
-
-		if (__lIterationCurrentListIndex == NUMBER_OF_MEMORY_INFO_LISTS)
-		{
-			// reached the end of the lists
-			*ppObject = NULL;
-			*pptr = NULL;
-			return false;
-		}
-
+		__pIterationCurrentElement = __tables[__iIterationTable].lists[__lIterationCurrentListIndex];
 	}
 
 	*ppObject = &(__pIterationCurrentElement->pinfo.info);
@@ -215,29 +510,66 @@ bool TMapMemoryInfo<T>::getNextPair(T **ppObject, void **pptr)
 }
 
 template <typename T>
-bool TMapMemoryInfo<T>::empty(void)
+void TMapMemoryInfo<T>::beginNewestIteration(void)
 {
-	for (long l = 0; l < NUMBER_OF_MEMORY_INFO_LISTS; l++) {
-		list_node_t * pNext = __info_lists[l];
-		if (pNext != NULL){
-			return false;
-		}
+	__pIterationOlderElement = __pNewest;
+}
+
+
+template <typename T>
+bool TMapMemoryInfo<T>::getNextOlderPair(T **ppObject, void **pptr)
+{
+	if (__pIterationOlderElement == NULL) {
+		*ppObject = NULL;
+		*pptr = NULL;
+		return false;
 	}
+
+	*ppObject = &(__pIterationOlderElement->pinfo.info);
+	*pptr = __pIterationOlderElement->pinfo.ptr;
+	__pIterationOlderElement = __pIterationOlderElement->older;
 	return true;
 }
 
+template <typename T>
+bool TMapMemoryInfo<T>::empty(void)
+{
+	return __count == 0;
+}
 
+
+// releases all elements, and the lists, which may have grown big
 template <typename T>
 void TMapMemoryInfo<T>::clearAllInfo(void)
 {
-	for (long l = 0; l < NUMBER_OF_MEMORY_INFO_LISTS; l++) {
-		list_node_t * pNext = __info_lists[l];
-		while (pNext != NULL) {
-			__info_lists[l] = pNext->next;
-			__pool.release(pNext);
-			pNext = __info_lists[l];
+	for (int i = 0; i < 2; i++) {
+		lists_table_t &table = __tables[i];
+		for (unsigned long l = nextNonEmpty(table, 0); l < table.numOfLists; l = nextNonEmpty(table, l + 1)) {
+			list_node_t * pNext = table.lists[l];
+			while (pNext != NULL) {
+				table.lists[l] = pNext->next;
+				__pool->release(pNext);
+				pNext = table.lists[l];
+			}
 		}
+		freeLists(table);
+	}
+	__lRehashIndex = -1;
+	__count = 0;
+	__pNewest = NULL;
+}
+
+
+template <typename T>
+size_t TMapMemoryInfo<T>::getMemoryUsage(void)
+{
+	size_t bytes = 0;
+	for (int i = 0; i < 2; i++) {
+		unsigned long numOfLists = __atomic_load_n(&__tables[i].numOfLists, __ATOMIC_RELAXED);
+		unsigned long numOfWords = numOfLists / 64;
+		bytes += numOfLists * sizeof(list_node_t*) + (numOfWords + (numOfWords + 63) / 64) * sizeof(uint64_t);
 	}
+	return bytes;
 }
 
 
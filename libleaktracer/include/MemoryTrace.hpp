@@ -15,6 +15,7 @@
 #define __MEMORY_TRACE_h_included__
 
 #include <time.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
@@ -29,6 +30,16 @@
 #include "Mutex.hpp"
 #include "MutexLock.hpp"
 #include "MapMemoryInfo.hpp"
+#include "LockFreeMapMemoryInfo.hpp"
+#include "EventBuffer.hpp"
+#include "StackTable.hpp"
+#include "StackUnwinder.hpp"
+#include "AddressFilter.hpp"
+#include "ModuleTable.hpp"
+#include "PprofWriter.hpp"
+#include "ControlChannel.hpp"
+#include "LatencyHistogram.hpp"
+#include "leaktracer_report.h"
 
 
 /////////////////////////////////////////////////////////////
@@ -39,21 +50,90 @@
 //              Otherwise should be explicetly activated
 //              default: OFF
 //
-// ALLOCATION_STACK_DEPTH - max number of stack frame to
-//              save. Max supported value: 10
+// ALLOCATION_STACK_DEPTH - default number of stack frames to
+//              save, LEAKTRACER_STACK_DEPTH sets it at runtime.
+//              Each distinct stack is saved once (see StackTable)
+//
+// MAX_ALLOCATION_STACK_DEPTH - max number of stack frames to
+//              save. Without USE_BACKTRACE and frame pointer
+//              unwinder, at most 10 frames are saved.
+//              default: 64
 //
 // PRINTED_DATA_BUFFER_SIZE - size of the data buffer to be printed
 //              for each allocation.
 //
+// ALLOCATION_MAP_SHARD_BITS - the allocation map is split in
+//              (1 << ALLOCATION_MAP_SHARD_BITS) independently
+//              locked shards, selected by address.
+//              default: 4 (16 shards)
+//
+// EVENT_SEQUENCE_DOMAIN_BITS - with LEAKTRACER_EVENT_BUFFER_SIZE,
+//              buffered events are applied in the order they were
+//              queued within each of (1 << EVENT_SEQUENCE_DOMAIN_BITS)
+//              domains selected by address, each one inside a shard.
+//              A thread with a full buffer applies by itself its
+//              events which are the next ones of their domain.
+//              default: 12
+//
+// SAMPLED_ADDRESS_FILTER_BITS - with LEAKTRACER_SAMPLE_BYTES, releases
+//              are checked against a filter of (1 << bits) counters
+//              of sampled addresses before looking up the map.
+//              default: 20
+//
+// USE_TLS - per-thread data (internal disabler, options) is kept
+//              in initial-exec __thread variables instead of
+//              pthread_getspecific/pthread_setspecific.
+//              default: OFF (Makefile turns it ON)
+//
+// USE_LOCKFREE_MAP - shards are lock-free open-addressing tables
+//              (TLockFreeMapMemoryInfo) growing by chained tables,
+//              allocation hooks never lock them. "make
+//              runtests-lockfree" runs the tests with it.
+//              default: OFF
+//
+// LEAKTRACER_HOOK_HISTOGRAMS - the allocation hooks measure how long
+//              they spend in the real allocation function, waiting
+//              for the shard lock, capturing the stack and updating
+//              the map, in per-thread histograms (see
+//              writeHookHistograms).
+//              default: OFF
+//
 /////////////////////////////////////////////////////////////
 
 #ifndef ALLOCATION_STACK_DEPTH
 #	define ALLOCATION_STACK_DEPTH 5
 #endif
 
+#ifndef MAX_ALLOCATION_STACK_DEPTH
+#	define MAX_ALLOCATION_STACK_DEPTH 64
+#endif
+
 #ifndef PRINTED_DATA_BUFFER_SIZE
 #	define PRINTED_DATA_BUFFER_SIZE 50
 #endif
+
+#ifndef ALLOCATION_MAP_SHARD_BITS
+#	define ALLOCATION_MAP_SHARD_BITS 4
+#endif
+#define ALLOCATION_MAP_SHARDS (1 << ALLOCATION_MAP_SHARD_BITS)
+
+#ifndef EVENT_SEQUENCE_DOMAIN_BITS
+#	define EVENT_SEQUENCE_DOMAIN_BITS 12
+#endif
+#if EVENT_SEQUENCE_DOMAIN_BITS < ALLOCATION_MAP_SHARD_BITS || EVENT_SEQUENCE_DOMAIN_BITS > 16
+#	error EVENT_SEQUENCE_DOMAIN_BITS must be between ALLOCATION_MAP_SHARD_BITS and 16
+#endif
+#define EVENT_SEQUENCE_DOMAINS (1 << EVENT_SEQUENCE_DOMAIN_BITS)
+
+#ifndef SAMPLED_ADDRESS_FILTER_BITS
+#	define SAMPLED_ADDRESS_FILTER_BITS 20
+#endif
+
+// the time stamp counter can be read (rdtsc) on these,
+// see LEAKTRACER_TIMESTAMP
+#if defined(__x86_64__) || defined(__i386__)
+#	define LEAKTRACER_TSC_TIMESTAMP
+#endif
 #include "LeakTracer_l.hpp"
 
 
@@ -70,7 +150,12 @@ public:
 	inline static MemoryTrace & GetInstance(void);
 
 	/** setup undelying libc malloc/free... */
-	static int Setup(void);
+	inline static int Setup(void) {
+		// once setup is done, a single load
+		if (__builtin_expect(__atomic_load_n(&__setupDone, __ATOMIC_ACQUIRE), true))
+			return 0;
+		return SetupSlowPath();
+	}
 
 	/** starts monitoring memory allocations in all threads */
 	inline void startMonitoringAllThreads(void);
@@ -100,12 +185,125 @@ public:
 	/** writes report with all memory leaks */
 	void writeLeaks(std::ostream &out);
 
-	/** writes report with all memory leaks */
+	/** writes report with memory leaks allocated in generations
+	 *  firstGeneration to lastGeneration (see markGeneration) */
+	void writeLeaks(std::ostream &out, uint32_t firstGeneration, uint32_t lastGeneration);
+
+	/** writes report with all memory leaks, in the format set by
+	 *  LEAKTRACER_REPORT_FORMAT, from a snapshot if
+	 *  LEAKTRACER_REPORT_SNAPSHOT is set */
 	void writeLeaksToFile(const char* reportFileName);
 
+	/** same, with memory leaks allocated in generations
+	 *  firstGeneration to lastGeneration only */
+	void writeLeaksToFile(const char* reportFileName, uint32_t firstGeneration, uint32_t lastGeneration);
+
+	/** writes binary report with all memory leaks (see
+	 *  leaktracer_report.h), from a snapshot if
+	 *  LEAKTRACER_REPORT_SNAPSHOT is set */
+	void writeLeaksToBinaryFile(const char* reportFileName);
+
+	/** writes all memory leaks as a pprof profile (gzipped
+	 *  profile.proto), from a snapshot if
+	 *  LEAKTRACER_REPORT_SNAPSHOT is set */
+	void writeLeaksToPprofFile(const char* reportFileName);
+
+	/** writes report of memory leaks aggregated by call stack,
+	 *  biggest first, only the top ones if top is not 0 */
+	void writeAggregatedLeaks(std::ostream &out, unsigned long top);
+
+	/** writes aggregated report to given file, from a snapshot if
+	 *  LEAKTRACER_REPORT_SNAPSHOT is set */
+	void writeAggregatedLeaksToFile(const char* reportFileName, unsigned long top);
+
+	/** writes the heap profile: allocations live and made so far,
+	 *  by call stack, biggest live bytes first, only the top ones
+	 *  if top is not 0. Needs LEAKTRACER_HEAP_PROFILE, takes time
+	 *  proportional to the number of stacks, not of allocations */
+	void writeHeapProfile(std::ostream &out, unsigned long top);
+
+	/** writes the heap profile to given file */
+	void writeHeapProfileToFile(const char* reportFileName, unsigned long top);
+
+	/** starts a new generation of allocations, and returns its
+	 *  number: allocations made from now on are stamped with it,
+	 *  so that reports can be restricted to them. Allocations
+	 *  made before the first call are in generation 0 */
+	uint32_t markGeneration(void);
+
+	/** returns the generation of allocations made now */
+	uint32_t getGeneration(void) { return __atomic_load_n(&__generation, __ATOMIC_RELAXED); }
+
+	/** returns how long (in ns) allocations were stalled for the
+	 *  last snapshot report, 0 if none was written */
+	uint64_t getLastSnapshotStall(void) { return __atomic_load_n(&__lastSnapshotStall, __ATOMIC_RELAXED); }
+
+	/** changes the sampling rate (see LEAKTRACER_SAMPLE_BYTES).
+	 *  Sampling can't be started nor stopped while running, as
+	 *  releases of blocks tracked before would be missed: returns
+	 *  false if LEAKTRACER_SAMPLE_BYTES was not set, or if
+	 *  sampleBytes is 0 */
+	bool setSampleBytes(size_t sampleBytes);
+
+	/** writes the state of LeakTracer, one "name=value" per line */
+	void writeStats(std::ostream &out);
+
+	/** allocation statistics, see getStats(). Tracked operations
+	 *  are those recorded in the allocation map (monitored, and
+	 *  sampled with LEAKTRACER_SAMPLE_BYTES), a reallocation in
+	 *  place counts as a release and an allocation */
+	typedef struct {
+		uint64_t allocations;
+		uint64_t releases;
+		uint64_t allocatedBytes;
+		uint64_t releasedBytes;		// of tracked blocks, others' size is unknown
+		uint64_t trackedAllocations;
+		uint64_t trackedReleases;
+		uint64_t untrackedAllocations;
+		uint64_t untrackedReleases;
+		uint64_t liveBlocks;		// in the map: leaks, if reported now
+		uint64_t liveBytes;
+		uint64_t metadataBytes;		// used by LeakTracer for them
+		uint64_t mapOverflows;		// allocations not tracked, map was full
+	} stats_t;
+
+	/** sums the per-thread counters of the hooks, in time
+	 *  proportional to the number of threads, not of allocations.
+	 *  Allocations are not locked: operations still queued in
+	 *  event buffers are not counted as tracked yet, and the
+	 *  memory used by the maps is approximate */
+	void getStats(stats_t &stats);
+
+	/** current time of the hook histograms: the time stamp
+	 *  counter (cycles), or the monotonic time in ns where it
+	 *  can't be read. 0 without LEAKTRACER_HOOK_HISTOGRAMS */
+	static inline uint64_t hookClock(void);
+
+	/** records the time spent in the real allocation function
+	 *  by a hook since start (read with hookClock) */
+	inline void recordAllocationTime(uint64_t start);
+
+	/** writes count, p50, p99, p99.9 and max of the times of the
+	 *  hooks for each phase, as "name=value" lines. Writes nothing
+	 *  without LEAKTRACER_HOOK_HISTOGRAMS */
+	void writeHookHistograms(std::ostream &out);
+
 	/** returns TRUE if all monitoring is currently disabled,
 	 *  required to make sure we don't use this class before it
 	 *  was properly initialized */
+#ifdef USE_TLS
+	inline bool AllMonitoringIsDisabled(void) {
+		return ( (__monitoringDisabler!=0)|| (__tlsInternalDisabler != 0) );
+	}
+
+	inline int InternalMonitoringDisablerThreadUp(void) {
+		return __tlsInternalDisabler++;
+	}
+
+	inline int InternalMonitoringDisablerThreadDown(void) {
+		return __tlsInternalDisabler--;
+	}
+#else
 	inline bool AllMonitoringIsDisabled(void) {
 		return ( (__monitoringDisabler!=0)||
 			 (((intptr_t)pthread_getspecific(__thread_internal_disabler_key)) != 0) );
@@ -126,6 +324,7 @@ public:
 		pthread_setspecific(__thread_internal_disabler_key, (void*) (oldvalue - 1) );
 		return oldvalue;
 	}
+#endif
 
 	static void __attribute__ ((constructor)) MemoryTraceOnInit(void);
 	static void __attribute__ ((destructor)) MemoryTraceOnExit(void);
@@ -138,25 +337,207 @@ private:
 	MemoryTrace(void);
 	static MemoryTrace *__instance;
 
+	// set once init_full() is done, Setup() has nothing to do anymore
+	static bool __setupDone;
+	static int SetupSlowPath(void);
+
 	// global settings
-	bool __setupDone;
 	bool __monitoringAllThreads;
 	bool __monitoringReleases;
 	int  __monitoringDisabler;
 
+	// per - allocation info
+	typedef struct _allocation_info_struct {
+		size_t size;
+		uint64_t timestamp;		// see storeTimestamp
+		stack_id_t stackId;
+		uint32_t generation;	// see markGeneration, kept by reallocations
+		float weight;		// number of allocations this one stands for
+		bool isArray;
+	} allocation_info_t;
+	inline unsigned int storeAllocationStack(void* arr[MAX_ALLOCATION_STACK_DEPTH]);
+	inline stack_id_t internAllocationStack(void);
+	unsigned int __stackDepth;		// frames to save, see LEAKTRACER_STACK_DEPTH
+
+	// how stacks are captured, see LEAKTRACER_UNWINDER
+	enum { UNWINDER_GLIBC, UNWINDER_FRAME_POINTER };
+	int __unwinder;
+
+	// all distinct allocation stacks
+	StackTable __stacks;
+
+	// how allocations are timestamped, see LEAKTRACER_TIMESTAMP
+	enum { TIMESTAMP_MONOTONIC, TIMESTAMP_COARSE, TIMESTAMP_TSC, TIMESTAMP_SEQUENCE };
+	int __timestampSource;
+	uint64_t __allocationSequence;
+	// time stamp counter and monotonic time (ns) read together
+	// at startup, the TSC rate is measured from them at report time
+	uint64_t __tscBase;
+	uint64_t __monotonicBase;
+	inline void storeTimestamp(uint64_t &timestamp);
+	static inline uint64_t monotonicNanoseconds(clockid_t clock);
+	double timestampSeconds(uint64_t timestamp, double tscPerNanosecond);
+	double measureTscRate(void);
+
+	// allocation event, queued in per-thread buffers when
+	// LEAKTRACER_EVENT_BUFFER_SIZE is set, and applied later to
+	// the allocation map by drainOwnEvents() or
+	// flushEventBuffers()
+	enum { EVENT_ALLOCATION, EVENT_REALLOCATION, EVENT_RELEASE };
+	typedef struct _allocation_event_struct {
+		uint32_t sequence;		// order in the domain
+		unsigned short domain;		// see getEventDomain()
+		unsigned char op;
+		void *ptr;
+		allocation_info_t info;		// unused for EVENT_RELEASE
+	} allocation_event_t;
+	typedef TEventBuffer<allocation_event_t> event_buffer_t;
+	unsigned int __eventBufferSize;		// 0 when events are not buffered
+	unsigned int __eventDrainInterval;	// ms, 0 for no drainer thread
+	// sequence of the next event queued in each domain, and of the
+	// next one to apply (updated under the lock of its shard)
+	uint32_t __eventSequence[EVENT_SEQUENCE_DOMAINS];
+	uint32_t __appliedEventSequence[EVENT_SEQUENCE_DOMAINS];
+	inline unsigned int getEventDomain(void *p);
+	static inline unsigned int getEventShardIndex(const allocation_event_t &event)
+	{ return event.domain >> (EVENT_SEQUENCE_DOMAIN_BITS - ALLOCATION_MAP_SHARD_BITS); }
+	// events of all buffers, in the order flushEventBuffers()
+	// applies them, room for all buffers, __threadListMutex must
+	// be locked
+	allocation_event_t **__flushOrder;
+	unsigned long __flushOrderCapacity;
+	uint32_t __flushDomainStart[EVENT_SEQUENCE_DOMAINS];
+	unsigned long __numOfEventBuffers;
+	bool reserveFlushOrder(void);
+	inline bool queueEvent(unsigned char op, void *p, size_t size, bool is_array, float weight);
+	void flushEventBuffers(void);
+	void flushEventBuffers_unlocked(void);
+	// drainer thread, stopped on exit
+	pid_t __eventDrainerPid;	// process of the thread, 0 if none
+	pthread_t __eventDrainer;
+	int __eventDrainerPipe[2];	// written to stop it
+	void startEventDrainer(void);
+	void stopEventDrainer(void);
+	// number of reports reading the blocks of the map (data=): a
+	// release queued meanwhile must be applied before its block is
+	// freed, see applyOwnEvents()
+	unsigned int __blockReaders;
+	inline void beginBlockReads(void);
+	inline void endBlockReads(void);
+	inline bool blocksAreRead(void);
+	static void *eventDrainerThread(void *);
+
+	// see LEAKTRACER_CONTROL_SOCKET
+	ControlChannel __controlChannel;
+	void startControlChannel(void);
+
+	// reporter thread: signal handlers only write a request to
+	// its pipe, it also writes periodic reports (see
+	// LEAKTRACER_REPORT_INTERVAL_MS) and the report on exit, so
+	// that no interrupted or exiting thread writes a report. It is
+	// not restarted in a forked child, where signal handlers run
+	// the requests themselves, as before the thread starts. It
+	// ends after REPORTER_EXIT_REPORT or REPORTER_EXIT, sent on
+	// exit once it has finished the report it may be writing
+	enum { REPORTER_START = 'S', REPORTER_STOP = 'T', REPORTER_REPORT = 'R', REPORTER_EXIT_REPORT = 'X', REPORTER_EXIT = 'Q' };
+	pid_t __reporterPid;		// process of the thread, 0 if none
+	pid_t __exitingPid;		// process running the exit handlers
+	int __reporterPipe[2];
+	int __reporterDonePipe[2];	// acknowledges REPORTER_EXIT(_REPORT)
+	unsigned int __reportInterval;	// ms, 0 for no periodic reports
+	bool wakeUpReporter(char request);
+	void runSignalRequest(char request);
+	void runReporterRequest(char request);
+	void startReporter(void);
+	static void *reporterThread(void *);
+	static const char *signalReportFileName(void);
+	static const char *exitReportFileName(void);
+
 	// per-thread settings, for cases where only allocations
 	// made by specific threads are monitored
+	// counters of the hooks, each one only written by one thread
+	// (without atomic read-modify-write), in its own cache line
+	typedef struct {
+		uint64_t allocations;
+		uint64_t releases;
+		uint64_t allocatedBytes;
+		uint64_t releasedBytes;
+		uint64_t trackedAllocations;
+		uint64_t trackedReleases;
+		int64_t liveBlocks;		// negative when released by other threads
+		int64_t liveBytes;
+	} __attribute__ ((aligned (64))) thread_stats_t;
+	template <typename C> static inline void addToCounter(C &counter, C value)
+	{ __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED); }
+	static inline void countTrackedAllocation(thread_stats_t &stats, size_t size);
+	static inline void countTrackedRelease(thread_stats_t &stats, size_t size);
+	// counters of exited threads, of applied events and of cleared
+	// allocations, __threadListMutex must be locked
+	thread_stats_t __sharedStats;
+	// releases by threads which had no options yet
+	uint64_t __releasesWithoutOptions;
+	static void addStats(stats_t &stats, const thread_stats_t &threadStats);
+	void sumStats_unlocked(stats_t &stats);
+
+	// phases of the hooks timed with LEAKTRACER_HOOK_HISTOGRAMS
+	enum { HOOK_PHASE_ALLOCATION, HOOK_PHASE_LOCK_WAIT, HOOK_PHASE_STACK_CAPTURE, HOOK_PHASE_MAP_UPDATE, HOOK_PHASES };
+	static const char * const __hookPhaseNames[HOOK_PHASES];
+#ifdef LEAKTRACER_HOOK_HISTOGRAMS
+	// histograms of exited threads, __threadListMutex must be locked
+	LatencyHistogram __sharedHookHistograms[HOOK_PHASES];
+#endif
+
 	struct ThreadMonitoringOptions {
+		thread_stats_t stats;
+		StackTable::thread_counters_t stackCounters;	// see LEAKTRACER_HEAP_PROFILE
+#ifdef LEAKTRACER_HOOK_HISTOGRAMS
+		LatencyHistogram hookHistograms[HOOK_PHASES];
+#endif
 		bool monitoringAllocations;
-		inline ThreadMonitoringOptions() : monitoringAllocations(false) {}
+		event_buffer_t *events;		// NULL when events are not buffered
+		void *stackLow;				// bounds of the thread stack, for the
+		void *stackHigh;			// frame pointer unwinder (NULL if unknown)
+		long bytesUntilSample;		// see LEAKTRACER_SAMPLE_BYTES
+		uint64_t random;
+		inline ThreadMonitoringOptions() : monitoringAllocations(false), events(NULL), stackLow(NULL), stackHigh(NULL),
+			bytesUntilSample(0), random(0) { memset(&stats, 0, sizeof(stats)); memset(&stackCounters, 0, sizeof(stackCounters)); }
 	};
 	inline ThreadMonitoringOptions & getThreadOptions(void);
+	inline ThreadMonitoringOptions * findThreadOptions(void);
 	void removeThreadOptions(ThreadMonitoringOptions *pOptions);
+	// see queueEvent()
+	void applyEvent(allocation_event_t &event, thread_stats_t &stats, StackTable::thread_counters_t *pStackCounters);
+	bool drainOwnEvents(ThreadMonitoringOptions &options);
+	void applyOwnEvents(ThreadMonitoringOptions &options);
+	static inline void recordHookTime(ThreadMonitoringOptions &options, int phase, uint64_t &start);
 	inline void stopMonitoringPerThreadAllocations(void);
 
+	// sampling: one allocation is tracked per __sampleBytes bytes
+	// allocated on average (0 tracks all of them). Releases of
+	// blocks which were not sampled are filtered out by
+	// __sampledAddresses without locking.
+	size_t __sampleBytes;
+	TAddressFilter<SAMPLED_ADDRESS_FILTER_BITS> __sampledAddresses;
+	inline long nextSampleInterval(ThreadMonitoringOptions &options);
+	inline bool sampleAllocation(size_t size, float &weight);
+
+	// per stack counters of allocations, see LEAKTRACER_HEAP_PROFILE.
+	// With sampling, an allocation counts for its weight. Counted
+	// in the counters of calling thread first, when it has options.
+	bool __heapProfile;
+	inline void countAllocation(const allocation_info_t &info, StackTable::thread_counters_t *pStackCounters);
+	inline void countRelease(const allocation_info_t &info, StackTable::thread_counters_t *pStackCounters);
+
 	// key to access per-thread info
+#ifdef USE_TLS
+	static LEAKTRACER_TLS int __tlsInternalDisabler;
+	static LEAKTRACER_TLS ThreadMonitoringOptions *__tlsThreadOptions;
+#else
 	pthread_key_t __thread_internal_disabler_key;
+#endif
 
+	// with USE_TLS, the key is only used to get CleanUpThreadData
+	// called on thread exit
 	static void CleanUpThreadData(void *ptrThreadOptions);
 	pthread_key_t __thread_options_key;
 
@@ -176,27 +557,109 @@ private:
 	static int signalNumberFromString(const char* signame);
 
 	/** writes report with all memory leaks */
-	void writeLeaksPrivate(std::ostream &out);
+	void writeLeaksPrivate(std::ostream &out, uint64_t snapshotStall);
+	void prepareReport(bool symbols, uint32_t firstGeneration, uint32_t lastGeneration);
+
+	// statistics written in the header of the current report, set
+	// by prepareReport()
+	stats_t __reportStats;
+
+	// generations of allocations, the range written by the current
+	// report is set by prepareReport()
+	uint32_t __generation;
+	uint32_t __reportFirstGeneration;
+	uint32_t __reportLastGeneration;
+	inline bool allGenerationsReported(void) { return __reportFirstGeneration == 0 && __reportLastGeneration == UINT32_MAX; }
+	int writeReportHeader(std::ostream &out, uint64_t snapshotStall);
+	void writeReportModules(std::ostream &out);
+	void writeFrameSymbols(std::ostream &out, void * const *stack, unsigned int numOfFrames);
+
+	// how frames are written in reports, see LEAKTRACER_REPORT_FRAMES
+	enum { REPORT_FRAMES_ADDRESS, REPORT_FRAMES_MODULE, REPORT_FRAMES_SYMBOL };
+	int __reportFrames;
+	ModuleTable __modules;
+	void cacheLeakSymbols(void);
+	void writeFrame(std::ostream &out, void *addr);
+
+	// see LEAKTRACER_REPORT_FORMAT and LEAKTRACER_REPORT_TOP
+	enum { REPORT_FORMAT_TEXT, REPORT_FORMAT_BINARY, REPORT_FORMAT_AGGREGATED, REPORT_FORMAT_PPROF };
+	int __reportFormat;
+	unsigned long __reportTop;
+	bool writeBinaryLeaksPrivate(FILE *file, uint64_t snapshotStall);
+
+	// leaks of a call stack, in aggregated reports. With sampling,
+	// blocks and bytes are estimates.
+	typedef struct {
+		double blocks;
+		double bytes;
+		size_t minSize;
+		size_t maxSize;
+		uint64_t oldest;
+		uint64_t newest;
+	} leaks_group_t;
+	leaks_group_t * groupLeaks(unsigned long *pNumOfGroups);
+	void writeAggregatedLeaksPrivate(std::ostream &out, unsigned long top, uint64_t snapshotStall);
+	bool writePprofLeaksPrivate(FILE *file, uint64_t snapshotStall);
+	void writeHeapProfilePrivate(std::ostream &out, unsigned long top);
+
+	void writeReportToFile(const char *reportFilename, int format, unsigned long top,
+		uint32_t firstGeneration, uint32_t lastGeneration);
+	bool writeReportFile(const char *reportFilename, int format, unsigned long top, uint64_t snapshotStall);
+
+	// reports written by a forked child, see LEAKTRACER_REPORT_SNAPSHOT
+	bool __reportSnapshot;
+	uint64_t __lastSnapshotStall;
+	bool writeLeaksSnapshot(const char *reportFilename, int format, unsigned long top);
 
 	// centralized list of all per-thread options
 	typedef std::list<ThreadMonitoringOptions*> list_monitoring_options_t;
 	list_monitoring_options_t __listThreadOptions;
 	Mutex __threadListMutex;
 
-	// per - allocation info
-	typedef struct _allocation_info_struct {
-		size_t size;
-		struct timespec timestamp;
-		void * allocStack[ALLOCATION_STACK_DEPTH];
-		bool isArray;
-	} allocation_info_t;
-	inline void storeAllocationStack(void* arr[ALLOCATION_STACK_DEPTH]);
-	inline void storeTimestamp(struct timespec &tm);
-
+#ifdef USE_LOCKFREE_MAP
+	typedef TLockFreeMapMemoryInfo<allocation_info_t> memory_allocations_info_t;
+	// allocation hooks don't lock the shards, the shard mutex
+	// only serializes iterations (reports, flushes, clear)
+	class HookLock {
+	public:
+		inline explicit HookLock(Mutex &) {}
+	};
+#else
 	typedef TMapMemoryInfo<allocation_info_t> memory_allocations_info_t;
-	memory_allocations_info_t __allocations;
-	Mutex __allocations_mutex;
+	typedef MutexLock HookLock;
+	// nodes of all shards, shards don't lock it for each node
+	// (see TThreadCachingObjectsPool)
+	memory_allocations_info_t::nodes_pool_t __nodesPool;
+#endif
+	// gives free map nodes back to the system if many were
+	// released since the last time, or cleans up the lock-free
+	// map. Walks all free nodes or slots: called by background
+	// threads and reports
+	void trimMetadataIfDue(void);
+	// same for the nodes only, called by the hooks with no lock
+	// held, as no background thread may run
+	inline void trimNodesIfDue(void);
+
+	// allocation map is split in shards selected by address, each
+	// one with its own lock (and its own objects pool), so that
+	// threads allocating concurrently rarely wait for each other
+	struct allocations_shard_t {
+		Mutex mutex;
+		memory_allocations_info_t allocations;
+	} __attribute__ ((aligned (64)));
+	allocations_shard_t __shards[ALLOCATION_MAP_SHARDS];
+	inline unsigned int getShardIndex(void *p);
+	inline allocations_shard_t & getShard(void *p) { return __shards[getShardIndex(p)]; }
+	// iteration over the leaks of a shard written by the current
+	// report, the shard must be locked
+	inline void beginLeaksIteration(allocations_shard_t &shard);
+	inline bool getNextLeak(allocations_shard_t &shard, allocation_info_t **ppInfo, void **pptr);
+
+	// protects the transition to "monitoring releases" state
+	Mutex __monitoringMutex;
+
 	void clearAllocationsInfo(void);
+	bool allocationsInfoEmpty(void);
 };
 
 
@@ -216,17 +679,98 @@ inline MemoryTrace & MemoryTrace::GetInstance(void)
 }
 
 
+// Returns the shard holding allocation info of given pointer.
+// The list inside a shard is chosen by the low bits of
+// hashPointer(), so the shard is chosen by another hash: the high
+// bits of a single multiply, cheaper than the full finalizer and
+// not correlated with the list bits, so that the pointers of a
+// shard still spread over all of its lists.
+inline unsigned int MemoryTrace::getShardIndex(void *p)
+{
+	uint64_t h = (uint64_t)reinterpret_cast<uintptr_t>(p) * 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(h >> (64 - ALLOCATION_MAP_SHARD_BITS));
+}
+
+
+// Returns the domain of the events on given pointer, from the same
+// hash as its shard, so that a domain is inside a shard
+inline unsigned int MemoryTrace::getEventDomain(void *p)
+{
+	uint64_t h = (uint64_t)reinterpret_cast<uintptr_t>(p) * 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(h >> (64 - EVENT_SEQUENCE_DOMAIN_BITS));
+}
+
+
+// Starts iterating over the leaks of a shard in the generations of
+// the current report. When they are the newest ones, they are
+// found from the newest allocation, the older ones are not visited.
+inline void MemoryTrace::beginLeaksIteration(allocations_shard_t &shard)
+{
+#ifndef USE_LOCKFREE_MAP
+	if (__reportFirstGeneration != 0) {
+		shard.allocations.beginNewestIteration();
+		return;
+	}
+#endif
+	shard.allocations.beginIteration();
+}
+
+
+inline bool MemoryTrace::getNextLeak(allocations_shard_t &shard, allocation_info_t **ppInfo, void **pptr)
+{
+#ifndef USE_LOCKFREE_MAP
+	if (__reportFirstGeneration != 0) {
+		while (shard.allocations.getNextOlderPair(ppInfo, pptr)) {
+			if ((*ppInfo)->generation < __reportFirstGeneration)
+				return false;
+			if ((*ppInfo)->generation <= __reportLastGeneration)
+				return true;
+		}
+		return false;
+	}
+#endif
+	while (shard.allocations.getNextPair(ppInfo, pptr)) {
+		if ((*ppInfo)->generation >= __reportFirstGeneration && (*ppInfo)->generation <= __reportLastGeneration)
+			return true;
+	}
+	return false;
+}
+
+
 // Returns per-thread object for calling thread
 // (creates one if called for the first time)
 inline MemoryTrace::ThreadMonitoringOptions & MemoryTrace::getThreadOptions(void)
 {
+#ifdef USE_TLS
+	ThreadMonitoringOptions *pOpt = __tlsThreadOptions;
+#else
 	ThreadMonitoringOptions *pOpt = reinterpret_cast<ThreadMonitoringOptions*>(pthread_getspecific(__thread_options_key));
+#endif
 	if (pOpt == NULL) {
 		MutexLock lock(__threadListMutex);
 		// before creating new object we need to disable any monitoring
 		InternalMonitoringDisablerThreadUp();
 		pOpt = new ThreadMonitoringOptions;
+		if (__eventBufferSize != 0) {
+			pOpt->events = new event_buffer_t(__eventBufferSize);
+			if (!pOpt->events->valid() || !reserveFlushOrder()) {
+				// this thread will update the map directly
+				delete pOpt->events;
+				pOpt->events = NULL;
+			} else {
+				__numOfEventBuffers++;
+			}
+		}
+		if (__unwinder == UNWINDER_FRAME_POINTER)
+			getThreadStackBounds(&pOpt->stackLow, &pOpt->stackHigh);
+		if (__sampleBytes != 0) {
+			pOpt->random = reinterpret_cast<uintptr_t>(pOpt) ^ (uint64_t)pthread_self() ^ 0x9E3779B97F4A7C15ULL;
+			pOpt->bytesUntilSample = nextSampleInterval(*pOpt);
+		}
 		pthread_setspecific(__thread_options_key, pOpt);
+#ifdef USE_TLS
+		__tlsThreadOptions = pOpt;
+#endif
 		__listThreadOptions.push_back(pOpt);
 		InternalMonitoringDisablerThreadDown();
 	}
@@ -234,6 +778,17 @@ inline MemoryTrace::ThreadMonitoringOptions & MemoryTrace::getThreadOptions(void
 }
 
 
+// options of calling thread, NULL if they were not created yet
+inline MemoryTrace::ThreadMonitoringOptions * MemoryTrace::findThreadOptions(void)
+{
+#ifdef USE_TLS
+	return __tlsThreadOptions;
+#else
+	return reinterpret_cast<ThreadMonitoringOptions*>(pthread_getspecific(__thread_options_key));
+#endif
+}
+
+
 // iterates over list of per-thread objects, and diables
 // monitoring for all threads
 inline void MemoryTrace::stopMonitoringPerThreadAllocations(void)
@@ -254,10 +809,10 @@ inline void MemoryTrace::startMonitoringAllThreads(void)
 
 	TRACE((stderr, "LeakTracer: startMonitoringAllThreads\n"));
 	if (!__monitoringReleases) {
-		MutexLock lock(__allocations_mutex);
+		MutexLock lock(__monitoringMutex);
 		// double-check inside Mutex
 		if (!__monitoringReleases) {
-			__allocations.clearAllInfo();
+			clearAllocationsInfo();
 			__monitoringReleases = true;
 		}
 	}
@@ -275,10 +830,10 @@ inline void MemoryTrace::startMonitoringThisThread(void)
 	TRACE((stderr, "LeakTracer: startMonitoringThisThread\n"));
 	if (!__monitoringAllThreads) {
 		if (!__monitoringReleases) {
-			MutexLock lock(__allocations_mutex);
+			MutexLock lock(__monitoringMutex);
 			// double-check inside Mutex
 			if (!__monitoringReleases) {
-				__allocations.clearAllInfo();
+				clearAllocationsInfo();
 				__monitoringReleases = true;
 			}
 		}
@@ -312,55 +867,107 @@ inline void MemoryTrace::stopAllMonitoring(void)
 }
 
 
-// stores allocation stack, up to ALLOCATION_STACK_DEPTH
-// frames
-inline void MemoryTrace::storeAllocationStack(void* arr[ALLOCATION_STACK_DEPTH])
+// stores allocation stack, up to __stackDepth frames,
+// returns the number of frames stored
+inline unsigned int MemoryTrace::storeAllocationStack(void* arr[MAX_ALLOCATION_STACK_DEPTH])
 {
 	unsigned int iIndex = 0;
+#ifdef LEAKTRACER_FRAME_POINTER_UNWINDER
+	if (__unwinder == UNWINDER_FRAME_POINTER) {
+		ThreadMonitoringOptions &options = getThreadOptions();
+		iIndex = unwindFramePointers(arr, __stackDepth, options.stackLow, options.stackHigh);
+	} else
+#endif
+	{
 #ifdef USE_BACKTRACE
-	void* arrtmp[ALLOCATION_STACK_DEPTH+1];
-	iIndex = backtrace(arrtmp, ALLOCATION_STACK_DEPTH + 1) - 1;
+	void* arrtmp[MAX_ALLOCATION_STACK_DEPTH+1];
+	iIndex = backtrace(arrtmp, __stackDepth + 1) - 1;
 	memcpy(arr, &arrtmp[1], iIndex*sizeof(void*));
 #else
 	void *pFrame;
 	// NOTE: we can't use "for" loop, __builtin_* functions
 	// require the number to be known at compile time
-	arr[iIndex++] = (                  (pFrame = __builtin_frame_address(0)) != NULL) ? __builtin_return_address(0) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(1)) != NULL) ? __builtin_return_address(1) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(2)) != NULL) ? __builtin_return_address(2) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(3)) != NULL) ? __builtin_return_address(3) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(4)) != NULL) ? __builtin_return_address(4) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(5)) != NULL) ? __builtin_return_address(5) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(6)) != NULL) ? __builtin_return_address(6) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(7)) != NULL) ? __builtin_return_address(7) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
-	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(8)) != NULL) ? __builtin_return_address(8) : NULL; if (iIndex == ALLOCATION_STACK_DEPTH) return;
+	arr[iIndex++] = (                  (pFrame = __builtin_frame_address(0)) != NULL) ? __builtin_return_address(0) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(1)) != NULL) ? __builtin_return_address(1) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(2)) != NULL) ? __builtin_return_address(2) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(3)) != NULL) ? __builtin_return_address(3) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(4)) != NULL) ? __builtin_return_address(4) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(5)) != NULL) ? __builtin_return_address(5) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(6)) != NULL) ? __builtin_return_address(6) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(7)) != NULL) ? __builtin_return_address(7) : NULL; if (iIndex == __stackDepth) return iIndex;
+	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(8)) != NULL) ? __builtin_return_address(8) : NULL; if (iIndex == __stackDepth) return iIndex;
 	arr[iIndex++] = (pFrame != NULL && (pFrame = __builtin_frame_address(9)) != NULL) ? __builtin_return_address(9) : NULL;
 #endif
-	// fill remaining spaces
-	for (; iIndex < ALLOCATION_STACK_DEPTH; iIndex++)
-		arr[iIndex] = NULL;
+	}
+	return iIndex;
+}
+
+
+// stores the stack of current allocation in the stack table,
+// returns its ID
+inline stack_id_t MemoryTrace::internAllocationStack(void)
+{
+	if (__stackDepth == 0)
+		return NO_STACK_ID;
+
+	void *stack[MAX_ALLOCATION_STACK_DEPTH];
+	unsigned int numOfFrames = storeAllocationStack(stack);
+	// missing frames are stored as NULL by __builtin_frame_address
+	// ladder, frames after the first missing one are missing too
+	while (numOfFrames > 0 && stack[numOfFrames - 1] == NULL)
+		numOfFrames--;
+	return __stacks.intern(stack, numOfFrames);
 }
 
 
 // adds all relevant info regarding current allocation to map
 inline void MemoryTrace::registerAllocation(void *p, size_t size, bool is_array)
 {
-	allocation_info_t *info = NULL;
-	if (!AllMonitoringIsDisabled() && (__monitoringAllThreads || getThreadOptions().monitoringAllocations) && p != NULL) {
-		MutexLock lock(__allocations_mutex);
-		info = __allocations.insert(p);
+	if (!AllMonitoringIsDisabled() && p != NULL) {
+		// also makes nodes cached by this thread released with
+		// its options
+		ThreadMonitoringOptions &options = getThreadOptions();
+		addToCounter(options.stats.allocations, (uint64_t)1);
+		addToCounter(options.stats.allocatedBytes, (uint64_t)size);
+		if (!__monitoringAllThreads && !options.monitoringAllocations)
+			return;
+
+		float weight = 1;
+		if (__sampleBytes != 0) {
+			if (!sampleAllocation(size, weight))
+				return;
+			// before the release can look for it
+			__sampledAddresses.add(p);
+		}
+
+		if (__eventBufferSize != 0 && queueEvent(EVENT_ALLOCATION, p, size, is_array, weight))
+			return;
+
+		// we store the stack before locking the shard mutex
+		// prevent a deadlock between backtrave function who are now using advanced dl_iterate_phdr function
+		// and dl_* function which uses malloc functions
+		uint64_t start = hookClock();
+		stack_id_t stackId = internAllocationStack();
+		recordHookTime(options, HOOK_PHASE_STACK_CAPTURE, start);
+
+		allocations_shard_t &shard = getShard(p);
+		HookLock lock(shard.mutex);
+		recordHookTime(options, HOOK_PHASE_LOCK_WAIT, start);
+		allocation_info_t *info = shard.allocations.insert(p);
 		if (info != NULL) {
 			info->size = size;
 			info->isArray = is_array;
+			info->stackId = stackId;
+			// read under the shard lock, so generations only grow
+			// in the insertion order of the shard
+			info->generation = getGeneration();
+			info->weight = weight;
 			storeTimestamp(info->timestamp);
+			countAllocation(*info, &options.stackCounters);
+			countTrackedAllocation(options.stats, size);
+			shard.allocations.publish(info);
 		}
-	}
- 	// we store the stack without locking __allocations_mutex
-	// it should be safe enough
-	// prevent a deadlock between backtrave function who are now using advanced dl_iterate_phdr function
- 	// and dl_* function which uses malloc functions
-	if (info != NULL) {
-		storeAllocationStack(info->allocStack);
+		recordHookTime(options, HOOK_PHASE_MAP_UPDATE, start);
 	}
 
 	if (p == NULL) {
@@ -374,15 +981,47 @@ inline void MemoryTrace::registerAllocation(void *p, size_t size, bool is_array)
 // adds all relevant info regarding current allocation to map
 inline void MemoryTrace::registerReallocation(void *p, size_t size, bool is_array)
 {
-	if (!AllMonitoringIsDisabled() && (__monitoringAllThreads || getThreadOptions().monitoringAllocations) && p != NULL) {
-		MutexLock lock(__allocations_mutex);
-		allocation_info_t *info = __allocations.find(p);
+	if (!AllMonitoringIsDisabled() && p != NULL) {
+		ThreadMonitoringOptions &options = getThreadOptions();
+		addToCounter(options.stats.releases, (uint64_t)1);
+		addToCounter(options.stats.allocations, (uint64_t)1);
+		addToCounter(options.stats.allocatedBytes, (uint64_t)size);
+		if (!__monitoringAllThreads && !options.monitoringAllocations)
+			return;
+
+		// the block keeps the weight it was sampled with
+		if (__sampleBytes != 0 && !__sampledAddresses.mayContain(p))
+			return;
+
+		if (__eventBufferSize != 0 && queueEvent(EVENT_REALLOCATION, p, size, is_array, 1)) {
+			// the block may have shrunk
+			if (blocksAreRead())
+				applyOwnEvents(options);
+			return;
+		}
+
+		uint64_t start = hookClock();
+		stack_id_t stackId = internAllocationStack();
+		recordHookTime(options, HOOK_PHASE_STACK_CAPTURE, start);
+
+		allocations_shard_t &shard = getShard(p);
+		HookLock lock(shard.mutex);
+		recordHookTime(options, HOOK_PHASE_LOCK_WAIT, start);
+		// the lock-free map has no lock to keep reports from
+		// reading the element while it is modified
+		allocation_info_t *info = shard.allocations.findAndPin(p);
 		if (info != NULL) {
+			countRelease(*info, &options.stackCounters);
+			countTrackedRelease(options.stats, info->size);
 			info->size = size;
 			info->isArray = is_array;
-			storeAllocationStack(info->allocStack);
+			info->stackId = stackId;
 			storeTimestamp(info->timestamp);
+			countAllocation(*info, &options.stackCounters);
+			countTrackedAllocation(options.stats, size);
+			shard.allocations.unpin(info);
 		}
+		recordHookTime(options, HOOK_PHASE_MAP_UPDATE, start);
 	}
 
 	if (p == NULL) {
@@ -393,27 +1032,280 @@ inline void MemoryTrace::registerReallocation(void *p, size_t size, bool is_arra
 }
 
 
-// removes allocation's info from the map
+// removes allocation's info from the map. Releases are counted
+// without creating the options of calling thread, which are only
+// needed once a tracked block is released.
 inline void MemoryTrace::registerRelease(void *p, bool is_array)
 {
-	if (!AllMonitoringIsDisabled() && __monitoringReleases && p != NULL) {
-		MutexLock lock(__allocations_mutex);
-		allocation_info_t *info = __allocations.find(p);
-		if (info != NULL) {
-			if (info->isArray != is_array) {
-				InternalMonitoringDisablerThreadUp();
-				// WARNING
-				InternalMonitoringDisablerThreadDown();
+	if (!AllMonitoringIsDisabled() && p != NULL) {
+		ThreadMonitoringOptions *pOptions = findThreadOptions();
+		if (pOptions != NULL)
+			addToCounter(pOptions->stats.releases, (uint64_t)1);
+		else
+			__atomic_add_fetch(&__releasesWithoutOptions, 1, __ATOMIC_RELAXED);
+		if (!__monitoringReleases)
+			return;
+
+		// most blocks were not sampled, don't look for them
+		if (__sampleBytes != 0 && !__sampledAddresses.mayContain(p))
+			return;
+
+		if (__eventBufferSize != 0 && queueEvent(EVENT_RELEASE, p, 0, is_array, 1)) {
+			// the block is freed on return
+			if (blocksAreRead())
+				applyOwnEvents(getThreadOptions());
+			return;
+		}
+
+		uint64_t start = hookClock();
+		size_t releasedSize = 0;
+		bool released = false;
+		{
+			allocations_shard_t &shard = getShard(p);
+			HookLock lock(shard.mutex);
+			if (pOptions != NULL)
+				recordHookTime(*pOptions, HOOK_PHASE_LOCK_WAIT, start);
+			allocation_info_t *info = shard.allocations.find(p);
+			if (info != NULL) {
+				if (info->isArray != is_array) {
+					InternalMonitoringDisablerThreadUp();
+					// WARNING
+					InternalMonitoringDisablerThreadDown();
+				}
+				countRelease(*info, (pOptions != NULL) ? &pOptions->stackCounters : NULL);
+				releasedSize = info->size;
+				released = true;
+				shard.allocations.release(p);
+				if (__sampleBytes != 0)
+					__sampledAddresses.remove(p);
+			}
+			if (pOptions != NULL)
+				recordHookTime(*pOptions, HOOK_PHASE_MAP_UPDATE, start);
+		}
+		// outside of the shard lock, as the options may be created
+		if (released) {
+			countTrackedRelease(getThreadOptions().stats, releasedSize);
+			trimNodesIfDue();
+		}
+	}
+}
+
+
+// a trim walks all free nodes, but is only due once a quarter of
+// them were released since the last one: its cost is spread over
+// the releases which made it due. Lock-free maps are only cleaned up
+// by background threads and reports, as hooks never lock them
+inline void MemoryTrace::trimNodesIfDue(void)
+{
+#ifndef USE_LOCKFREE_MAP
+	__nodesPool.trimIfDue();
+#endif
+}
+
+// counts an allocation in the counters of its stack, the release
+// must be counted with the same info
+inline void MemoryTrace::countAllocation(const allocation_info_t &info, StackTable::thread_counters_t *pStackCounters)
+{
+	if (__heapProfile)
+		__stacks.countAllocation(pStackCounters, info.stackId, (int64_t)(info.weight + 0.5f), (int64_t)(info.size * info.weight + 0.5f));
+}
+
+
+inline void MemoryTrace::countRelease(const allocation_info_t &info, StackTable::thread_counters_t *pStackCounters)
+{
+	if (__heapProfile)
+		__stacks.countRelease(pStackCounters, info.stackId, (int64_t)(info.weight + 0.5f), (int64_t)(info.size * info.weight + 0.5f));
+}
+
+
+// counts an operation recorded in the allocation map, in the
+// counters of calling thread (or in __sharedStats)
+inline void MemoryTrace::countTrackedAllocation(thread_stats_t &stats, size_t size)
+{
+	addToCounter(stats.trackedAllocations, (uint64_t)1);
+	addToCounter(stats.liveBlocks, (int64_t)1);
+	addToCounter(stats.liveBytes, (int64_t)size);
+}
+
+
+inline void MemoryTrace::countTrackedRelease(thread_stats_t &stats, size_t size)
+{
+	addToCounter(stats.trackedReleases, (uint64_t)1);
+	addToCounter(stats.releasedBytes, (uint64_t)size);
+	addToCounter(stats.liveBlocks, (int64_t)-1);
+	addToCounter(stats.liveBytes, -(int64_t)size);
+}
+
+
+// appends an event to the buffer of calling thread, instead
+// of updating the allocation map. Sequence number is taken
+// while holding the buffer mutex, so that a flush never sees
+// an event without the events it depends on (see
+// flushEventBuffers). A full buffer is drained by this thread
+// only, unless all its events wait for events of other threads.
+// returns false if calling thread has no buffer
+inline bool MemoryTrace::queueEvent(unsigned char op, void *p, size_t size, bool is_array, float weight)
+{
+	ThreadMonitoringOptions &options = getThreadOptions();
+	event_buffer_t *events = options.events;
+	if (events == NULL)
+		return false;
+
+	allocation_event_t event;
+	event.ptr = p;
+	event.op = op;
+	event.domain = getEventDomain(p);
+	uint64_t start = hookClock();
+	if (op != EVENT_RELEASE) {
+		event.info.size = size;
+		event.info.isArray = is_array;
+		event.info.weight = weight;
+		storeTimestamp(event.info.timestamp);
+		event.info.stackId = internAllocationStack();
+		recordHookTime(options, HOOK_PHASE_STACK_CAPTURE, start);
+	}
+
+	// the map is updated later, appending the event is timed
+	// as the update
+	for (;;) {
+		{
+			MutexLock lock(events->mutex);
+			if (!events->full()) {
+				event.sequence = __sync_fetch_and_add(&__eventSequence[event.domain], 1);
+				*events->append() = event;
+				recordHookTime(options, HOOK_PHASE_MAP_UPDATE, start);
+				return true;
 			}
-			__allocations.release(p);
 		}
+		// buffer is full
+		if (!drainOwnEvents(options))
+			flushEventBuffers();
+		trimNodesIfDue();
 	}
 }
 
-// storetimestamp function
-inline void MemoryTrace::storeTimestamp(struct timespec &timestamp)
+
+// a report reading the blocks is counted before it applies the
+// queued events: a hook which appended its event, then sees no
+// report, appended it before the report took the buffer mutexes
+// to apply them, so the event is applied before the blocks are read
+inline void MemoryTrace::beginBlockReads(void)
+{
+	__atomic_add_fetch(&__blockReaders, 1, __ATOMIC_SEQ_CST);
+}
+
+
+inline void MemoryTrace::endBlockReads(void)
+{
+	__atomic_sub_fetch(&__blockReaders, 1, __ATOMIC_RELEASE);
+}
+
+
+inline bool MemoryTrace::blocksAreRead(void)
+{
+	return __atomic_load_n(&__blockReaders, __ATOMIC_SEQ_CST) != 0;
+}
+
+
+// draws the number of bytes to allocate before the next
+// sampled allocation, from a geometric distribution of mean
+// __sampleBytes (exponential, as bytes are many), so that each
+// byte allocated has the same probability to be sampled
+inline long MemoryTrace::nextSampleInterval(ThreadMonitoringOptions &options)
+{
+	// xorshift64*
+	uint64_t x = options.random;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	options.random = x;
+	// uniform in ]0, 1]
+	double u = (((x * 0x2545F4914F6CDD1DULL) >> 11) + 1) * (1.0 / 9007199254740992.0);
+	return (long)(-log(u) * __sampleBytes) + 1;
+}
+
+
+// returns true if an allocation of size bytes is sampled, and the
+// number of allocations of this size it stands for in weight: an
+// allocation of size bytes is sampled with probability
+// 1 - exp(-size / __sampleBytes)
+inline bool MemoryTrace::sampleAllocation(size_t size, float &weight)
+{
+	ThreadMonitoringOptions &options = getThreadOptions();
+	options.bytesUntilSample -= size;
+	if (__builtin_expect(options.bytesUntilSample > 0, true))
+		return false;
+
+	options.bytesUntilSample = nextSampleInterval(options);
+	weight = 1.0 / (1.0 - exp(-(double)size / __sampleBytes));
+	return true;
+}
+
+
+inline uint64_t MemoryTrace::monotonicNanoseconds(clockid_t clock)
 {
-  clock_gettime(CLOCK_MONOTONIC, &timestamp);
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+inline uint64_t MemoryTrace::hookClock(void)
+{
+#if !defined(LEAKTRACER_HOOK_HISTOGRAMS)
+	return 0;
+#elif defined(LEAKTRACER_TSC_TIMESTAMP)
+	return __builtin_ia32_rdtsc();
+#else
+	return monotonicNanoseconds(CLOCK_MONOTONIC);
+#endif
+}
+
+
+// records the time since start in given phase of the hooks of
+// calling thread, and restarts from now
+inline void MemoryTrace::recordHookTime(ThreadMonitoringOptions &options, int phase, uint64_t &start)
+{
+#ifdef LEAKTRACER_HOOK_HISTOGRAMS
+	uint64_t now = hookClock();
+	options.hookHistograms[phase].add(now - start);
+	start = now;
+#endif
+}
+
+
+inline void MemoryTrace::recordAllocationTime(uint64_t start)
+{
+#ifdef LEAKTRACER_HOOK_HISTOGRAMS
+	uint64_t now = hookClock();
+	// not while the options of this thread are created
+	if (!AllMonitoringIsDisabled())
+		getThreadOptions().hookHistograms[HOOK_PHASE_ALLOCATION].add(now - start);
+#endif
+}
+
+
+// stores the monotonic time in ns (of CLOCK_MONOTONIC or
+// CLOCK_MONOTONIC_COARSE), the time stamp counter, or the
+// allocation sequence number, see timestampSeconds
+inline void MemoryTrace::storeTimestamp(uint64_t &timestamp)
+{
+	switch (__timestampSource) {
+	case TIMESTAMP_COARSE:
+		timestamp = monotonicNanoseconds(CLOCK_MONOTONIC_COARSE);
+		break;
+#ifdef LEAKTRACER_TSC_TIMESTAMP
+	case TIMESTAMP_TSC:
+		timestamp = __builtin_ia32_rdtsc();
+		break;
+#endif
+	case TIMESTAMP_SEQUENCE:
+		timestamp = __sync_add_and_fetch(&__allocationSequence, 1);
+		break;
+	default:
+		timestamp = monotonicNanoseconds(CLOCK_MONOTONIC);
+		break;
+	}
 }
 
 
@@ -0,0 +1,150 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __MODULE_TABLE_h_included__
+#define __MODULE_TABLE_h_included__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <link.h>
+#include "Mutex.hpp"
+#include "MutexLock.hpp"
+#include "ObjectsPool.hpp"
+
+
+namespace leaktracer {
+
+/**
+ * Table of the modules (program and shared libraries) loaded in
+ * the process, with their load base and GNU build-id, so that
+ * reports can give frames as module + offset, which can be
+ * resolved offline whatever the address space layout.
+ *
+ * Also caches dladdr() symbols of frames, for reports symbolized
+ * in-process.
+ *
+ * The modules are collected by dl_iterate_phdr(), again only
+ * when dlopen()/dlclose() changed them. refresh() and all other
+ * functions must be called with the mutex locked (getMutex()),
+ * and monitoring disabled, as they allocate.
+ */
+class ModuleTable {
+public:
+	ModuleTable(void);
+	virtual ~ModuleTable(void);
+
+	Mutex & getMutex(void) { return __mutex; }
+
+	/** collects the modules if they changed since last call */
+	void refresh(void);
+
+	/** number of modules, and their properties, index is
+	 *  in [0, size()[, 0 is the program */
+	unsigned int size(void) { return __numOfModules; }
+	const char * getPath(unsigned int index) { return __modules[index].path; }
+	uintptr_t getBase(unsigned int index) { return __modules[index].base; }
+	/** hexadecimal, empty if unknown */
+	const char * getBuildId(unsigned int index) { return __modules[index].buildId; }
+
+	/** finds the module holding given address, returns false if
+	 *  none, else its index and the offset from its base */
+	bool find(void *addr, unsigned int *pIndex, uintptr_t *pOffset);
+
+	/** number of loaded segments of the modules, and their
+	 *  properties, index is in [0, numOfSegments()[, sorted by
+	 *  address */
+	unsigned int numOfSegments(void) { return __numOfSegments; }
+	uintptr_t getSegmentStart(unsigned int index) { return __segments[index].start; }
+	uintptr_t getSegmentEnd(unsigned int index) { return __segments[index].end; }
+	/** offset of the segment in the file of its module */
+	uintptr_t getSegmentFileOffset(unsigned int index) { return __segments[index].fileOffset; }
+	unsigned int getSegmentModule(unsigned int index) { return __segments[index].module; }
+
+	/** finds the segment holding given address, returns false if
+	 *  none, else its index */
+	bool findSegment(void *addr, unsigned int *pIndex);
+
+	/** looks up the symbol of given return address with
+	 *  dladdr(), if not cached yet. dladdr() takes the dynamic
+	 *  loader lock, no lock taken by allocation hooks must be
+	 *  held */
+	void cacheSymbol(void *addr);
+
+	/** returns the cached symbol holding given return address
+	 *  and the offset in it, NULL if unknown or not cached. In
+	 *  pFirstTime, tells if the symbol of this address was asked
+	 *  for the first time since newReport() */
+	const char * getSymbol(void *addr, uintptr_t *pOffset, bool *pFirstTime);
+
+	/** starts a new report, for getSymbol() */
+	void newReport(void) { __report++; }
+
+private:
+	typedef struct {
+		char *path;
+		uintptr_t base;
+		char buildId[2 * 32 + 1];
+	} module_t;
+
+	// address range of a loaded segment
+	typedef struct {
+		uintptr_t start;
+		uintptr_t end;
+		uintptr_t fileOffset;
+		unsigned int module;
+	} segment_t;
+
+	module_t *__modules;
+	unsigned int __numOfModules;
+	unsigned int __modulesCapacity;
+	// sorted by address
+	segment_t *__segments;
+	unsigned int __numOfSegments;
+	unsigned int __segmentsCapacity;
+
+	// dlopen()/dlclose() counters when last collected
+	unsigned long long __adds;
+	unsigned long long __subs;
+	bool __collected;
+
+	static int changedCallback(struct dl_phdr_info *info, size_t size, void *data);
+	static int collectCallback(struct dl_phdr_info *info, size_t size, void *data);
+	bool addModule(const char *path, uintptr_t base);
+	bool addSegment(uintptr_t start, uintptr_t end, uintptr_t fileOffset);
+	void clear(void);
+
+	// symbols cache, open addressing by return address,
+	// capacity is a power of 2
+	typedef struct {
+		void *addr;				// NULL for a free slot
+		const char *name;		// owned by the dynamic loader
+		uintptr_t offset;
+		unsigned long report;	// last report it was asked by
+	} symbol_t;
+#define MODULE_TABLE_MIN_SYMBOLS	(1 << 10)
+	symbol_t *__symbols;
+	unsigned long __symbolsCapacity;
+	unsigned long __numOfSymbols;
+	unsigned long __report;
+	inline symbol_t * findSymbol(void *addr);
+	bool growSymbols(void);
+	void clearSymbols(void);
+
+	Mutex __mutex;
+};
+
+
+}  // end namespace
+
+
+#endif  // include once
@@ -25,6 +25,9 @@
 #include "Mutex.hpp"
 #include "MutexLock.hpp"
 #include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 /**
  * dynamic call interfaces to memory allocation functions in libc.so
@@ -63,6 +66,156 @@ public:
 	{
 		LT_FREE(p);
 	}
+
+	// bytes allocated for given number of chunks
+	size_t getMemoryUsage( unsigned long numOfChunks )
+	{
+		return numOfChunks * NumOfElementsInChunk * sizeof(E);
+	}
+};
+
+
+// when set, mmap()-ed chunks are carved from regions backed by
+// transparent huge pages
+inline bool & chunksUseHugePages()
+{
+	static bool useHugePages = false;
+	return useHugePages;
+}
+
+/**
+ * This class used for allocation of chunks of elements of type E
+ * mapped directly with mmap(), away from the heap of the traced
+ * program, and given back to the system when released.
+ *
+ * With chunksUseHugePages() set when the first chunk is allocated,
+ * chunks are carved from 2MB regions, 2MB aligned (mapped bigger,
+ * then trimmed) and advised with MADV_HUGEPAGE, as a huge page can
+ * only back an aligned 2MB range. The pages of a released chunk are
+ * given back with MADV_DONTNEED, its region is unmapped once all its
+ * chunks are released. Calls must be serialized by the caller.
+ */
+template <typename E, unsigned int NumOfElementsInChunk>
+class TMmapChunkAllocator
+{
+public:
+	TMmapChunkAllocator() : __mode(MODE_UNKNOWN), __regions(NULL), __num_of_regions(0) {}
+
+	E * allocate()
+	{
+		if (__mode == MODE_UNKNOWN)
+			__mode = (chunksUseHugePages() && chunksPerRegion() > 0) ? MODE_REGIONS : MODE_CHUNKS;
+		if (__mode == MODE_REGIONS)
+			return allocateFromRegion();
+
+		void *p = mmap(NULL, chunkSize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		return (E*) p;
+	}
+
+	void release( E * p )
+	{
+		if (__mode == MODE_REGIONS)
+			releaseToRegion(p);
+		else
+			munmap(p, chunkSize());
+	}
+
+	// bytes mapped for given number of chunks
+	size_t getMemoryUsage( unsigned long numOfChunks )
+	{
+		if (__mode == MODE_REGIONS)
+			return (size_t)__atomic_load_n(&__num_of_regions, __ATOMIC_RELAXED) * REGION_SIZE;
+		return numOfChunks * chunkSize();
+	}
+
+private:
+	enum { MODE_UNKNOWN, MODE_CHUNKS, MODE_REGIONS };
+	int __mode;
+
+	// rounded up to pages
+	static size_t chunkSize()
+	{
+		size_t pageSize = sysconf(_SC_PAGESIZE);
+		return (NumOfElementsInChunk * sizeof(E) + pageSize - 1) & ~(pageSize - 1);
+	}
+
+	// a region holds its chunks from its start, and ends with
+	// its header. Chunks are marked free in a 32-bit mask.
+	static const size_t REGION_SIZE = 2UL << 20;
+	typedef struct _region_struct {
+		struct _region_struct *next;
+		uint32_t free_chunks;
+		unsigned int num_of_chunks;		// in use
+	} region_t;
+	region_t *__regions;
+	unsigned long __num_of_regions;
+
+	static unsigned int chunksPerRegion()
+	{
+		size_t chunks = (REGION_SIZE - sizeof(region_t)) / chunkSize();
+		return chunks > 32 ? 32 : (unsigned int)chunks;
+	}
+
+	static region_t * regionOf( void *p )
+	{
+		char *base = (char*)((uintptr_t)p & ~(uintptr_t)(REGION_SIZE - 1));
+		return reinterpret_cast<region_t*>(base + REGION_SIZE - sizeof(region_t));
+	}
+
+	static char * regionBase( region_t *region )
+	{
+		return (char*)region + sizeof(region_t) - REGION_SIZE;
+	}
+
+	E * allocateFromRegion()
+	{
+		region_t *region = __regions;
+		while (region != NULL && region->free_chunks == 0)
+			region = region->next;
+		if (region == NULL) {
+			// twice the size, so that an aligned region fits in it
+			char *p = (char*) mmap(NULL, 2 * REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == (char*) MAP_FAILED)
+				return NULL;
+			char *base = (char*)(((uintptr_t)p + REGION_SIZE - 1) & ~(uintptr_t)(REGION_SIZE - 1));
+			if (base != p)
+				munmap(p, base - p);
+			munmap(base + REGION_SIZE, p + REGION_SIZE - base);
+#ifdef MADV_HUGEPAGE
+			madvise(base, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+			region = regionOf(base);
+			region->free_chunks = (chunksPerRegion() == 32) ? ~(uint32_t)0 : ((uint32_t)1 << chunksPerRegion()) - 1;
+			region->num_of_chunks = 0;
+			region->next = __regions;
+			__regions = region;
+			__atomic_store_n(&__num_of_regions, __num_of_regions + 1, __ATOMIC_RELAXED);
+		}
+
+		unsigned int iChunk = __builtin_ctz(region->free_chunks);
+		region->free_chunks &= ~((uint32_t)1 << iChunk);
+		region->num_of_chunks ++;
+		return (E*)(regionBase(region) + iChunk * chunkSize());
+	}
+
+	void releaseToRegion( E * p )
+	{
+		region_t *region = regionOf(p);
+		if (-- region->num_of_chunks == 0) {
+			region_t **ppRegion = &__regions;
+			while (*ppRegion != region)
+				ppRegion = &(*ppRegion)->next;
+			*ppRegion = region->next;
+			munmap(regionBase(region), REGION_SIZE);
+			__atomic_store_n(&__num_of_regions, __num_of_regions - 1, __ATOMIC_RELAXED);
+			return;
+		}
+		unsigned int iChunk = ((char*)p - regionBase(region)) / chunkSize();
+		region->free_chunks |= (uint32_t)1 << iChunk;
+		madvise(p, chunkSize(), MADV_DONTNEED);
+	}
 };
 
 
@@ -111,6 +264,7 @@ public:
 	// statistics
 	unsigned long getNumOfObjects();
 	unsigned long getNumOfChunks();
+	size_t getMemoryUsage();
 
 
 private:
@@ -247,6 +401,12 @@ unsigned long TObjectsPool<T, NumOfElementsInChunk, IsThreadSafe, CHUNK_ALLOCATO
 	return __num_of_chunks;
 }
 
+template <typename T, unsigned int NumOfElementsInChunk, bool IsThreadSafe, typename CHUNK_ALLOCATOR>
+size_t TObjectsPool<T, NumOfElementsInChunk, IsThreadSafe, CHUNK_ALLOCATOR>::getMemoryUsage()
+{
+	return (size_t)__atomic_load_n(&__num_of_chunks, __ATOMIC_RELAXED) * NumOfElementsInChunk * sizeof(t_list_element<T>);
+}
+
 
 }; // namespace
 
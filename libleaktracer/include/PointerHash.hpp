@@ -0,0 +1,43 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __POINTER_HASH_h_included__
+#define __POINTER_HASH_h_included__
+
+#include <stdint.h>
+
+
+namespace leaktracer {
+
+/**
+ * Mixes all the bits of a pointer (MurmurHash3 64 bits
+ * finalizer). Allocated blocks are aligned on 8 or 16 bytes, and
+ * come from a few address ranges, so neither the low nor the high
+ * bits of an address can be used directly as a table index. Any
+ * range of bits of the result can.
+ */
+inline uint64_t hashPointer(const void *ptr)
+{
+	uint64_t h = reinterpret_cast<uintptr_t>(ptr);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+}  // end namespace
+
+
+#endif  // include once
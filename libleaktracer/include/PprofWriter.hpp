@@ -0,0 +1,132 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __PPROF_WRITER_h_included__
+#define __PPROF_WRITER_h_included__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "ObjectsPool.hpp"
+
+
+namespace leaktracer {
+
+/**
+ * Writes a profile in the gzipped profile.proto format of pprof,
+ * without protobuf nor zlib: messages are encoded by hand, and the
+ * gzip stream is made of stored (not compressed) deflate blocks.
+ *
+ * The profile is streamed: each message is written as soon as it
+ * is complete, the strings of the string table too, add*() return
+ * their index in it. Locations (and their functions) are written
+ * the first time they are asked for.
+ *
+ * Nothing is checked until close(), which returns false if any
+ * write or allocation failed.
+ */
+class PprofWriter {
+public:
+	PprofWriter(FILE *file);
+	virtual ~PprofWriter(void);
+
+	/** adds a string to the string table, returns its index */
+	int64_t addString(const char *s);
+
+	/** writes the type and unit of the values of the samples, in
+	 *  the order of the values */
+	void writeSampleType(const char *type, const char *unit);
+
+	/** writes the type of the sampling period, and the period */
+	void writePeriod(const char *type, const char *unit, int64_t period);
+
+	/** writes the sample type shown by default */
+	void writeDefaultSampleType(const char *type);
+
+	/** writes the time of the profile, in ns since the Epoch */
+	void writeTime(int64_t timeNanos);
+
+	/** writes a comment */
+	void writeComment(const char *comment);
+
+	/** writes a mapping of a module, id must not be 0. Mappings
+	 *  are not marked as having functions: pprof symbolizes them,
+	 *  functions given with locations are kept if it can't */
+	void writeMapping(uint64_t id, uint64_t start, uint64_t limit, uint64_t fileOffset,
+		const char *filename, const char *buildId);
+
+	/** returns the ID of the location of given address, in given
+	 *  mapping (0 for none), in given function (NULL if unknown).
+	 *  The location is written the first time */
+	uint64_t getLocation(uintptr_t address, uint64_t mappingId, const char *function);
+
+	/** writes a sample, locations from the innermost one */
+	void writeSample(const uint64_t *locations, unsigned int numOfLocations,
+		const int64_t *values, unsigned int numOfValues);
+
+	/** ends the gzip stream, returns false on error. The file is
+	 *  not closed */
+	bool close(void);
+
+private:
+	FILE *__file;
+	bool __ok;
+	int64_t __numOfStrings;
+
+	// message being encoded: nested messages are encoded first,
+	// so that the length is known before they are written
+	unsigned char *__message;
+	size_t __messageSize;
+	size_t __messageCapacity;
+	inline void beginMessage(void) { __messageSize = 0; }
+	void putByte(unsigned char byte);
+	void putVarint(uint64_t value);
+	void putField(unsigned int field, uint64_t value);
+	template <typename T> void putPacked(unsigned int field, const T *values, unsigned int numOfValues);
+	void putMessage(unsigned int field, const unsigned char *message, size_t size);
+	void endMessage(unsigned int field);
+	void writeValueType(unsigned int field, const char *type, const char *unit);
+
+	// IDs of locations (by address) and of functions (by name
+	// pointer), open addressing, capacity is a power of 2
+	typedef struct {
+		uintptr_t key;		// 0 for a free slot
+		uint64_t id;
+	} id_slot_t;
+	typedef struct {
+		id_slot_t *slots;
+		unsigned long capacity;
+		unsigned long size;
+	} id_table_t;
+#define PPROF_WRITER_MIN_IDS	(1 << 10)
+	id_table_t __locations;
+	id_table_t __functions;
+	id_slot_t * findId(id_table_t &table, uintptr_t key);
+
+	// gzip stream, the deflate block being filled is written
+	// when full
+#define PPROF_WRITER_BLOCK_SIZE	65535
+	unsigned char *__block;
+	size_t __blockSize;
+	uint32_t __crcTable[256];
+	uint32_t __crc;
+	uint32_t __inputSize;
+	void output(const void *data, size_t size);
+	void writeBlock(bool last);
+};
+
+
+}  // end namespace
+
+
+#endif  // include once
@@ -0,0 +1,327 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __STACK_TABLE_h_included__
+#define __STACK_TABLE_h_included__
+
+#include <stdint.h>
+#include <string.h>
+#include "Mutex.hpp"
+#include "MutexLock.hpp"
+#include "ObjectsPool.hpp"
+#include "PointerHash.hpp"
+
+
+namespace leaktracer {
+
+// identifies a stack in a StackTable, 0 is "no stack"
+typedef uint32_t stack_id_t;
+#define NO_STACK_ID ((stack_id_t)0)
+
+/**
+ * Global table of allocation stacks: each distinct stack is
+ * stored once, and identified by a small ID, allocations only
+ * keep the ID.
+ *
+ * Stacks have any number of frames, each one is stored in an
+ * arena slot of its own size. Stacks are never removed, so IDs
+ * and frames stay valid for the life of the table.
+ *
+ * Lookups don't lock: stacks are looked up in an open addressing
+ * index of IDs, by hash. Only adding a new stack takes the mutex.
+ * The index is replaced by a twice bigger one when half full,
+ * replaced indexes are kept until destruction, as lookups may
+ * still be reading them.
+ *
+ * Each stack also keeps counters of the allocations made from
+ * it, so that a heap profile is read in O(stacks), without
+ * walking the allocations. Threads count in their own
+ * thread_counters_t first, folded in the counters of the stacks
+ * with relaxed atomics when another stack needs their slot, so
+ * that threads allocating from the same stacks don't share their
+ * cache lines on each allocation.
+ *
+ * Nothing is allocated until the first stack is added.
+ */
+class StackTable {
+public:
+	StackTable(void);
+	virtual ~StackTable(void);
+
+	/** Returns the ID of given stack, adds it if not known yet.
+	 *  Returns NO_STACK_ID if it could not be added */
+	stack_id_t intern(void * const *frames, unsigned int numOfFrames);
+
+	/** Returns the frames of a stack, and their number in
+	 *  numOfFrames, NULL for NO_STACK_ID */
+	inline void * const * getFrames(stack_id_t id, unsigned int *numOfFrames);
+
+	/** number of distinct stacks */
+	inline unsigned long size(void) { return __atomic_load_n(&__count, __ATOMIC_ACQUIRE); }
+
+	/** allocations made from a stack: live ones, and all of them
+	 *  since the table was created */
+	typedef struct {
+		int64_t liveBlocks;
+		int64_t liveBytes;
+		uint64_t allocatedBlocks;
+		uint64_t allocatedBytes;
+	} stack_counters_t;
+
+	/** counters of one thread not added to the stacks yet, a slot
+	 *  per stack (direct mapped by ID). Only written by their
+	 *  thread, must be zeroed before use */
+#define STACK_TABLE_THREAD_SLOTS	16
+	typedef struct {
+		struct {
+			stack_id_t id;
+			stack_counters_t counters;
+		} slots[STACK_TABLE_THREAD_SLOTS];
+	} thread_counters_t;
+
+	/** counts an allocation (or a reallocation) of blocks blocks
+	 *  and bytes bytes from a stack, ignored for NO_STACK_ID. In
+	 *  the counters of calling thread if pending is not NULL */
+	inline void countAllocation(thread_counters_t *pending, stack_id_t id, int64_t blocks, int64_t bytes);
+	/** counts the release of what countAllocation() counted */
+	inline void countRelease(thread_counters_t *pending, stack_id_t id, int64_t blocks, int64_t bytes);
+	/** adds the counters of a thread to the stacks, and zeroes
+	 *  them, the thread must not count meanwhile */
+	void fold(thread_counters_t &pending);
+	/** reads the counters of a stack, id must not be NO_STACK_ID.
+	 *  Counters of threads are not included */
+	inline void getCounters(stack_id_t id, stack_counters_t *pCounters);
+	/** adds the counters of a thread, which may count meanwhile,
+	 *  to counters (indexed by ID, stacks up to numOfStacks) */
+	void addPending(const thread_counters_t &pending, stack_counters_t *counters, unsigned long numOfStacks);
+	/** forgets the live allocations counted until now by all
+	 *  stacks, when the allocations are forgotten, and by the
+	 *  counters of a thread with discardPendingLive() */
+	void clearLiveCounters(void);
+	void discardPendingLive(const thread_counters_t &pending);
+
+	/** bytes allocated for the stacks and their index */
+	inline size_t getMemoryUsage(void) { return __atomic_load_n(&__memoryUsage, __ATOMIC_RELAXED); }
+
+private:
+	typedef struct _stack_entry_struct {
+		uint64_t hash;
+		stack_counters_t counters;
+		unsigned int numOfFrames;
+		void *frames[1];				// numOfFrames frames
+	} stack_entry_t;
+
+	// entries are allocated from arena chunks, linked by their
+	// first word for destruction
+#define STACK_TABLE_ARENA_CHUNK_SIZE	(1 << 16)
+	char *__arenaChunk;
+	size_t __arenaUsed;
+	inline stack_entry_t * allocateEntry(unsigned int numOfFrames);
+
+	// ID to entry, stored in chunks, so they never move,
+	// entry of ID id is entry (id - 1)
+#define STACK_TABLE_CHUNK_BITS	10
+#define STACK_TABLE_CHUNK_SIZE	(1 << STACK_TABLE_CHUNK_BITS)
+#define STACK_TABLE_MAX_CHUNKS	(1 << 12)
+	stack_entry_t **__entries[STACK_TABLE_MAX_CHUNKS];
+	stack_id_t __count;
+
+	inline stack_entry_t * getEntry(stack_id_t id);
+
+	// counters of threads, see thread_counters_t
+	template <typename C> static inline void addToCounter(C &counter, C value)
+	{ __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED); }
+	inline stack_counters_t & getPendingCounters(thread_counters_t &pending, stack_id_t id);
+	inline void foldSlot(thread_counters_t &pending, unsigned int iSlot);
+
+	// open addressing index (linear probing) of IDs,
+	// capacity is a power of 2
+	typedef struct _index_struct {
+		struct _index_struct *previous;		// replaced index
+		unsigned long capacity;
+		stack_id_t ids[1];					// capacity IDs
+	} index_t;
+#define STACK_TABLE_MIN_INDEX_CAPACITY	(1 << 10)
+	index_t *__index;
+
+	static inline uint64_t hash(void * const *frames, unsigned int numOfFrames);
+	inline stack_id_t lookup(void * const *frames, unsigned int numOfFrames, uint64_t h);
+	inline void addToIndex(index_t *index, stack_id_t id);
+	bool growIndex(void);
+
+	// serializes additions
+	Mutex __mutex;
+	// bytes allocated, written with the mutex locked
+	size_t __memoryUsage;
+	inline void addMemoryUsage(size_t bytes)
+	{ __atomic_store_n(&__memoryUsage, __memoryUsage + bytes, __ATOMIC_RELAXED); }
+};
+
+
+//////////////////////////////////////////////////////////////////////
+//
+// IMPLEMENTATION: StackTable
+// (inline functions)
+//
+//////////////////////////////////////////////////////////////////////
+
+// FNV-1a on the frames, mixed at the end as the low bits
+// select the index slot
+inline uint64_t StackTable::hash(void * const *frames, unsigned int numOfFrames)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (unsigned int i = 0; i < numOfFrames; i++) {
+		h ^= reinterpret_cast<uintptr_t>(frames[i]);
+		h *= 0x100000001b3ULL;
+	}
+	return hashPointer(reinterpret_cast<void*>(h));
+}
+
+
+inline StackTable::stack_entry_t * StackTable::getEntry(stack_id_t id)
+{
+	stack_entry_t **chunk = __atomic_load_n(&__entries[(id - 1) >> STACK_TABLE_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&chunk[(id - 1) & (STACK_TABLE_CHUNK_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+
+inline void * const * StackTable::getFrames(stack_id_t id, unsigned int *numOfFrames)
+{
+	if (id == NO_STACK_ID) {
+		*numOfFrames = 0;
+		return NULL;
+	}
+	stack_entry_t *entry = getEntry(id);
+	*numOfFrames = entry->numOfFrames;
+	return entry->frames;
+}
+
+
+inline void StackTable::countAllocation(thread_counters_t *pending, stack_id_t id, int64_t blocks, int64_t bytes)
+{
+	if (id == NO_STACK_ID)
+		return;
+	if (pending != NULL) {
+		stack_counters_t &counters = getPendingCounters(*pending, id);
+		addToCounter(counters.liveBlocks, blocks);
+		addToCounter(counters.liveBytes, bytes);
+		addToCounter(counters.allocatedBlocks, (uint64_t)blocks);
+		addToCounter(counters.allocatedBytes, (uint64_t)bytes);
+		return;
+	}
+	stack_counters_t &counters = getEntry(id)->counters;
+	__atomic_add_fetch(&counters.liveBlocks, blocks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counters.liveBytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counters.allocatedBlocks, blocks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counters.allocatedBytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+inline void StackTable::countRelease(thread_counters_t *pending, stack_id_t id, int64_t blocks, int64_t bytes)
+{
+	if (id == NO_STACK_ID)
+		return;
+	if (pending != NULL) {
+		stack_counters_t &counters = getPendingCounters(*pending, id);
+		addToCounter(counters.liveBlocks, -blocks);
+		addToCounter(counters.liveBytes, -bytes);
+		return;
+	}
+	stack_counters_t &counters = getEntry(id)->counters;
+	__atomic_sub_fetch(&counters.liveBlocks, blocks, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&counters.liveBytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+// counters of the slot of a stack in the counters of calling
+// thread, the stack using the slot before is folded first
+inline StackTable::stack_counters_t & StackTable::getPendingCounters(thread_counters_t &pending, stack_id_t id)
+{
+	unsigned int iSlot = id & (STACK_TABLE_THREAD_SLOTS - 1);
+	if (pending.slots[iSlot].id != id) {
+		if (pending.slots[iSlot].id != NO_STACK_ID)
+			foldSlot(pending, iSlot);
+		__atomic_store_n(&pending.slots[iSlot].id, id, __ATOMIC_RELAXED);
+	}
+	return pending.slots[iSlot].counters;
+}
+
+
+// adds a slot of a thread to the counters of its stack, readers of
+// the slot may see its counters in both of them meanwhile
+inline void StackTable::foldSlot(thread_counters_t &pending, unsigned int iSlot)
+{
+	stack_counters_t &from = pending.slots[iSlot].counters;
+	stack_counters_t &counters = getEntry(pending.slots[iSlot].id)->counters;
+	if (from.liveBlocks != 0)
+		__atomic_add_fetch(&counters.liveBlocks, from.liveBlocks, __ATOMIC_RELAXED);
+	if (from.liveBytes != 0)
+		__atomic_add_fetch(&counters.liveBytes, from.liveBytes, __ATOMIC_RELAXED);
+	if (from.allocatedBlocks != 0)
+		__atomic_add_fetch(&counters.allocatedBlocks, from.allocatedBlocks, __ATOMIC_RELAXED);
+	if (from.allocatedBytes != 0)
+		__atomic_add_fetch(&counters.allocatedBytes, from.allocatedBytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&pending.slots[iSlot].id, NO_STACK_ID, __ATOMIC_RELAXED);
+	__atomic_store_n(&from.liveBlocks, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&from.liveBytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&from.allocatedBlocks, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&from.allocatedBytes, 0, __ATOMIC_RELAXED);
+}
+
+
+// counters are read one by one, they may be updated meanwhile
+inline void StackTable::getCounters(stack_id_t id, stack_counters_t *pCounters)
+{
+	stack_counters_t &counters = getEntry(id)->counters;
+	pCounters->liveBlocks = __atomic_load_n(&counters.liveBlocks, __ATOMIC_RELAXED);
+	pCounters->liveBytes = __atomic_load_n(&counters.liveBytes, __ATOMIC_RELAXED);
+	pCounters->allocatedBlocks = __atomic_load_n(&counters.allocatedBlocks, __ATOMIC_RELAXED);
+	pCounters->allocatedBytes = __atomic_load_n(&counters.allocatedBytes, __ATOMIC_RELAXED);
+}
+
+
+// returns the ID of the stack, or NO_STACK_ID if not found.
+// An ID is published in the index only once its entry is
+// written, and the index is never full, so this doesn't lock.
+inline stack_id_t StackTable::lookup(void * const *frames, unsigned int numOfFrames, uint64_t h)
+{
+	index_t *index = __atomic_load_n(&__index, __ATOMIC_ACQUIRE);
+	if (index == NULL)
+		return NO_STACK_ID;
+
+	for (unsigned long i = h & (index->capacity - 1); ; i = (i + 1) & (index->capacity - 1)) {
+		stack_id_t id = __atomic_load_n(&index->ids[i], __ATOMIC_ACQUIRE);
+		if (id == NO_STACK_ID)
+			return NO_STACK_ID;
+		stack_entry_t *entry = getEntry(id);
+		if (entry->hash == h && entry->numOfFrames == numOfFrames &&
+			memcmp(entry->frames, frames, numOfFrames * sizeof(void*)) == 0)
+			return id;
+	}
+}
+
+
+// mutex must be locked
+inline void StackTable::addToIndex(index_t *index, stack_id_t id)
+{
+	unsigned long i = getEntry(id)->hash & (index->capacity - 1);
+	while (index->ids[i] != NO_STACK_ID)
+		i = (i + 1) & (index->capacity - 1);
+	__atomic_store_n(&index->ids[i], id, __ATOMIC_RELEASE);
+}
+
+
+}  // end namespace
+
+
+#endif  // include once
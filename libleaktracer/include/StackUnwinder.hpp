@@ -0,0 +1,101 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __STACK_UNWINDER_h_included__
+#define __STACK_UNWINDER_h_included__
+
+#include <pthread.h>
+#include <stdint.h>
+
+
+// frame layout is known on these: the frame pointer points to
+// the saved frame pointer of the caller, followed by the return
+// address
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#	define LEAKTRACER_FRAME_POINTER_UNWINDER
+#endif
+
+
+namespace leaktracer {
+
+/**
+ * Gets the bounds of the stack of calling thread, returns false
+ * if unknown. pthread_getattr_np() may allocate memory (for the
+ * main thread), monitoring must be disabled.
+ */
+inline bool getThreadStackBounds(void **pLow, void **pHigh)
+{
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+	bool found = false;
+
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+		return false;
+	if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+		*pLow = addr;
+		*pHigh = static_cast<char*>(addr) + size;
+		found = true;
+	}
+	pthread_attr_destroy(&attr);
+	return found;
+}
+
+
+#ifdef LEAKTRACER_FRAME_POINTER_UNWINDER
+/**
+ * Stores up to maxFrames return addresses of the callers of the
+ * function this is inlined in, by following the frame pointers.
+ * Returns the number of frames stored.
+ *
+ * Code built without frame pointers breaks the chain: every frame
+ * must be inside [stackLow, stackHigh[, aligned, and above the
+ * previous one (the stack grows down), otherwise the walk stops,
+ * so a bogus frame pointer is never dereferenced.
+ */
+__attribute__ ((always_inline))
+inline unsigned int unwindFramePointers(void **frames, unsigned int maxFrames, void *stackLow, void *stackHigh)
+{
+	uintptr_t low = reinterpret_cast<uintptr_t>(stackLow);
+	uintptr_t high = reinterpret_cast<uintptr_t>(stackHigh);
+	void **fp = static_cast<void**>(__builtin_frame_address(0));
+	unsigned int iIndex = 0;
+
+	// bounds unknown
+	if (high <= low + 2 * sizeof(void*))
+		return 0;
+
+	while (iIndex < maxFrames) {
+		uintptr_t addr = reinterpret_cast<uintptr_t>(fp);
+		if (addr < low || addr > high - 2 * sizeof(void*) || (addr & (sizeof(void*) - 1)) != 0)
+			break;
+
+		void *ret = fp[1];
+		if (ret == NULL)
+			break;
+		frames[iIndex++] = ret;
+
+		void **next = static_cast<void**>(fp[0]);
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+	return iIndex;
+}
+#endif
+
+
+}  // end namespace
+
+
+#endif  // include once
@@ -0,0 +1,490 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef __THREAD_CACHING_OBJECTS_POOL_h_included__
+#define __THREAD_CACHING_OBJECTS_POOL_h_included__
+
+#include "ObjectsPool.hpp"
+#include "LeakTracer_l.hpp"
+#include <string.h>
+
+
+namespace leaktracer {
+
+/**
+ * Same as TObjectsPool, but each thread keeps a few free cells
+ * of its own (its magazine), so that most allocate()/release()
+ * calls don't lock the pool mutex. The shared free list (the
+ * depot) refills empty magazines and takes the overflow of full
+ * ones, half a magazine at a time.
+ *
+ * Each thread has a single magazine, used with the first pool of
+ * this type the thread allocates from or releases to, other pools
+ * of the same type always use their depot. A thread gives its
+ * cells back with releaseThreadCache(), called by the destructor
+ * of a thread-specific key of the pool when the thread exits, the
+ * pool is then used by this thread through the depot only. The key
+ * is created with the pool, before the keys of the program, so
+ * that setting it doesn't allocate memory.
+ *
+ * Without USE_TLS, there are no magazines.
+ *
+ * Chunks whose cells are all back in the depot are given back to
+ * the chunk allocator by trim(), which walks the whole depot.
+ * Releases never trim: once the depot has grown well above its
+ * low-water mark since the last trim (after a big burst of
+ * releases), the trim is only marked due, and trimIfDue() runs it
+ * from a thread holding no other lock.
+ */
+template <typename T,
+	unsigned int NumOfElementsInChunk,
+	typename CHUNK_ALLOCATOR = TDefaultChunkAllocator< t_list_element<T>, NumOfElementsInChunk > >
+class TThreadCachingObjectsPool
+{
+public:
+	TThreadCachingObjectsPool();
+	~TThreadCachingObjectsPool();
+
+	//---------------------------------
+	// Returns a pointer to free object
+	// NOTE: no constructor is executed
+	inline void * allocate();
+
+	//---------------------------------
+	// Releases object when unused
+	inline void release( void *p );
+
+	//---------------------------------
+	// Gives the cells cached by calling thread back to the depot
+	void releaseThreadCache();
+
+	//---------------------------------
+	// Releases chunks with no cell in use
+	void trim();
+	void trimIfDue();
+
+	//---------------------------------
+	// statistics
+	unsigned long getNumOfChunks();
+	size_t getMemoryUsage();
+
+private:
+	// free cells cached by one thread
+	typedef struct {
+		void *owner;						// pool using it
+		t_list_element<T> *first_free_cell;
+		unsigned int count;
+	} magazine_t;
+#define MAGAZINE_SIZE		64
+	// owner of a magazine released by releaseThreadCache()
+#define MAGAZINE_RETIRED	((void*)1)
+
+#ifdef USE_TLS
+	static LEAKTRACER_TLS magazine_t __magazine;
+	inline magazine_t * getMagazine();
+	// set when a thread takes its magazine, to release it on exit
+	pthread_key_t __magazine_key;
+	bool __magazine_key_valid;
+	static void releaseThreadCacheOnExit( void *pPool );
+#endif
+	void refill( magazine_t *m );
+	void flush( magazine_t *m, unsigned int count );
+
+	// depot, locked by __mutex
+	void * allocate_unlocked();
+	void release_unlocked( void *p );
+	bool allocateChunk();
+	inline void takenFromDepot( unsigned int count );
+	inline void addedToDepot( unsigned int count );
+	void trim_unlocked();
+	unsigned long chunkIndex( t_list_element<T> *pCell );
+
+	CHUNK_ALLOCATOR __allocator;
+	t_list_element<T> *__first_free_cell;
+	unsigned long __num_of_chunks;
+	// chunks, sorted by address
+	t_list_element<T> **__chunks;
+	unsigned long __chunks_capacity;
+	// free cells in the depot, and their lowest number since
+	// the last trim
+	unsigned long __num_of_free_cells;
+	unsigned long __free_cells_low_water;
+	bool __trim_due;		// read without __mutex by trimIfDue()
+	Mutex __mutex;
+};
+
+
+
+//======================================================
+// Implementation
+//======================================================
+
+#ifdef USE_TLS
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+LEAKTRACER_TLS typename TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::magazine_t
+	TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::__magazine;
+#endif
+
+
+//---------------------------------
+// constructor
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::TThreadCachingObjectsPool()
+: __first_free_cell( FREE_CELL_NONE ), __num_of_chunks(0),
+  __chunks(NULL), __chunks_capacity(0),
+  __num_of_free_cells(0), __free_cells_low_water(0), __trim_due(false)
+{
+#ifdef USE_TLS
+	__magazine_key_valid = (pthread_key_create(&__magazine_key, releaseThreadCacheOnExit) == 0);
+#endif
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::~TThreadCachingObjectsPool()
+{
+#ifdef USE_TLS
+	if (__magazine_key_valid)
+		pthread_key_delete(__magazine_key);
+#endif
+}
+
+
+#ifdef USE_TLS
+//---------------------------------
+// returns magazine of calling thread, NULL if it
+// belongs to another pool or was released
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+inline typename TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::magazine_t *
+TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::getMagazine()
+{
+	magazine_t *m = &__magazine;
+	if (__builtin_expect(m->owner == this, true))
+		return m;
+	if (m->owner != NULL)
+		return NULL;
+	// without the key, the cells would be lost on thread exit
+	if (!__magazine_key_valid) {
+		m->owner = MAGAZINE_RETIRED;
+		return NULL;
+	}
+	m->owner = this;
+	pthread_setspecific(__magazine_key, this);
+	return m;
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::releaseThreadCacheOnExit( void *pPool )
+{
+	static_cast<TThreadCachingObjectsPool *>(pPool)->releaseThreadCache();
+}
+#endif
+
+
+//---------------------------------
+// allocating objects
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+inline void * TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::allocate()
+{
+#ifdef USE_TLS
+	magazine_t *m = getMagazine();
+	if (m != NULL) {
+		if (m->first_free_cell == FREE_CELL_NONE) {
+			refill(m);
+			if (m->first_free_cell == FREE_CELL_NONE)
+				return NULL;
+		}
+		t_list_element<T> *pCell = m->first_free_cell;
+		m->first_free_cell = pCell->next_free_cell;
+		m->count --;
+		return static_cast<void*>( &(pCell->data) );
+	}
+#endif
+
+	MutexLock lock(__mutex);
+	return allocate_unlocked();
+}
+
+
+//---------------------------------
+// releasing objects
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+inline void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::release( void *p )
+{
+	if( p == NULL ) return;
+
+#ifdef USE_TLS
+	magazine_t *m = getMagazine();
+	if (m != NULL) {
+		t_list_element<T> *pReleased = reinterpret_cast<t_list_element<T> *>( p );
+		pReleased->next_free_cell = m->first_free_cell;
+		m->first_free_cell = pReleased;
+		if (++ m->count > MAGAZINE_SIZE)
+			flush(m, MAGAZINE_SIZE / 2);
+		return;
+	}
+#endif
+
+	MutexLock lock(__mutex);
+	release_unlocked(p);
+}
+
+
+//---------------------------------
+// moves half a magazine of cells from the depot
+// to the magazine, which is empty
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::refill( magazine_t *m )
+{
+	MutexLock lock(__mutex);
+	if( FREE_CELL_NONE == __first_free_cell && !allocateChunk() )
+		return;
+
+	t_list_element<T> *pLast = __first_free_cell;
+	unsigned int count = 1;
+	while (count < MAGAZINE_SIZE / 2 && pLast->next_free_cell != FREE_CELL_NONE) {
+		pLast = pLast->next_free_cell;
+		count ++;
+	}
+	m->first_free_cell = __first_free_cell;
+	m->count = count;
+	__first_free_cell = pLast->next_free_cell;
+	pLast->next_free_cell = FREE_CELL_NONE;
+	takenFromDepot(count);
+}
+
+
+//---------------------------------
+// moves count cells (at most all) of the magazine
+// to the depot
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::flush( magazine_t *m, unsigned int count )
+{
+	if (count > m->count)
+		count = m->count;
+	if (count == 0)
+		return;
+
+	t_list_element<T> *pFirst = m->first_free_cell;
+	t_list_element<T> *pLast = pFirst;
+	for (unsigned int i = 1; i < count; i++)
+		pLast = pLast->next_free_cell;
+	m->first_free_cell = pLast->next_free_cell;
+	m->count -= count;
+
+	MutexLock lock(__mutex);
+	pLast->next_free_cell = __first_free_cell;
+	__first_free_cell = pFirst;
+	addedToDepot(count);
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::releaseThreadCache()
+{
+#ifdef USE_TLS
+	magazine_t *m = &__magazine;
+	if (m->owner != this)
+		return;
+	flush(m, m->count);
+	m->owner = MAGAZINE_RETIRED;
+#endif
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::trim()
+{
+	MutexLock lock(__mutex);
+	trim_unlocked();
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::trimIfDue()
+{
+	if (!__atomic_load_n(&__trim_due, __ATOMIC_RELAXED))
+		return;
+	MutexLock lock(__mutex);
+	if (__trim_due)
+		trim_unlocked();
+}
+
+
+//---------------------------------
+// adds a chunk of free cells to the depot
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+bool TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::allocateChunk()
+{
+	if (__num_of_chunks == __chunks_capacity) {
+		unsigned long capacity = __chunks_capacity ? __chunks_capacity * 2 : 16;
+		t_list_element<T> **chunks = static_cast<t_list_element<T> **>(LT_MALLOC(capacity * sizeof(t_list_element<T> *)));
+		if( NULL == chunks )
+			return false;
+		if (__chunks != NULL) {
+			memcpy(chunks, __chunks, __num_of_chunks * sizeof(t_list_element<T> *));
+			LT_FREE(__chunks);
+		}
+		__chunks = chunks;
+		__chunks_capacity = capacity;
+	}
+
+	t_list_element<T> *pChunk = __allocator.allocate();
+	if( NULL == pChunk )
+		return false;
+
+	for( unsigned int i = 0; i < NumOfElementsInChunk; i++ )
+		pChunk[i].next_free_cell = pChunk + i + 1;
+	pChunk[NumOfElementsInChunk - 1].next_free_cell = __first_free_cell;
+	__first_free_cell = pChunk;
+
+	unsigned long iPos = __num_of_chunks;
+	while (iPos > 0 && __chunks[iPos - 1] > pChunk) {
+		__chunks[iPos] = __chunks[iPos - 1];
+		iPos --;
+	}
+	__chunks[iPos] = pChunk;
+	__num_of_chunks ++;
+	// new cells are not a burst of releases
+	__num_of_free_cells += NumOfElementsInChunk;
+	__free_cells_low_water += NumOfElementsInChunk;
+	return true;
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+inline void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::takenFromDepot( unsigned int count )
+{
+	__num_of_free_cells -= count;
+	if (__num_of_free_cells < __free_cells_low_water)
+		__free_cells_low_water = __num_of_free_cells;
+}
+
+
+// a trim is due once the depot has grown above its low-water mark
+// by a few chunks, and by a quarter of its cells: the trim walks
+// at most 4 cells per cell released since the last one. Cells
+// kept free by partly used chunks don't delay the next trim much.
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+inline void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::addedToDepot( unsigned int count )
+{
+	__num_of_free_cells += count;
+	unsigned long released = __num_of_free_cells - __free_cells_low_water;
+	if (released > 4 * NumOfElementsInChunk && 4 * released > __num_of_free_cells)
+		__atomic_store_n(&__trim_due, true, __ATOMIC_RELAXED);
+}
+
+
+// index of the chunk holding given cell
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+unsigned long TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::chunkIndex( t_list_element<T> *pCell )
+{
+	unsigned long low = 0, high = __num_of_chunks;
+	while (high - low > 1) {
+		unsigned long middle = (low + high) / 2;
+		if (__chunks[middle] <= pCell)
+			low = middle;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+
+//---------------------------------
+// counts free cells of each chunk in the depot, and releases
+// the chunks with all their cells free. Cells in magazines are
+// in use as far as the depot knows.
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::trim_unlocked()
+{
+	__atomic_store_n(&__trim_due, false, __ATOMIC_RELAXED);
+	__free_cells_low_water = __num_of_free_cells;
+	if (__num_of_free_cells < NumOfElementsInChunk)
+		return;
+
+	unsigned int *freeCells = static_cast<unsigned int *>(LT_CALLOC(__num_of_chunks, sizeof(unsigned int)));
+	if (freeCells == NULL)
+		return;
+	for (t_list_element<T> *pCell = __first_free_cell; pCell != FREE_CELL_NONE; pCell = pCell->next_free_cell)
+		freeCells[chunkIndex(pCell)] ++;
+
+	// unlink cells of empty chunks from the free list
+	t_list_element<T> **ppCell = &__first_free_cell;
+	while (*ppCell != FREE_CELL_NONE) {
+		if (freeCells[chunkIndex(*ppCell)] == NumOfElementsInChunk) {
+			*ppCell = (*ppCell)->next_free_cell;
+			__num_of_free_cells --;
+		} else {
+			ppCell = &(*ppCell)->next_free_cell;
+		}
+	}
+
+	unsigned long kept = 0;
+	for (unsigned long i = 0; i < __num_of_chunks; i++) {
+		if (freeCells[i] == NumOfElementsInChunk)
+			__allocator.release(__chunks[i]);
+		else
+			__chunks[kept++] = __chunks[i];
+	}
+	__num_of_chunks = kept;
+	__free_cells_low_water = __num_of_free_cells;
+	LT_FREE(freeCells);
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void * TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::allocate_unlocked()
+{
+	if( FREE_CELL_NONE == __first_free_cell && !allocateChunk() )
+		return NULL;
+
+	void* retVal = static_cast<void*>( &(__first_free_cell->data) );
+	__first_free_cell = __first_free_cell->next_free_cell;
+	takenFromDepot(1);
+	return retVal;
+}
+
+
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+void TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::release_unlocked( void *p )
+{
+	t_list_element<T> *pReleased = reinterpret_cast<t_list_element<T> *>( p );
+	pReleased->next_free_cell = __first_free_cell;
+	__first_free_cell = pReleased;
+	addedToDepot(1);
+}
+
+
+// Statistics
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+unsigned long TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::getNumOfChunks()
+{
+	return __num_of_chunks;
+}
+
+// bytes of the chunks, and of their array
+template <typename T, unsigned int NumOfElementsInChunk, typename CHUNK_ALLOCATOR>
+size_t TThreadCachingObjectsPool<T, NumOfElementsInChunk, CHUNK_ALLOCATOR>::getMemoryUsage()
+{
+	MutexLock lock(__mutex);
+	return __allocator.getMemoryUsage(__num_of_chunks) +
+		__chunks_capacity * sizeof(t_list_element<T> *);
+}
+
+
+}; // namespace
+
+
+#endif  // include once
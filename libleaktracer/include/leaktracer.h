@@ -21,9 +21,60 @@ void leaktracer_stopMonitoringAllocations(void);
 /** stops all monitoring - both of allocations and releases */
 void leaktracer_stopAllMonitoring(void);
 
-/** writes report with all memory leaks */
+/** writes report with all memory leaks, in the format set by
+ *  LEAKTRACER_REPORT_FORMAT */
 void leaktracer_writeLeaksToFile(const char* reportFileName);
 
+/** writes binary report with all memory leaks (see
+ *  leaktracer_report.h) */
+void leaktracer_writeLeaksToBinaryFile(const char* reportFileName);
+
+/** writes all memory leaks as a pprof profile (gzipped
+ *  profile.proto) */
+void leaktracer_writeLeaksToPprofFile(const char* reportFileName);
+
+/** writes report of memory leaks aggregated by call stack,
+ *  biggest first, only the top ones if top is not 0 */
+void leaktracer_writeAggregatedLeaksToFile(const char* reportFileName, unsigned long top);
+
+/** writes the heap profile (LEAKTRACER_HEAP_PROFILE): live and
+ *  allocated memory by call stack, biggest live first, only the
+ *  top ones if top is not 0 */
+void leaktracer_writeHeapProfileToFile(const char* reportFileName, unsigned long top);
+
+/** starts a new generation of allocations, and returns its number
+ *  (see MemoryTrace::markGeneration) */
+unsigned int leaktracer_markGeneration(void);
+
+/** writes report with memory leaks allocated in generations
+ *  firstGeneration to lastGeneration, in the format set by
+ *  LEAKTRACER_REPORT_FORMAT */
+void leaktracer_writeGenerationsLeaksToFile(const char* reportFileName, unsigned int firstGeneration, unsigned int lastGeneration);
+
+/** returns how long (in ns) allocations were stalled for the last
+ *  snapshot report (LEAKTRACER_REPORT_SNAPSHOT), 0 if none */
+unsigned long long leaktracer_getLastSnapshotStall(void);
+
+/** allocation statistics (see MemoryTrace::stats_t) */
+typedef struct {
+	unsigned long long allocations;
+	unsigned long long releases;
+	unsigned long long allocatedBytes;
+	unsigned long long releasedBytes;
+	unsigned long long trackedAllocations;
+	unsigned long long trackedReleases;
+	unsigned long long untrackedAllocations;
+	unsigned long long untrackedReleases;
+	unsigned long long liveBlocks;
+	unsigned long long liveBytes;
+	unsigned long long metadataBytes;
+	unsigned long long mapOverflows;
+} leaktracer_stats_t;
+
+/** sums the per-thread counters of allocations, in time
+ *  proportional to the number of threads, not of allocations */
+void leaktracer_getStats(leaktracer_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
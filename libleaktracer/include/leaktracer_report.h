@@ -0,0 +1,88 @@
+#ifndef __LEAKTRACER_REPORT_H__
+#define __LEAKTRACER_REPORT_H__
+
+#include <stdint.h>
+
+/**
+ * Binary leaks report (LEAKTRACER_REPORT_FORMAT=binary), written
+ * in the byte order of the host. All sections are 8 bytes
+ * aligned, at the offsets (from the start of the file) given by
+ * the header, so that the file can be used mmap()-ed:
+ *
+ * header            leaktracer_report_header_t
+ * modules           numOfModules leaktracer_report_module_t
+ * strings           stringsSize bytes of NUL terminated strings
+ * leaks             numOfLeaks records of leakRecordSize bytes,
+ *                   each one a leaktracer_report_leak_t followed
+ *                   by leakDataSize bytes of data
+ * stacks            numOfStacks leaktracer_report_stack_t
+ * frames            numOfFrames leaktracer_report_frame_t
+ *
+ * helpers/leak-report-to-text converts it to the text report.
+ */
+
+#define LEAKTRACER_REPORT_MAGIC		"LTREPORT"
+#define LEAKTRACER_REPORT_VERSION	1
+
+/* header flags */
+#define LEAKTRACER_REPORT_TIMESTAMP_SEQUENCE	0x1	/* leak times are sequence numbers */
+
+typedef struct {
+	char magic[8];				/* LEAKTRACER_REPORT_MAGIC, not NUL terminated */
+	uint32_t version;			/* LEAKTRACER_REPORT_VERSION */
+	uint32_t headerSize;		/* sizeof(leaktracer_report_header_t) */
+	int64_t diffUtcMono;		/* CLOCK_REALTIME - CLOCK_MONOTONIC, in ns */
+	uint64_t sampleBytes;		/* LEAKTRACER_SAMPLE_BYTES, 0 if not sampling */
+	uint32_t flags;
+	uint32_t leakRecordSize;
+	uint32_t leakDataSize;
+	uint32_t numOfModules;
+	uint64_t modulesOffset;
+	uint64_t stringsOffset;
+	uint64_t stringsSize;
+	uint64_t leaksOffset;
+	uint64_t numOfLeaks;
+	uint64_t stacksOffset;
+	uint64_t numOfStacks;
+	uint64_t framesOffset;
+	uint64_t numOfFrames;
+	uint64_t snapshotStall;		/* ns allocations were stalled for a snapshot report, 0 if not one */
+	uint32_t firstGeneration;	/* generations of the leaks written, 0 and */
+	uint32_t lastGeneration;	/* 0xffffffff for all of them */
+} leaktracer_report_header_t;
+
+typedef struct {
+	uint64_t base;				/* load base */
+	uint64_t path;				/* offsets in strings */
+	uint64_t buildId;			/* hexadecimal, empty if unknown */
+} leaktracer_report_module_t;
+
+/* leak flags */
+#define LEAKTRACER_REPORT_LEAK_ARRAY	0x1		/* allocated by new[] */
+#define LEAKTRACER_REPORT_NO_STACK		0xffffffff
+
+typedef struct {
+	uint64_t address;
+	uint64_t size;
+	double time;				/* seconds of CLOCK_MONOTONIC, or sequence number */
+	uint32_t stack;				/* index in stacks, or LEAKTRACER_REPORT_NO_STACK */
+	float weight;				/* allocations it stands for, 1 if not sampling */
+	uint32_t flags;
+	uint32_t dataSize;			/* bytes of data used */
+} leaktracer_report_leak_t;
+
+typedef struct {
+	uint64_t firstFrame;		/* index in frames */
+	uint32_t numOfFrames;
+	uint32_t reserved;
+} leaktracer_report_stack_t;
+
+#define LEAKTRACER_REPORT_NO_MODULE		0xffffffff
+
+typedef struct {
+	uint64_t offset;			/* from the module base, address if no module */
+	uint32_t module;			/* index in modules, or LEAKTRACER_REPORT_NO_MODULE */
+	uint32_t reserved;
+} leaktracer_report_frame_t;
+
+#endif /* __LEAKTRACER_REPORT_H__ */
@@ -23,7 +23,9 @@ void* operator new(size_t size) {
 	void *p;
 	leaktracer::MemoryTrace::Setup();
 
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	p = LT_MALLOC(size);
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 	leaktracer::MemoryTrace::GetInstance().registerAllocation(p, size, false);
 
 	return p;
@@ -34,7 +36,9 @@ void* operator new[] (size_t size) {
 	void *p;
 	leaktracer::MemoryTrace::Setup();
 
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	p = LT_MALLOC(size);
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 	leaktracer::MemoryTrace::GetInstance().registerAllocation(p, size, true);
 
 	return p;
@@ -45,7 +49,9 @@ void operator delete (void *p) {
 	leaktracer::MemoryTrace::Setup();
 
 	leaktracer::MemoryTrace::GetInstance().registerRelease(p, false);
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	LT_FREE(p);
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 }
 
 
@@ -53,7 +59,9 @@ void operator delete[] (void *p) {
 	leaktracer::MemoryTrace::Setup();
 
 	leaktracer::MemoryTrace::GetInstance().registerRelease(p, true);
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	LT_FREE(p);
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 }
 
 /** -- libc memory operators -- **/
@@ -69,9 +77,11 @@ void *malloc(size_t size)
 	void *p;
 	leaktracer::MemoryTrace::Setup();
 
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	leaktracer::MemoryTrace::GetInstance().InternalMonitoringDisablerThreadUp();
 	p = LT_MALLOC(size);
 	leaktracer::MemoryTrace::GetInstance().InternalMonitoringDisablerThreadDown();
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 	leaktracer::MemoryTrace::GetInstance().registerAllocation(p, size, false);
 
 	return p;
@@ -82,7 +92,9 @@ void free(void* ptr)
 	leaktracer::MemoryTrace::Setup();
 
 	leaktracer::MemoryTrace::GetInstance().registerRelease(ptr, false);
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	LT_FREE(ptr);
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 }
 
 void* realloc(void *ptr, size_t size)
@@ -90,11 +102,13 @@ void* realloc(void *ptr, size_t size)
 	void *p;
 	leaktracer::MemoryTrace::Setup();
 
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	leaktracer::MemoryTrace::GetInstance().InternalMonitoringDisablerThreadUp();
 
 	p = LT_REALLOC(ptr, size);
 
 	leaktracer::MemoryTrace::GetInstance().InternalMonitoringDisablerThreadDown();
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 
 	if (p != ptr)
 	{
@@ -115,9 +129,11 @@ void* calloc(size_t nmemb, size_t size)
 	void *p;
 	leaktracer::MemoryTrace::Setup();
 
+	uint64_t start = leaktracer::MemoryTrace::hookClock();
 	leaktracer::MemoryTrace::GetInstance().InternalMonitoringDisablerThreadUp();
 	p = LT_CALLOC(nmemb, size);
 	leaktracer::MemoryTrace::GetInstance().InternalMonitoringDisablerThreadDown();
+	leaktracer::MemoryTrace::GetInstance().recordAllocationTime(start);
 	leaktracer::MemoryTrace::GetInstance().registerAllocation(p, nmemb*size, false);
 
 	return p;
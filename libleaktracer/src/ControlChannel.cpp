@@ -0,0 +1,226 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sstream>
+#include "ControlChannel.hpp"
+#include "MemoryTrace.hpp"
+
+
+namespace leaktracer {
+
+
+ControlChannel::ControlChannel(void)
+: __socket(-1)
+{
+}
+
+
+ControlChannel::~ControlChannel(void)
+{
+	if (__socket >= 0)
+		close(__socket);
+}
+
+
+bool ControlChannel::start(const char *name)
+{
+	struct sockaddr_un addr;
+	size_t length = strlen(name);
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	// abstract socket: the name follows a NUL byte, it is not
+	// NUL terminated
+	if (length == 0 || length + 1 > sizeof(addr.sun_path)) {
+		std::cerr << "LeakTracer: invalid control socket name \"" << name << "\"\n";
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path + 1, name, length);
+
+	__socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (__socket < 0 ||
+		bind(__socket, reinterpret_cast<struct sockaddr*>(&addr), offsetof(struct sockaddr_un, sun_path) + 1 + length) != 0 ||
+		listen(__socket, 16) != 0) {
+		std::cerr << "LeakTracer: failed to listen on control socket \"" << name << "\": " << strerror(errno) << "\n";
+		if (__socket >= 0)
+			close(__socket);
+		__socket = -1;
+		return false;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	bool ok = (pthread_create(&thread, &attr, serviceThread, this) == 0);
+	pthread_attr_destroy(&attr);
+	if (!ok) {
+		std::cerr << "LeakTracer: failed to start control thread\n";
+		close(__socket);
+		__socket = -1;
+	}
+	return ok;
+}
+
+
+void *ControlChannel::serviceThread(void *arg)
+{
+	ControlChannel *channel = static_cast<ControlChannel*>(arg);
+
+	// allocations of this thread are never monitored
+	MemoryTrace::GetInstance().InternalMonitoringDisablerThreadUp();
+
+	for (;;) {
+		int connection = accept4(channel->__socket, NULL, NULL, SOCK_CLOEXEC);
+		if (connection < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				usleep(100000);
+			continue;
+		}
+		channel->serve(connection);
+		close(connection);
+	}
+	return NULL;
+}
+
+
+// serves one client, if it runs as the same user as this process
+// (or as root). The reply is written in memory first, so that a
+// client which doesn't read it never blocks a command holding
+// LeakTracer locks, only this thread, for a few seconds
+void ControlChannel::serve(int connection)
+{
+	struct ucred credentials;
+	socklen_t length = sizeof(credentials);
+	struct timeval timeout;
+	std::string command;
+	std::ostringstream reply;
+
+	timeout.tv_sec = 5;
+	timeout.tv_usec = 0;
+	setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0 ||
+		(credentials.uid != getuid() && credentials.uid != 0))
+		reply << "error permission denied\n";
+	else if (!readCommand(connection, command))
+		reply << "error no command\n";
+	else
+		runCommand(command, reply);
+	sendReply(connection, reply.str());
+}
+
+
+// reads the command line, without its end. A client which doesn't
+// send it before the receive timeout is dropped
+bool ControlChannel::readCommand(int connection, std::string &command)
+{
+	char c;
+
+	for (;;) {
+		ssize_t received = recv(connection, &c, 1, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			return !command.empty();
+		if (c == '\n')
+			return true;
+		if (command.size() >= 4096)
+			return false;
+		command += c;
+	}
+}
+
+
+// sends the whole reply, gives up if the client went away or
+// doesn't read it before the send timeout (without SIGPIPE)
+void ControlChannel::sendReply(int connection, const std::string &reply)
+{
+	const char *data = reply.data();
+	size_t size = reply.size();
+
+	while (size > 0) {
+		ssize_t sent = send(connection, data, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return;
+		data += sent;
+		size -= sent;
+	}
+}
+
+
+void ControlChannel::runCommand(const std::string &command, std::ostream &out)
+{
+	MemoryTrace &instance = MemoryTrace::GetInstance();
+
+	// command word, and its argument (the rest of the line)
+	std::string::size_type end = command.find_first_of(" \t\r");
+	std::string name = command.substr(0, end);
+	std::string argument;
+	if (end != std::string::npos) {
+		std::string::size_type first = command.find_first_not_of(" \t\r", end);
+		std::string::size_type last = command.find_last_not_of(" \t\r");
+		if (first != std::string::npos)
+			argument = command.substr(first, last - first + 1);
+	}
+
+	if (name == "start") {
+		instance.startMonitoringAllThreads();
+		out << "ok\n";
+	} else if (name == "stop") {
+		instance.stopAllMonitoring();
+		out << "ok\n";
+	} else if (name == "report") {
+		if (argument.empty()) {
+			out << "ok\n";
+			instance.writeLeaks(out);
+		} else {
+			instance.writeLeaksToFile(argument.c_str());
+			out << "ok\n";
+		}
+	} else if (name == "stats") {
+		out << "ok\n";
+		instance.writeStats(out);
+	} else if (name == "mark-generation") {
+		out << "ok\n";
+		out << "generation=" << instance.markGeneration() << "\n";
+	} else if (name == "sample-bytes") {
+		char *endOfNumber;
+		unsigned long sampleBytes = strtoul(argument.c_str(), &endOfNumber, 0);
+		if (argument.empty() || *endOfNumber != '\0')
+			out << "error sample-bytes needs a number of bytes\n";
+		else if (!instance.setSampleBytes(sampleBytes))
+			out << "error sampling can only be changed if LEAKTRACER_SAMPLE_BYTES was set, and not to 0\n";
+		else
+			out << "ok\n";
+	} else {
+		out << "error unknown command \"" << name << "\"\n";
+	}
+}
+
+
+}  // end namespace
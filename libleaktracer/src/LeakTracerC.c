@@ -34,3 +34,56 @@ void leaktracer_writeLeaksToFile(const char* reportFileName)
 {
 	leaktracer::MemoryTrace::GetInstance().writeLeaksToFile(reportFileName);
 }
+
+void leaktracer_writeLeaksToBinaryFile(const char* reportFileName)
+{
+	leaktracer::MemoryTrace::GetInstance().writeLeaksToBinaryFile(reportFileName);
+}
+
+void leaktracer_writeLeaksToPprofFile(const char* reportFileName)
+{
+	leaktracer::MemoryTrace::GetInstance().writeLeaksToPprofFile(reportFileName);
+}
+
+void leaktracer_writeAggregatedLeaksToFile(const char* reportFileName, unsigned long top)
+{
+	leaktracer::MemoryTrace::GetInstance().writeAggregatedLeaksToFile(reportFileName, top);
+}
+
+void leaktracer_writeHeapProfileToFile(const char* reportFileName, unsigned long top)
+{
+	leaktracer::MemoryTrace::GetInstance().writeHeapProfileToFile(reportFileName, top);
+}
+
+unsigned int leaktracer_markGeneration(void)
+{
+	return leaktracer::MemoryTrace::GetInstance().markGeneration();
+}
+
+void leaktracer_writeGenerationsLeaksToFile(const char* reportFileName, unsigned int firstGeneration, unsigned int lastGeneration)
+{
+	leaktracer::MemoryTrace::GetInstance().writeLeaksToFile(reportFileName, firstGeneration, lastGeneration);
+}
+
+unsigned long long leaktracer_getLastSnapshotStall(void)
+{
+	return leaktracer::MemoryTrace::GetInstance().getLastSnapshotStall();
+}
+
+void leaktracer_getStats(leaktracer_stats_t *stats)
+{
+	leaktracer::MemoryTrace::stats_t s;
+	leaktracer::MemoryTrace::GetInstance().getStats(s);
+	stats->allocations = s.allocations;
+	stats->releases = s.releases;
+	stats->allocatedBytes = s.allocatedBytes;
+	stats->releasedBytes = s.releasedBytes;
+	stats->trackedAllocations = s.trackedAllocations;
+	stats->trackedReleases = s.trackedReleases;
+	stats->untrackedAllocations = s.untrackedAllocations;
+	stats->untrackedReleases = s.untrackedReleases;
+	stats->liveBlocks = s.liveBlocks;
+	stats->liveBytes = s.liveBytes;
+	stats->metadataBytes = s.metadataBytes;
+	stats->mapOverflows = s.mapOverflows;
+}
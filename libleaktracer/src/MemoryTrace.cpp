@@ -12,13 +12,20 @@
 ////////////////////////////////////////////////////////
 
 #include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "MemoryTrace.hpp"
 #include <ctype.h>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <algorithm>
 
 #include <dlfcn.h>
 #include <assert.h>
@@ -49,44 +56,62 @@ static libc_alloc_func_t libc_alloc_funcs[] = {
 };
 
 MemoryTrace *MemoryTrace::__instance = NULL;
-char s_memoryTrace_instance[sizeof(MemoryTrace)];
+char s_memoryTrace_instance[sizeof(MemoryTrace)] __attribute__ ((aligned (64)));
 pthread_once_t MemoryTrace::_init_no_alloc_allowed_once = PTHREAD_ONCE_INIT;
 pthread_once_t MemoryTrace::_init_full_once = PTHREAD_ONCE_INIT;
 
+bool MemoryTrace::__setupDone = false;
+#ifdef USE_TLS
+LEAKTRACER_TLS int MemoryTrace::__tlsInternalDisabler = 0;
+LEAKTRACER_TLS MemoryTrace::ThreadMonitoringOptions *MemoryTrace::__tlsThreadOptions = NULL;
+#endif
+
+const char * const MemoryTrace::__hookPhaseNames[HOOK_PHASES] = { "allocation", "lock_wait", "stack_capture", "map_update" };
+
 int MemoryTrace::__sigStartAllThread = 0;
 int MemoryTrace::__sigStopAllThread = 0;
 int MemoryTrace::__sigReport = 0;
 
 
 MemoryTrace::MemoryTrace(void) :
-	__setupDone(false), __monitoringAllThreads(false), __monitoringReleases(false), __monitoringDisabler(0)
+	__monitoringAllThreads(false), __monitoringReleases(false), __monitoringDisabler(0),
+	__stackDepth(ALLOCATION_STACK_DEPTH), __timestampSource(TIMESTAMP_MONOTONIC), __allocationSequence(0),
+	__tscBase(0), __monotonicBase(0), __eventBufferSize(0), __eventDrainInterval(0),
+	__flushOrder(NULL), __flushOrderCapacity(0), __numOfEventBuffers(0), __eventDrainerPid(0), __blockReaders(0),
+	__reporterPid(0), __exitingPid(0), __reportInterval(0), __sampleBytes(0),
+	__heapProfile(false), __generation(0), __reportFirstGeneration(0), __reportLastGeneration(UINT32_MAX),
+	__reportFrames(REPORT_FRAMES_MODULE), __reportFormat(REPORT_FORMAT_TEXT), __reportTop(0),
+	__reportSnapshot(false), __lastSnapshotStall(0)
 {
+#if defined(USE_BACKTRACE) || !defined(LEAKTRACER_FRAME_POINTER_UNWINDER)
+	__unwinder = UNWINDER_GLIBC;
+#else
+	__unwinder = UNWINDER_FRAME_POINTER;
+#endif
+	memset(&__sharedStats, 0, sizeof(__sharedStats));
+	__releasesWithoutOptions = 0;
+	memset(&__reportStats, 0, sizeof(__reportStats));
+	memset(__eventSequence, 0, sizeof(__eventSequence));
+	memset(__appliedEventSequence, 0, sizeof(__appliedEventSequence));
+#ifndef USE_LOCKFREE_MAP
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++)
+		__shards[iShard].allocations.setNodesPool(&__nodesPool);
+#endif
 }
 
+// the handler may interrupt a thread holding LeakTracer locks, or
+// in malloc(): requests are run by the reporter thread (see
+// runSignalRequest)
 void MemoryTrace::sigactionHandler(int sigNumber, siginfo_t *siginfo, void *arg)
 {
 	(void)siginfo;
 	(void)arg;
 	if (sigNumber == __sigStartAllThread)
-	{
-		TRACE((stderr, "MemoryTracer: signal %d received, starting monitoring\n", sigNumber));
-		leaktracer::MemoryTrace::GetInstance().startMonitoringAllThreads();
-	}
+		leaktracer::MemoryTrace::GetInstance().runSignalRequest(REPORTER_START);
 	if (sigNumber == __sigStopAllThread)
-	{
-  		TRACE((stderr, "MemoryTracer: signal %d received, stoping monitoring\n", sigNumber));
-		leaktracer::MemoryTrace::GetInstance().stopAllMonitoring();
-	}
+		leaktracer::MemoryTrace::GetInstance().runSignalRequest(REPORTER_STOP);
 	if (sigNumber == __sigReport)
-	{
-		const char* reportFilename;
-		if (getenv("LEAKTRACER_ONSIG_REPORTFILENAME") == NULL)
-			reportFilename = "leaks.out";
-		else
-			reportFilename = getenv("LEAKTRACER_ONSIG_REPORTFILENAME");
-		TRACE((stderr, "MemoryTracer: signal %d received, writing report to %s\n", sigNumber, reportFilename));
-		leaktracer::MemoryTrace::GetInstance().writeLeaksToFile(reportFilename);
-	}
+		leaktracer::MemoryTrace::GetInstance().runSignalRequest(REPORTER_REPORT);
 }
 
 int MemoryTrace::signalNumberFromString(const char* signame)
@@ -124,9 +149,11 @@ MemoryTrace::init_no_alloc_allowed()
 	// we're using a c++ placement to initialized the MemoryTrace object living in the data section
 	new (__instance) MemoryTrace();
 
+#ifndef USE_TLS
 	// it seems some implementation of pthread_key_create use malloc() internally (old linuxthreads)
 	// these are not supported yet
 	pthread_key_create(&__instance->__thread_internal_disabler_key, NULL);
+#endif
 }
 
 void
@@ -190,6 +217,126 @@ MemoryTrace::init_full()
 		TRACE((stderr, "LeakTracer: registered signal %d SIGREPORT for tid %d\n", sigNumber, (pid_t) syscall (SYS_gettid)));
 	}
 
+#ifdef USE_LOCKFREE_MAP
+	// must be set before the first insert
+	if (getenv("LEAKTRACER_LOCKFREE_MAP_CAPACITY"))
+	{
+		unsigned long capacity = strtoul(getenv("LEAKTRACER_LOCKFREE_MAP_CAPACITY"), NULL, 0);
+		for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++)
+			__shards[iShard].allocations.setCapacity(capacity / ALLOCATION_MAP_SHARDS);
+	}
+#endif
+
+	if (getenv("LEAKTRACER_HUGEPAGES"))
+		chunksUseHugePages() = atoi(getenv("LEAKTRACER_HUGEPAGES")) != 0;
+
+	// must be known before any per-thread options is created
+	if (getenv("LEAKTRACER_SAMPLE_BYTES"))
+	{
+		__sampleBytes = strtoul(getenv("LEAKTRACER_SAMPLE_BYTES"), NULL, 0);
+		if (__sampleBytes != 0 && !__sampledAddresses.allocate()) {
+			fprintf(stderr, "LeakTracer: failed to allocate sampled addresses filter, not sampling\n");
+			__sampleBytes = 0;
+		}
+	}
+
+	if (getenv("LEAKTRACER_HEAP_PROFILE"))
+		__heapProfile = (atoi(getenv("LEAKTRACER_HEAP_PROFILE")) != 0);
+
+	if (getenv("LEAKTRACER_STACK_DEPTH"))
+	{
+		__stackDepth = atoi(getenv("LEAKTRACER_STACK_DEPTH"));
+		if (__stackDepth > MAX_ALLOCATION_STACK_DEPTH) {
+			fprintf(stderr, "LeakTracer: LEAKTRACER_STACK_DEPTH limited to %d\n", MAX_ALLOCATION_STACK_DEPTH);
+			__stackDepth = MAX_ALLOCATION_STACK_DEPTH;
+		}
+	}
+
+	// must be known before any per-thread options is created
+	if (getenv("LEAKTRACER_UNWINDER"))
+	{
+		const char *unwinder = getenv("LEAKTRACER_UNWINDER");
+		if (!strcmp(unwinder, "glibc"))
+#ifdef USE_BACKTRACE
+			__unwinder = UNWINDER_GLIBC;
+#else
+			// stacks would come from the __builtin_frame_address ladder
+			fprintf(stderr, "LeakTracer: LEAKTRACER_UNWINDER glibc needs libleaktracer built with -DUSE_BACKTRACE, ignored\n");
+#endif
+#ifdef LEAKTRACER_FRAME_POINTER_UNWINDER
+		else if (!strcmp(unwinder, "framepointer"))
+			__unwinder = UNWINDER_FRAME_POINTER;
+#endif
+		else
+			fprintf(stderr, "LeakTracer: unsupported LEAKTRACER_UNWINDER %s\n", unwinder);
+	}
+
+	if (getenv("LEAKTRACER_TIMESTAMP"))
+	{
+		const char *timestamp = getenv("LEAKTRACER_TIMESTAMP");
+		if (!strcmp(timestamp, "monotonic"))
+			__timestampSource = TIMESTAMP_MONOTONIC;
+		else if (!strcmp(timestamp, "coarse"))
+			__timestampSource = TIMESTAMP_COARSE;
+#ifdef LEAKTRACER_TSC_TIMESTAMP
+		else if (!strcmp(timestamp, "tsc")) {
+			__tscBase = __builtin_ia32_rdtsc();
+			__monotonicBase = monotonicNanoseconds(CLOCK_MONOTONIC);
+			__timestampSource = TIMESTAMP_TSC;
+		}
+#endif
+		else if (!strcmp(timestamp, "sequence"))
+			__timestampSource = TIMESTAMP_SEQUENCE;
+		else
+			fprintf(stderr, "LeakTracer: unsupported LEAKTRACER_TIMESTAMP %s\n", timestamp);
+	}
+
+	if (getenv("LEAKTRACER_REPORT_FRAMES"))
+	{
+		const char *frames = getenv("LEAKTRACER_REPORT_FRAMES");
+		if (!strcmp(frames, "address"))
+			__reportFrames = REPORT_FRAMES_ADDRESS;
+		else if (!strcmp(frames, "module"))
+			__reportFrames = REPORT_FRAMES_MODULE;
+		else if (!strcmp(frames, "symbol"))
+			__reportFrames = REPORT_FRAMES_SYMBOL;
+		else
+			fprintf(stderr, "LeakTracer: unsupported LEAKTRACER_REPORT_FRAMES %s\n", frames);
+	}
+
+	if (getenv("LEAKTRACER_REPORT_FORMAT"))
+	{
+		const char *format = getenv("LEAKTRACER_REPORT_FORMAT");
+		if (!strcmp(format, "text"))
+			__reportFormat = REPORT_FORMAT_TEXT;
+		else if (!strcmp(format, "binary"))
+			__reportFormat = REPORT_FORMAT_BINARY;
+		else if (!strcmp(format, "aggregated"))
+			__reportFormat = REPORT_FORMAT_AGGREGATED;
+		else if (!strcmp(format, "pprof"))
+			__reportFormat = REPORT_FORMAT_PPROF;
+		else
+			fprintf(stderr, "LeakTracer: unsupported LEAKTRACER_REPORT_FORMAT %s\n", format);
+	}
+
+	if (getenv("LEAKTRACER_REPORT_TOP"))
+		__reportTop = strtoul(getenv("LEAKTRACER_REPORT_TOP"), NULL, 10);
+
+	if (getenv("LEAKTRACER_REPORT_SNAPSHOT"))
+		__reportSnapshot = (atoi(getenv("LEAKTRACER_REPORT_SNAPSHOT")) != 0);
+
+	if (getenv("LEAKTRACER_EVENT_BUFFER_SIZE"))
+	{
+		__eventBufferSize = atoi(getenv("LEAKTRACER_EVENT_BUFFER_SIZE"));
+		__eventDrainInterval = 50;
+		if (getenv("LEAKTRACER_EVENT_DRAIN_INTERVAL_MS"))
+			__eventDrainInterval = atoi(getenv("LEAKTRACER_EVENT_DRAIN_INTERVAL_MS"));
+		TRACE((stderr, "LeakTracer: buffering %u events per thread, drained every %u ms\n", __eventBufferSize, __eventDrainInterval));
+	}
+
+	if (getenv("LEAKTRACER_REPORT_INTERVAL_MS"))
+		__reportInterval = atoi(getenv("LEAKTRACER_REPORT_INTERVAL_MS"));
+
 	if (getenv("LEAKTRACER_ONSTART_STARTALLTHREAD") || getenv("LEAKTRACER_AUTO_REPORTFILENAME"))
 	{
 		leaktracer::MemoryTrace::GetInstance().startMonitoringAllThreads();
@@ -199,22 +346,18 @@ MemoryTrace::init_full()
 	void *bt;
 	backtrace(&bt, 1);
 #endif
-	__setupDone = true;
-
 	__monitoringDisabler--;
+
+	__atomic_store_n(&__setupDone, true, __ATOMIC_RELEASE);
 }
 
-int MemoryTrace::Setup(void)
+int MemoryTrace::SetupSlowPath(void)
 {
 	pthread_once(&MemoryTrace::_init_no_alloc_allowed_once, MemoryTrace::init_no_alloc_allowed);
 
 	if (!leaktracer::MemoryTrace::GetInstance().AllMonitoringIsDisabled()) {
 		pthread_once(&MemoryTrace::_init_full_once, MemoryTrace::init_full_from_once);
 	}
-#if 0
-        else if (!leaktracer::MemoryTrace::GetInstance().__setupDone) {
-	}	
-#endif
 	return 0;
 }
 
@@ -222,26 +365,51 @@ void MemoryTrace::MemoryTraceOnInit(void)
 {
 	//TRACE((stderr, "LeakTracer: MemoryTrace::MemoryTraceOnInit\n"));
 	leaktracer::MemoryTrace::Setup();
+
+	// threads can't be safely created from init_full(), which may
+	// run inside the very first malloc of the process
+	leaktracer::MemoryTrace::GetInstance().startEventDrainer();
+	leaktracer::MemoryTrace::GetInstance().startControlChannel();
+	leaktracer::MemoryTrace::GetInstance().startReporter();
 }
 
 
 void MemoryTrace::MemoryTraceOnExit(void)
 {
+	MemoryTrace &instance = leaktracer::MemoryTrace::GetInstance();
+
+	// signals don't write reports anymore
+	__atomic_store_n(&instance.__exitingPid, getpid(), __ATOMIC_RELEASE);
+
+	// the report and the check below apply pending events
+	instance.stopEventDrainer();
+
+	char request = REPORTER_EXIT;
 	if (getenv("LEAKTRACER_ONEXIT_REPORT") || getenv("LEAKTRACER_AUTO_REPORTFILENAME"))
 	{
-		const char *reportName;
-		if ( !(reportName = getenv("LEAKTRACER_ONEXIT_REPORTFILENAME")) && !(reportName = getenv("LEAKTRACER_AUTO_REPORTFILENAME")))
+		if (exitReportFileName() == NULL)
 		{
 			TRACE((stderr, "LeakTracer: LEAKTRACER_ONEXIT_REPORTFILENAME needs to be defined when using LEAKTRACER_ONEXIT_REPORT\n"));
 			return;
 		}
-		leaktracer::MemoryTrace::GetInstance().stopAllMonitoring();
-		TRACE((stderr, "LeakTracer: writing leak report in %s\n", reportName));
-		leaktracer::MemoryTrace::GetInstance().writeLeaksToFile(reportName);
+		instance.stopAllMonitoring();
+		TRACE((stderr, "LeakTracer: writing leak report in %s\n", exitReportFileName()));
+		request = REPORTER_EXIT_REPORT;
+	}
+	// the report on exit is written by the reporter thread if it
+	// runs in this process, which is waited for even without that
+	// report, so that the process doesn't end in the middle of a
+	// periodic or signal report
+	if (__atomic_load_n(&instance.__reporterPid, __ATOMIC_ACQUIRE) == getpid() &&
+		write(instance.__reporterPipe[1], &request, 1) == 1) {
+		while (read(instance.__reporterDonePipe[0], &request, 1) < 0 && errno == EINTR)
+			;
+	} else if (request == REPORTER_EXIT_REPORT) {
+		instance.runReporterRequest(REPORTER_EXIT_REPORT);
 	}
 	
 	const char *exitCode = getenv("LEAKTRACER_EXIT_CODE_ON_LEAKS");
-	if (exitCode != NULL && !leaktracer::MemoryTrace::GetInstance().__allocations.empty())
+	if (exitCode != NULL && !instance.allocationsInfoEmpty())
 	{
 		exit(atoi(exitCode));
 	}
@@ -258,8 +426,16 @@ MemoryTrace::~MemoryTrace(void)
 // cleanup per-thread data
 void MemoryTrace::CleanUpThreadData(void *ptrThreadOptions)
 {
+#ifdef USE_TLS
+	if (__tlsThreadOptions == ptrThreadOptions)
+		__tlsThreadOptions = NULL;
+#endif
 	if( ptrThreadOptions != NULL )
 		GetInstance().removeThreadOptions( reinterpret_cast<ThreadMonitoringOptions*>(ptrThreadOptions) );
+#ifndef USE_LOCKFREE_MAP
+	// after the events of the thread were applied
+	GetInstance().__nodesPool.releaseThreadCache();
+#endif
 }
 
 
@@ -268,23 +444,548 @@ void MemoryTrace::CleanUpThreadData(void *ptrThreadOptions)
 void MemoryTrace::removeThreadOptions(ThreadMonitoringOptions *pOptions)
 {
 	MutexLock lock(__threadListMutex);
+	// releases below must not queue events in the buffer being removed
+	InternalMonitoringDisablerThreadUp();
+	if (pOptions->events != NULL) {
+		flushEventBuffers_unlocked();
+		__numOfEventBuffers--;
+	}
 	for (list_monitoring_options_t::iterator it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it) {
 		if (*it == pOptions) {
-			// found this object in the list
+			// found this object in the list, its counters are kept
+			thread_stats_t &stats = (*it)->stats;
+			addToCounter(__sharedStats.allocations, stats.allocations);
+			addToCounter(__sharedStats.releases, stats.releases);
+			addToCounter(__sharedStats.allocatedBytes, stats.allocatedBytes);
+			addToCounter(__sharedStats.releasedBytes, stats.releasedBytes);
+			addToCounter(__sharedStats.trackedAllocations, stats.trackedAllocations);
+			addToCounter(__sharedStats.trackedReleases, stats.trackedReleases);
+			addToCounter(__sharedStats.liveBlocks, stats.liveBlocks);
+			addToCounter(__sharedStats.liveBytes, stats.liveBytes);
+#ifdef LEAKTRACER_HOOK_HISTOGRAMS
+			for (int phase = 0; phase < HOOK_PHASES; phase++)
+				__sharedHookHistograms[phase].merge((*it)->hookHistograms[phase]);
+#endif
+			__stacks.fold((*it)->stackCounters);
+			delete (*it)->events;
 			delete *it;
 			__listThreadOptions.erase(it);
-			return;
+			break;
 		}
 	}
+	InternalMonitoringDisablerThreadDown();
 }
 
 
-// writes all memory leaks to given stream
-void MemoryTrace::writeLeaksPrivate(std::ostream &out)
+// applies one queued event to the allocation map, counted in given
+// statistics, shard of the event must be locked (and
+// __threadListMutex for __sharedStats)
+void MemoryTrace::applyEvent(allocation_event_t &event, thread_stats_t &stats, StackTable::thread_counters_t *pStackCounters)
+{
+	memory_allocations_info_t &allocations = __shards[getEventShardIndex(event)].allocations;
+	allocation_info_t *info;
+
+	switch (event.op) {
+	case EVENT_ALLOCATION:
+		info = allocations.insert(event.ptr);
+		if (info != NULL) {
+			*info = event.info;
+			info->generation = getGeneration();
+			countAllocation(*info, pStackCounters);
+			countTrackedAllocation(stats, info->size);
+			allocations.publish(info);
+		}
+		break;
+	case EVENT_REALLOCATION:
+		info = allocations.find(event.ptr);
+		if (info != NULL) {
+			// the block keeps the weight it was sampled with,
+			// and its generation
+			float weight = info->weight;
+			uint32_t generation = info->generation;
+			countRelease(*info, pStackCounters);
+			countTrackedRelease(stats, info->size);
+			*info = event.info;
+			info->weight = weight;
+			info->generation = generation;
+			countAllocation(*info, pStackCounters);
+			countTrackedAllocation(stats, info->size);
+		}
+		break;
+	case EVENT_RELEASE:
+		info = allocations.find(event.ptr);
+		if (info == NULL)
+			break;
+		countRelease(*info, pStackCounters);
+		countTrackedRelease(stats, info->size);
+		if (__sampleBytes != 0)
+			__sampledAddresses.remove(event.ptr);
+		allocations.release(event.ptr);
+		break;
+	}
+}
+
+
+// applies events queued in all per-thread buffers
+void MemoryTrace::flushEventBuffers(void)
+{
+	if (__eventBufferSize == 0)
+		return;
+
+	MutexLock lock(__threadListMutex);
+	flushEventBuffers_unlocked();
+}
+
+
+// applies the events of the buffer of calling thread which are the
+// next ones of their domain, and keeps the others (each one waits
+// for an event queued before by another thread in its domain),
+// without locking the other buffers.
+// Returns false if none could be applied
+bool MemoryTrace::drainOwnEvents(ThreadMonitoringOptions &options)
+{
+	event_buffer_t *events = options.events;
+	allocation_event_t *event;
+	bool drained = false;
+
+	MutexLock lock(events->mutex);
+	for (events->rewind(); (event = events->peek()) != NULL; events->next()) {
+		MutexLock shardLock(__shards[getEventShardIndex(*event)].mutex);
+		if (event->sequence != __appliedEventSequence[event->domain]) {
+			events->keep();
+			continue;
+		}
+		applyEvent(*event, options.stats, &options.stackCounters);
+		__appliedEventSequence[event->domain]++;
+		drained = true;
+	}
+	events->compact();
+	return drained;
+}
+
+
+// applies the events of the buffer of calling thread, those which
+// wait for events of other threads with all buffers, while a report
+// reads the blocks: the block of a release queued meanwhile is
+// freed on return. Waits for the report to release the shard locks.
+void MemoryTrace::applyOwnEvents(ThreadMonitoringOptions &options)
+{
+	drainOwnEvents(options);
+	bool applied;
+	{
+		MutexLock lock(options.events->mutex);
+		applied = options.events->empty();
+	}
+	if (!applied)
+		flushEventBuffers();
+}
+
+
+// makes room in __flushOrder for the events of one more buffer,
+// __threadListMutex must be locked
+bool MemoryTrace::reserveFlushOrder(void)
+{
+	unsigned long capacity = (__numOfEventBuffers + 1) * __eventBufferSize;
+	if (capacity <= __flushOrderCapacity)
+		return true;
+
+	capacity = std::max(capacity, 2 * __flushOrderCapacity);
+	allocation_event_t **flushOrder = static_cast<allocation_event_t**>(LT_REALLOC(__flushOrder, capacity * sizeof(allocation_event_t*)));
+	if (flushOrder == NULL)
+		return false;
+	__flushOrder = flushOrder;
+	__flushOrderCapacity = capacity;
+	return true;
+}
+
+
+// applies events queued in all per-thread buffers,
+// __threadListMutex must be locked.
+// All buffers are locked together: an event on a pointer (a
+// release in thread B) can only be queued once the previous event
+// on the same pointer (the allocation in thread A) was queued, so
+// the events taken from all buffers never miss a dependency. As a
+// sequence is taken and its event appended under the buffer
+// mutex, the events of a domain in the buffers are numbered
+// without gaps from the next one to apply: each one has its slot
+// in __flushOrder, domain after domain, and the domains of a
+// shard are contiguous.
+void MemoryTrace::flushEventBuffers_unlocked(void)
+{
+	list_monitoring_options_t::iterator it;
+	unsigned long total = 0;
+
+	for (it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it) {
+		if ((*it)->events != NULL) {
+			pthread_mutex_lock(&(*it)->events->mutex.__mutex);
+			total += (*it)->events->size();
+		}
+	}
+
+	if (total != 0) {
+		uint32_t start = 0;
+		for (unsigned int iDomain = 0; iDomain < EVENT_SEQUENCE_DOMAINS; iDomain++) {
+			__flushDomainStart[iDomain] = start;
+			start += __atomic_load_n(&__eventSequence[iDomain], __ATOMIC_RELAXED) - __appliedEventSequence[iDomain];
+		}
+		assert(start == total);
+
+		for (it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it) {
+			event_buffer_t *events = (*it)->events;
+			allocation_event_t *event;
+			if (events == NULL)
+				continue;
+			for (events->rewind(); (event = events->peek()) != NULL; events->next())
+				__flushOrder[__flushDomainStart[event->domain] + (uint32_t)(event->sequence - __appliedEventSequence[event->domain])] = event;
+		}
+
+		unsigned long next = 0;
+		for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+			unsigned int endDomain = (iShard + 1) << (EVENT_SEQUENCE_DOMAIN_BITS - ALLOCATION_MAP_SHARD_BITS);
+			unsigned long end = (endDomain < EVENT_SEQUENCE_DOMAINS) ? __flushDomainStart[endDomain] : total;
+			if (next == end)
+				continue;
+
+			MutexLock lock(__shards[iShard].mutex);
+			for (; next < end; next++)
+				applyEvent(*__flushOrder[next], __sharedStats, NULL);
+			for (unsigned int iDomain = endDomain - (1 << (EVENT_SEQUENCE_DOMAIN_BITS - ALLOCATION_MAP_SHARD_BITS)); iDomain < endDomain; iDomain++)
+				__appliedEventSequence[iDomain] = __atomic_load_n(&__eventSequence[iDomain], __ATOMIC_RELAXED);
+		}
+	}
+
+	for (it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it) {
+		if ((*it)->events != NULL) {
+			(*it)->events->clear();
+			pthread_mutex_unlock(&(*it)->events->mutex.__mutex);
+		}
+	}
+}
+
+
+// background thread, applying queued events periodically so
+// that buffers of idle threads don't keep them forever, until
+// something is written to its pipe
+void *MemoryTrace::eventDrainerThread(void *)
+{
+	MemoryTrace &instance = GetInstance();
+	struct pollfd stop;
+
+	// allocations of this thread are never monitored
+	instance.InternalMonitoringDisablerThreadUp();
+
+	stop.fd = instance.__eventDrainerPipe[0];
+	stop.events = POLLIN;
+	while (poll(&stop, 1, (int)instance.__eventDrainInterval) <= 0) {
+		instance.flushEventBuffers();
+		instance.trimMetadataIfDue();
+	}
+	return NULL;
+}
+
+
+void MemoryTrace::startEventDrainer(void)
+{
+	if (__eventBufferSize == 0 || __eventDrainInterval == 0)
+		return;
+
+	if (pipe2(__eventDrainerPipe, O_CLOEXEC) != 0) {
+		std::cerr << "LeakTracer: failed to create events drainer pipe\n";
+		return;
+	}
+
+	InternalMonitoringDisablerThreadUp();
+	if (pthread_create(&__eventDrainer, NULL, eventDrainerThread, NULL) != 0)
+		std::cerr << "LeakTracer: failed to start events drainer thread\n";
+	else
+		__atomic_store_n(&__eventDrainerPid, getpid(), __ATOMIC_RELEASE);
+	InternalMonitoringDisablerThreadDown();
+}
+
+
+// stops the drainer thread, if it runs in this process (it is not
+// restarted in a forked child)
+void MemoryTrace::stopEventDrainer(void)
+{
+	char request = 0;
+
+	if (__atomic_load_n(&__eventDrainerPid, __ATOMIC_ACQUIRE) != getpid())
+		return;
+	__atomic_store_n(&__eventDrainerPid, 0, __ATOMIC_RELEASE);
+
+	InternalMonitoringDisablerThreadUp();
+	if (write(__eventDrainerPipe[1], &request, 1) == 1)
+		pthread_join(__eventDrainer, NULL);
+	InternalMonitoringDisablerThreadDown();
+}
+
+
+// listens on the control socket named by LEAKTRACER_CONTROL_SOCKET,
+// "%p" in the name is replaced by the process ID
+void MemoryTrace::startControlChannel(void)
+{
+	const char *name = getenv("LEAKTRACER_CONTROL_SOCKET");
+	if (name == NULL || name[0] == '\0')
+		return;
+
+	InternalMonitoringDisablerThreadUp();
+	std::ostringstream socketName;
+	for (const char *c = name; *c != '\0'; c++) {
+		if (c[0] == '%' && c[1] == 'p') {
+			socketName << getpid();
+			c++;
+		} else {
+			socketName << *c;
+		}
+	}
+	__controlChannel.start(socketName.str().c_str());
+	InternalMonitoringDisablerThreadDown();
+}
+
+
+// file of the reports on signal, and periodic reports
+const char *MemoryTrace::signalReportFileName(void)
+{
+	if (getenv("LEAKTRACER_ONSIG_REPORTFILENAME") == NULL)
+		return "leaks.out";
+	return getenv("LEAKTRACER_ONSIG_REPORTFILENAME");
+}
+
+
+// file of the report on exit, NULL if not set
+const char *MemoryTrace::exitReportFileName(void)
+{
+	const char *reportName;
+	if ( !(reportName = getenv("LEAKTRACER_ONEXIT_REPORTFILENAME")) && !(reportName = getenv("LEAKTRACER_AUTO_REPORTFILENAME")))
+		return NULL;
+	return reportName;
+}
+
+
+// asks the reporter thread to run given request, from a signal
+// handler: only async-signal-safe calls. The request is dropped if
+// the pipe is full. Returns false if the thread doesn't run in
+// this process (not started yet, or in a forked child)
+bool MemoryTrace::wakeUpReporter(char request)
+{
+	int savedErrno = errno;
+	bool running = (__atomic_load_n(&__reporterPid, __ATOMIC_ACQUIRE) == getpid());
+	if (running)
+		(void)!write(__reporterPipe[1], &request, 1);
+	errno = savedErrno;
+	return running;
+}
+
+
+// runs the request of a signal: by the reporter thread if it runs,
+// or by the handler itself (as LeakTracer always did before the
+// thread), unless the process is exiting, as the reporter has
+// ended after the report on exit, which nothing may overwrite
+void MemoryTrace::runSignalRequest(char request)
+{
+	if (wakeUpReporter(request) || __atomic_load_n(&__exitingPid, __ATOMIC_ACQUIRE) == getpid())
+		return;
+	int savedErrno = errno;
+	runReporterRequest(request);
+	errno = savedErrno;
+}
+
+
+void MemoryTrace::runReporterRequest(char request)
+{
+	switch (request) {
+	case REPORTER_START:
+		TRACE((stderr, "MemoryTracer: starting monitoring\n"));
+		startMonitoringAllThreads();
+		break;
+	case REPORTER_STOP:
+		TRACE((stderr, "MemoryTracer: stoping monitoring\n"));
+		stopAllMonitoring();
+		break;
+	case REPORTER_REPORT:
+		TRACE((stderr, "MemoryTracer: writing report to %s\n", signalReportFileName()));
+		writeLeaksToFile(signalReportFileName());
+		break;
+	case REPORTER_EXIT_REPORT:
+		writeLeaksToFile(exitReportFileName());
+		break;
+	}
+}
+
+
+// reporter thread, runs the requests written to its pipe, and
+// writes periodic reports
+void *MemoryTrace::reporterThread(void *)
+{
+	MemoryTrace &instance = GetInstance();
+	struct pollfd requests;
+	uint64_t nextReport = 0;
+	int timeout = -1;
+	char request;
+
+	// allocations of this thread are never monitored
+	instance.InternalMonitoringDisablerThreadUp();
+
+	requests.fd = instance.__reporterPipe[0];
+	requests.events = POLLIN;
+	if (instance.__reportInterval != 0)
+		nextReport = monotonicNanoseconds(CLOCK_MONOTONIC) + (uint64_t)instance.__reportInterval * 1000000;
+	for (;;) {
+		if (instance.__reportInterval != 0) {
+			uint64_t now = monotonicNanoseconds(CLOCK_MONOTONIC);
+			if (now >= nextReport) {
+				instance.runReporterRequest(REPORTER_REPORT);
+				nextReport = now + (uint64_t)instance.__reportInterval * 1000000;
+			}
+			timeout = (int)((nextReport - now + 999999) / 1000000);
+		}
+		instance.trimMetadataIfDue();
+		if (poll(&requests, 1, timeout) <= 0 || read(requests.fd, &request, 1) != 1)
+			continue;
+		instance.runReporterRequest(request);
+		if (request == REPORTER_EXIT_REPORT || request == REPORTER_EXIT) {
+			// nothing may overwrite the report while the
+			// process exits
+			__atomic_store_n(&instance.__reporterPid, 0, __ATOMIC_RELEASE);
+			(void)!write(instance.__reporterDonePipe[1], &request, 1);
+			break;
+		}
+	}
+	return NULL;
+}
+
+
+// starts the reporter thread, if signals or periodic or exit
+// reports are set up
+void MemoryTrace::startReporter(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (__sigStartAllThread == 0 && __sigStopAllThread == 0 && __sigReport == 0 && __reportInterval == 0 &&
+		!getenv("LEAKTRACER_ONEXIT_REPORT") && !getenv("LEAKTRACER_AUTO_REPORTFILENAME"))
+		return;
+
+	// a full pipe drops requests, instead of blocking the handler
+	if (pipe2(__reporterPipe, O_CLOEXEC) != 0 || pipe2(__reporterDonePipe, O_CLOEXEC) != 0) {
+		std::cerr << "LeakTracer: failed to create reporter pipes\n";
+		return;
+	}
+	fcntl(__reporterPipe[1], F_SETFL, O_NONBLOCK);
+
+	InternalMonitoringDisablerThreadUp();
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, reporterThread, NULL) != 0)
+		std::cerr << "LeakTracer: failed to start reporter thread\n";
+	else
+		__atomic_store_n(&__reporterPid, getpid(), __ATOMIC_RELEASE);
+	pthread_attr_destroy(&attr);
+	InternalMonitoringDisablerThreadDown();
+}
+
+
+// converts a timestamp to seconds of CLOCK_MONOTONIC (the
+// sequence number for TIMESTAMP_SEQUENCE). A TSC value is
+// converted with the TSC rate measured since startup.
+double MemoryTrace::timestampSeconds(uint64_t timestamp, double tscPerNanosecond)
+{
+	if (__timestampSource == TIMESTAMP_SEQUENCE)
+		return (double)timestamp;
+	if (__timestampSource == TIMESTAMP_TSC)
+		return (__monotonicBase + (double)(int64_t)(timestamp - __tscBase) / tscPerNanosecond) / 1000000000;
+	return (double)timestamp / 1000000000;
+}
+
+
+// looks up the symbols of the frames of all leaks. dladdr() takes
+// the dynamic loader lock, which a thread in dlopen() may hold
+// while allocating, so this is done before locking the shards
+// for the report. __modules mutex must be locked.
+void MemoryTrace::cacheLeakSymbols(void)
 {
-	struct timespec mono, utc, diff;
 	allocation_info_t *info;
 	void *p;
+
+	// stacks of the leaks
+	unsigned long numOfStacks = __stacks.size();
+	unsigned char *leakStacks = static_cast<unsigned char*>(LT_CALLOC(numOfStacks + 1, sizeof(unsigned char)));
+	if (leakStacks == NULL)
+		return;
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		allocations_shard_t &shard = __shards[iShard];
+		MutexLock lock(shard.mutex);
+		beginLeaksIteration(shard);
+		while (getNextLeak(shard, &info, &p)) {
+			if (info->stackId <= numOfStacks)
+				leakStacks[info->stackId] = 1;
+		}
+	}
+
+	for (stack_id_t id = 1; id <= numOfStacks; id++) {
+		if (!leakStacks[id])
+			continue;
+		unsigned int numOfFrames;
+		void * const *stack = __stacks.getFrames(id, &numOfFrames);
+		for (unsigned int i = 0; i < numOfFrames; i++)
+			__modules.cacheSymbol(stack[i]);
+	}
+	LT_FREE(leakStacks);
+}
+
+
+// writes a frame as module index and offset, or as an address
+// if not in a module
+void MemoryTrace::writeFrame(std::ostream &out, void *addr)
+{
+	unsigned int module;
+	uintptr_t offset;
+
+	if (__reportFrames != REPORT_FRAMES_ADDRESS && __modules.find(addr, &module, &offset))
+		out << module << ":0x" << std::hex << offset << std::dec;
+	else
+		out << addr;
+}
+
+
+// returns the TSC ticks per ns, measured since startup
+double MemoryTrace::measureTscRate(void)
+{
+#ifdef LEAKTRACER_TSC_TIMESTAMP
+	if (__timestampSource == TIMESTAMP_TSC) {
+		uint64_t tsc = __builtin_ia32_rdtsc();
+		uint64_t elapsed = monotonicNanoseconds(CLOCK_MONOTONIC) - __monotonicBase;
+		if (elapsed != 0)
+			return (double)(tsc - __tscBase) / elapsed;
+	}
+#endif
+	return 1;
+}
+
+
+// sets the generations written by a report, refreshes the modules,
+// and looks up the symbols of the leaks if the report writes them
+// (symbols set, and LEAKTRACER_REPORT_FRAMES=symbol), before a
+// report. __modules mutex must be locked.
+void MemoryTrace::prepareReport(bool symbols, uint32_t firstGeneration, uint32_t lastGeneration)
+{
+	__reportFirstGeneration = firstGeneration;
+	__reportLastGeneration = lastGeneration;
+	trimMetadataIfDue();
+	getStats(__reportStats);
+	__modules.refresh();
+	if (symbols && __reportFrames == REPORT_FRAMES_SYMBOL) {
+		__modules.newReport();
+		cacheLeakSymbols();
+	}
+}
+
+
+// writes the first line of reports, without its end, returns the
+// width of the seconds of timestamps
+int MemoryTrace::writeReportHeader(std::ostream &out, uint64_t snapshotStall)
+{
+	struct timespec mono, utc, diff;
 	double d;
 	const int precision = 6;
 	int maxsecwidth;
@@ -310,69 +1011,990 @@ void MemoryTrace::writeLeaksPrivate(std::ostream &out)
 	out << "# LeakTracer report";
 	d = diff.tv_sec + (((double)diff.tv_nsec)/1000000000);
 	out << " diff_utc_mono=" << std::fixed << std::left << std::setprecision(precision) << d ;
+	if (__sampleBytes != 0)
+		out << " sample_bytes=" << __sampleBytes;
+	if (__timestampSource == TIMESTAMP_SEQUENCE)
+		out << " timestamp=sequence";
+	if (snapshotStall != 0)
+		out << " snapshot_stall_us=" << std::setprecision(3) << snapshotStall / 1000.0;
+	if (!allGenerationsReported())
+		out << " generations=" << __reportFirstGeneration << "-" << __reportLastGeneration;
+	out << " allocations=" << __reportStats.allocations << " releases=" << __reportStats.releases;
+	out << " live_blocks=" << __reportStats.liveBlocks << " live_bytes=" << __reportStats.liveBytes;
+	out << " metadata_bytes=" << __reportStats.metadataBytes;
+	if (__reportStats.mapOverflows != 0)
+		out << " map_overflows=" << __reportStats.mapOverflows;
+	return maxsecwidth;
+}
+
+
+// writes the module lines of reports, prepareReport() must have
+// been called, __modules mutex must be locked
+void MemoryTrace::writeReportModules(std::ostream &out)
+{
+	if (__reportFrames != REPORT_FRAMES_ADDRESS) {
+		for (unsigned int i = 0; i < __modules.size(); i++) {
+			out << "# module " << i << " base=0x" << std::hex << __modules.getBase(i) << std::dec;
+			out << " build_id=" << (__modules.getBuildId(i)[0] != '\0' ? __modules.getBuildId(i) : "-");
+			out << " path=" << __modules.getPath(i) << "\n";
+		}
+	}
+}
+
+
+// writes the symbols of frames not seen yet in this report
+void MemoryTrace::writeFrameSymbols(std::ostream &out, void * const *stack, unsigned int numOfFrames)
+{
+	for (unsigned int i = 0; __reportFrames == REPORT_FRAMES_SYMBOL && i < numOfFrames; i++) {
+		uintptr_t offset;
+		bool firstTime;
+		const char *symbol = __modules.getSymbol(stack[i], &offset, &firstTime);
+		if (symbol != NULL && firstTime) {
+			out << "# symbol ";
+			writeFrame(out, stack[i]);
+			out << ' ' << symbol << "+0x" << std::hex << offset << std::dec << '\n';
+		}
+	}
+}
+
+
+// writes all memory leaks to given stream, prepareReport() must
+// have been called, __modules mutex must be locked
+void MemoryTrace::writeLeaksPrivate(std::ostream &out, uint64_t snapshotStall)
+{
+	allocation_info_t *info;
+	void *p;
+	double d;
+	const int precision = 6;
+	double tscPerNanosecond = measureTscRate();
+
+	int maxsecwidth = writeReportHeader(out, snapshotStall);
 	out << "\n";
+	writeReportModules(out);
+
+	// shards are walked one at a time, so an allocating thread
+	// waits at most for the dump of one shard
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		allocations_shard_t &shard = __shards[iShard];
+		MutexLock lock(shard.mutex);
+		beginLeaksIteration(shard);
+		while (getNextLeak(shard, &info, &p)) {
+			d = timestampSeconds(info->timestamp, tscPerNanosecond);
+			unsigned int numOfFrames;
+			void * const *stack = __stacks.getFrames(info->stackId, &numOfFrames);
+			writeFrameSymbols(out, stack, numOfFrames);
+
+			out << "leak, ";
+			out << "time="  << std::fixed << std::right << std::setprecision(precision) << std::setfill('0') << std::setw(maxsecwidth+1+precision) << d << ", "; // setw(16) ?
+			out << "stack=";
+			for (unsigned int i = 0; i < numOfFrames; i++) {
+				if (i > 0) out << ' ';
+				writeFrame(out, stack[i]);
+			}
+			out << ", ";
+
+			out << "size=" << info->size << ", ";
+			if (__sampleBytes != 0)
+				out << "weight=" << std::setw(0) << std::setprecision(3) << info->weight << ", ";
+
+			out << "data=";
+			const char *data = reinterpret_cast<const char *>(p);
+			for (unsigned int i = 0; i < PRINTED_DATA_BUFFER_SIZE && i < info->size; i++)
+				out << (isprint(data[i]) ? data[i] : '.');
+			out << '\n';
+		}
+	}
+}
+
+
+// orders groups of leaks (by stack ID) by bytes, biggest first
+class LeaksGroupGreater {
+public:
+	LeaksGroupGreater(const double *bytes) : __bytes(bytes) {}
+	bool operator()(stack_id_t a, stack_id_t b) const {
+		return __bytes[a] > __bytes[b] || (__bytes[a] == __bytes[b] && a < b);
+	}
+private:
+	const double *__bytes;
+};
+
+
+// groups the leaks of the current report by call stack, in one
+// pass over the shards: stack IDs are dense, so groups are found by
+// indexing an array with them. Returns the groups, indexed by stack
+// ID (0 is NO_STACK_ID), and their number in pNumOfGroups, NULL if
+// out of memory. The groups must be freed with LT_FREE.
+MemoryTrace::leaks_group_t * MemoryTrace::groupLeaks(unsigned long *pNumOfGroups)
+{
+	allocation_info_t *info;
+	void *p;
+
+	unsigned long numOfGroups = __stacks.size() + 1;
+	leaks_group_t *groups = static_cast<leaks_group_t*>(LT_CALLOC(numOfGroups, sizeof(leaks_group_t)));
+	bool ok = (groups != NULL);
 
-	__allocations.beginIteration();
-	while (__allocations.getNextPair(&info, &p)) {
-		d = info->timestamp.tv_sec + (((double)info->timestamp.tv_nsec)/1000000000);
-		out << "leak, ";
-		out << "time="  << std::fixed << std::right << std::setprecision(precision) << std::setfill('0') << std::setw(maxsecwidth+1+precision) << d << ", "; // setw(16) ?
+	for (unsigned int iShard = 0; ok && iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		allocations_shard_t &shard = __shards[iShard];
+		MutexLock lock(shard.mutex);
+		beginLeaksIteration(shard);
+		while (getNextLeak(shard, &info, &p)) {
+			stack_id_t id = info->stackId;
+			if (id >= numOfGroups) {
+				// added since the report started
+				unsigned long count = __stacks.size() + 1;
+				leaks_group_t *bigger = static_cast<leaks_group_t*>(LT_REALLOC(groups, count * sizeof(leaks_group_t)));
+				if (bigger == NULL) {
+					ok = false;
+					break;
+				}
+				memset(bigger + numOfGroups, 0, (count - numOfGroups) * sizeof(leaks_group_t));
+				groups = bigger;
+				numOfGroups = count;
+			}
+			leaks_group_t &group = groups[id];
+			double weight = (__sampleBytes != 0) ? info->weight : 1;
+			if (group.blocks == 0) {
+				group.minSize = group.maxSize = info->size;
+				group.oldest = group.newest = info->timestamp;
+			} else {
+				if (info->size < group.minSize)
+					group.minSize = info->size;
+				if (info->size > group.maxSize)
+					group.maxSize = info->size;
+				if (info->timestamp < group.oldest)
+					group.oldest = info->timestamp;
+				if (info->timestamp > group.newest)
+					group.newest = info->timestamp;
+			}
+			group.blocks += weight;
+			group.bytes += weight * info->size;
+		}
+		// may have stopped before the end
+		shard.allocations.endIteration();
+	}
+
+	if (!ok && groups != NULL) {
+		LT_FREE(groups);
+		groups = NULL;
+	}
+	*pNumOfGroups = numOfGroups;
+	return groups;
+}
+
+
+// writes memory leaks aggregated by call stack, sorted by bytes,
+// only the top ones if top is not 0. prepareReport() must have
+// been called, __modules mutex must be locked.
+void MemoryTrace::writeAggregatedLeaksPrivate(std::ostream &out, unsigned long top, uint64_t snapshotStall)
+{
+	const int precision = 6;
+	double tscPerNanosecond = measureTscRate();
+
+	unsigned long numOfGroups;
+	leaks_group_t *groups = groupLeaks(&numOfGroups);
+	bool ok = (groups != NULL);
+
+	// stack IDs of the groups, sorted. bytes are copied apart from
+	// the groups, for the comparisons
+	unsigned long numOfUsed = 0;
+	stack_id_t *ids = NULL;
+	double *bytes = NULL;
+	if (ok) {
+		ids = static_cast<stack_id_t*>(LT_MALLOC(numOfGroups * sizeof(stack_id_t)));
+		bytes = static_cast<double*>(LT_MALLOC(numOfGroups * sizeof(double)));
+		ok = (ids != NULL && bytes != NULL);
+	}
+	for (unsigned long id = 0; ok && id < numOfGroups; id++) {
+		bytes[id] = groups[id].bytes;
+		if (groups[id].blocks != 0)
+			ids[numOfUsed++] = id;
+	}
+	unsigned long numOfShown = (top != 0 && top < numOfUsed) ? top : numOfUsed;
+	if (ok)
+		std::partial_sort(ids, ids + numOfShown, ids + numOfUsed, LeaksGroupGreater(bytes));
+
+	int maxsecwidth = writeReportHeader(out, snapshotStall);
+	out << " aggregated=1 stacks=" << numOfShown << "/" << numOfUsed << "\n";
+	writeReportModules(out);
+	if (!ok)
+		std::cerr << "LeakTracer: not enough memory to aggregate leaks\n";
+
+	for (unsigned long i = 0; i < numOfShown; i++) {
+		const leaks_group_t &group = groups[ids[i]];
+		unsigned int numOfFrames;
+		void * const *stack = __stacks.getFrames(ids[i], &numOfFrames);
+		writeFrameSymbols(out, stack, numOfFrames);
+
+		out << "leaks, ";
+		out << "blocks=" << std::setprecision(0) << group.blocks << ", ";
+		out << "bytes=" << std::setprecision(0) << group.bytes << ", ";
+		out << "min_size=" << group.minSize << ", ";
+		out << "max_size=" << group.maxSize << ", ";
+		out << "oldest=" << std::right << std::setprecision(precision) << std::setfill('0') << std::setw(maxsecwidth+1+precision) << timestampSeconds(group.oldest, tscPerNanosecond) << ", ";
+		out << "newest=" << std::setw(maxsecwidth+1+precision) << timestampSeconds(group.newest, tscPerNanosecond) << ", ";
 		out << "stack=";
-		for (unsigned int i = 0; i < ALLOCATION_STACK_DEPTH; i++) {
-			if (info->allocStack[i] == NULL) break;
+		for (unsigned int j = 0; j < numOfFrames; j++) {
+			if (j > 0) out << ' ';
+			writeFrame(out, stack[j]);
+		}
+		out << '\n';
+	}
+
+	if (groups != NULL)
+		LT_FREE(groups);
+	if (ids != NULL)
+		LT_FREE(ids);
+	if (bytes != NULL)
+		LT_FREE(bytes);
+}
+
+
+// writes memory leaks to given file as a pprof profile (gzipped
+// profile.proto): one sample of (inuse_objects, inuse_space) per
+// call stack, one mapping per loaded segment. Frames are return
+// addresses, their locations are at the address before, in the
+// call. prepareReport() must have been called, __modules mutex must
+// be locked. Returns false on write error.
+bool MemoryTrace::writePprofLeaksPrivate(FILE *file, uint64_t snapshotStall)
+{
+	unsigned long numOfGroups;
+	leaks_group_t *groups = groupLeaks(&numOfGroups);
+	if (groups == NULL)
+		std::cerr << "LeakTracer: not enough memory to aggregate leaks\n";
+
+	PprofWriter writer(file);
+	writer.writeSampleType("inuse_objects", "count");
+	writer.writeSampleType("inuse_space", "bytes");
+	writer.writeDefaultSampleType("inuse_space");
+	writer.writeTime(monotonicNanoseconds(CLOCK_REALTIME));
+	if (__sampleBytes != 0)
+		writer.writePeriod("space", "bytes", __sampleBytes);
+
+	// fields of the text report header
+	std::ostringstream comment;
+	comment << "LeakTracer report";
+	if (snapshotStall != 0)
+		comment << " snapshot_stall_us=" << std::fixed << std::setprecision(3) << snapshotStall / 1000.0;
+	if (!allGenerationsReported())
+		comment << " generations=" << __reportFirstGeneration << "-" << __reportLastGeneration;
+	writer.writeComment(comment.str().c_str());
+
+	for (unsigned int i = 0; i < __modules.numOfSegments(); i++) {
+		unsigned int module = __modules.getSegmentModule(i);
+		writer.writeMapping(i + 1, __modules.getSegmentStart(i), __modules.getSegmentEnd(i),
+			__modules.getSegmentFileOffset(i), __modules.getPath(module), __modules.getBuildId(module));
+	}
 
-			if (i > 0) out << ' ';
-			out << info->allocStack[i];
+	uint64_t locations[MAX_ALLOCATION_STACK_DEPTH];
+	for (unsigned long id = 0; groups != NULL && id < numOfGroups; id++) {
+		const leaks_group_t &group = groups[id];
+		if (group.blocks == 0)
+			continue;
+		unsigned int numOfFrames;
+		void * const *stack = __stacks.getFrames(id, &numOfFrames);
+		unsigned int numOfLocations = 0;
+		for (unsigned int i = 0; i < numOfFrames && numOfLocations < MAX_ALLOCATION_STACK_DEPTH; i++) {
+			unsigned int segment;
+			uintptr_t offset;
+			bool firstTime;
+			uint64_t mappingId = __modules.findSegment(stack[i], &segment) ? segment + 1 : 0;
+			const char *function = (__reportFrames == REPORT_FRAMES_SYMBOL) ? __modules.getSymbol(stack[i], &offset, &firstTime) : NULL;
+			uint64_t location = writer.getLocation(reinterpret_cast<uintptr_t>(stack[i]) - 1, mappingId, function);
+			if (location != 0)
+				locations[numOfLocations++] = location;
 		}
-		out << ", ";
+		int64_t values[2];
+		values[0] = (int64_t)(group.blocks + 0.5);
+		values[1] = (int64_t)(group.bytes + 0.5);
+		writer.writeSample(locations, numOfLocations, values, 2);
+	}
+
+	if (groups != NULL)
+		LT_FREE(groups);
+	return writer.close();
+}
 
-		out << "size=" << info->size << ", ";
 
-		out << "data=";
-		const char *data = reinterpret_cast<const char *>(p);
-		for (unsigned int i = 0; i < PRINTED_DATA_BUFFER_SIZE && i < info->size; i++)
-			out << (isprint(data[i]) ? data[i] : '.');
+// writes the heap profile from the counters of the stacks, without
+// walking the allocations. Stacks are sorted by live bytes, only
+// the top ones if top is not 0. prepareReport() must have been
+// called, __modules mutex must be locked.
+void MemoryTrace::writeHeapProfilePrivate(std::ostream &out, unsigned long top)
+{
+	// index 0 is NO_STACK_ID, never counted
+	unsigned long numOfStacks = __stacks.size();
+	StackTable::stack_counters_t *counters = static_cast<StackTable::stack_counters_t*>(LT_MALLOC((numOfStacks + 1) * sizeof(StackTable::stack_counters_t)));
+	stack_id_t *ids = static_cast<stack_id_t*>(LT_MALLOC((numOfStacks + 1) * sizeof(stack_id_t)));
+	double *bytes = static_cast<double*>(LT_MALLOC((numOfStacks + 1) * sizeof(double)));
+	bool ok = (counters != NULL && ids != NULL && bytes != NULL);
+
+	for (stack_id_t id = 1; ok && id <= numOfStacks; id++)
+		__stacks.getCounters(id, &counters[id]);
+	if (ok) {
+		MutexLock lock(__threadListMutex);
+		for (list_monitoring_options_t::iterator it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it)
+			__stacks.addPending((*it)->stackCounters, counters, numOfStacks);
+	}
+	unsigned long numOfUsed = 0;
+	for (stack_id_t id = 1; ok && id <= numOfStacks; id++) {
+		// counters of threads are read while they may be folded,
+		// or cleared, in those of the stacks
+		if (counters[id].liveBlocks < 0)
+			counters[id].liveBlocks = 0;
+		if (counters[id].liveBytes < 0)
+			counters[id].liveBytes = 0;
+		bytes[id] = counters[id].liveBytes;
+		if (counters[id].allocatedBlocks != 0)
+			ids[numOfUsed++] = id;
+	}
+	unsigned long numOfShown = (top != 0 && top < numOfUsed) ? top : numOfUsed;
+	if (ok)
+		std::partial_sort(ids, ids + numOfShown, ids + numOfUsed, LeaksGroupGreater(bytes));
+
+	writeReportHeader(out, 0);
+	out << " heap_profile=1 stacks=" << numOfShown << "/" << numOfUsed << "\n";
+	writeReportModules(out);
+	if (!ok)
+		std::cerr << "LeakTracer: not enough memory to write the heap profile\n";
+	else if (!__heapProfile)
+		std::cerr << "LeakTracer: LEAKTRACER_HEAP_PROFILE is not set, the heap profile is empty\n";
+
+	// only the symbols of the stacks written are looked up
+	if (__reportFrames == REPORT_FRAMES_SYMBOL) {
+		__modules.newReport();
+		for (unsigned long i = 0; i < numOfShown; i++) {
+			unsigned int numOfFrames;
+			void * const *stack = __stacks.getFrames(ids[i], &numOfFrames);
+			for (unsigned int j = 0; j < numOfFrames; j++)
+				__modules.cacheSymbol(stack[j]);
+		}
+	}
+
+	for (unsigned long i = 0; i < numOfShown; i++) {
+		const StackTable::stack_counters_t &stackCounters = counters[ids[i]];
+		unsigned int numOfFrames;
+		void * const *stack = __stacks.getFrames(ids[i], &numOfFrames);
+		writeFrameSymbols(out, stack, numOfFrames);
+
+		out << "heap, ";
+		out << "live_blocks=" << stackCounters.liveBlocks << ", ";
+		out << "live_bytes=" << stackCounters.liveBytes << ", ";
+		out << "allocated_blocks=" << stackCounters.allocatedBlocks << ", ";
+		out << "allocated_bytes=" << stackCounters.allocatedBytes << ", ";
+		out << "stack=";
+		for (unsigned int j = 0; j < numOfFrames; j++) {
+			if (j > 0) out << ' ';
+			writeFrame(out, stack[j]);
+		}
 		out << '\n';
 	}
+
+	if (counters != NULL)
+		LT_FREE(counters);
+	if (ids != NULL)
+		LT_FREE(ids);
+	if (bytes != NULL)
+		LT_FREE(bytes);
 }
 
 
 // writes all memory leaks to given stream
 void MemoryTrace::writeLeaks(std::ostream &out)
 {
-	MutexLock lock(__allocations_mutex);
+	writeLeaks(out, 0, UINT32_MAX);
+}
+
+
+// writes memory leaks of given generations to given stream
+void MemoryTrace::writeLeaks(std::ostream &out, uint32_t firstGeneration, uint32_t lastGeneration)
+{
+	beginBlockReads();
+	flushEventBuffers();
 	InternalMonitoringDisablerThreadUp();
 
-	writeLeaksPrivate(out);
+	MutexLock modulesLock(__modules.getMutex());
+	prepareReport(true, firstGeneration, lastGeneration);
+	writeLeaksPrivate(out, 0);
+	modulesLock.unlock();
 
 	InternalMonitoringDisablerThreadDown();
+	endBlockReads();
 }
 
 
-// writes all memory leaks to given stream
-void MemoryTrace::writeLeaksToFile(const char* reportFilename)
+// writes memory leaks aggregated by call stack to given stream
+void MemoryTrace::writeAggregatedLeaks(std::ostream &out, unsigned long top)
+{
+	flushEventBuffers();
+	InternalMonitoringDisablerThreadUp();
+
+	MutexLock modulesLock(__modules.getMutex());
+	prepareReport(true, 0, UINT32_MAX);
+	writeAggregatedLeaksPrivate(out, top, 0);
+	modulesLock.unlock();
+
+	InternalMonitoringDisablerThreadDown();
+}
+
+
+// writes the heap profile to given stream. Events are applied
+// before, so that they are counted
+void MemoryTrace::writeHeapProfile(std::ostream &out, unsigned long top)
+{
+	flushEventBuffers();
+	InternalMonitoringDisablerThreadUp();
+
+	// symbols are looked up by the writer, for the stacks written
+	MutexLock modulesLock(__modules.getMutex());
+	prepareReport(false, 0, UINT32_MAX);
+	writeHeapProfilePrivate(out, top);
+	modulesLock.unlock();
+
+	InternalMonitoringDisablerThreadDown();
+}
+
+
+// writes the heap profile to given file
+void MemoryTrace::writeHeapProfileToFile(const char* reportFilename, unsigned long top)
+{
+	InternalMonitoringDisablerThreadUp();
+	std::ofstream oprofile;
+	oprofile.open(reportFilename, std::ios_base::out);
+	bool ok = false;
+	if (oprofile.is_open()) {
+		writeHeapProfile(oprofile, top);
+		oprofile.close();
+		ok = !oprofile.fail();
+	}
+	if (!ok)
+		std::cerr << "Failed to write to \"" << reportFilename << "\"\n";
+	InternalMonitoringDisablerThreadDown();
+}
+
+
+// writes all memory leaks to given file, in the binary format
+// (see leaktracer_report.h). Leaks are written while the shards are
+// walked, the stacks they use are numbered on the way and written
+// after them, then the header is written again with the sizes.
+// prepareReport() must have been called, __modules mutex must be
+// locked. Returns false on write error.
+bool MemoryTrace::writeBinaryLeaksPrivate(FILE *file, uint64_t snapshotStall)
+{
+	leaktracer_report_header_t header;
+	allocation_info_t *info;
+	void *p;
+	bool ok = true;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LEAKTRACER_REPORT_MAGIC, sizeof(header.magic));
+	header.version = LEAKTRACER_REPORT_VERSION;
+	header.headerSize = sizeof(header);
+	header.diffUtcMono = (int64_t)monotonicNanoseconds(CLOCK_REALTIME) - (int64_t)monotonicNanoseconds(CLOCK_MONOTONIC);
+	header.sampleBytes = __sampleBytes;
+	header.flags = (__timestampSource == TIMESTAMP_SEQUENCE) ? LEAKTRACER_REPORT_TIMESTAMP_SEQUENCE : 0;
+	header.leakDataSize = (PRINTED_DATA_BUFFER_SIZE + 7) & ~7;
+	header.leakRecordSize = sizeof(leaktracer_report_leak_t) + header.leakDataSize;
+	header.snapshotStall = snapshotStall;
+	header.firstGeneration = __reportFirstGeneration;
+	header.lastGeneration = __reportLastGeneration;
+	double tscPerNanosecond = measureTscRate();
+	ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+
+	// modules, then their strings
+	uint64_t offset = sizeof(header);
+	header.numOfModules = __modules.size();
+	header.modulesOffset = offset;
+	for (unsigned int i = 0; i < __modules.size(); i++) {
+		leaktracer_report_module_t module;
+		module.base = __modules.getBase(i);
+		module.path = header.stringsSize;
+		header.stringsSize += strlen(__modules.getPath(i)) + 1;
+		module.buildId = header.stringsSize;
+		header.stringsSize += strlen(__modules.getBuildId(i)) + 1;
+		ok = ok && fwrite(&module, sizeof(module), 1, file) == 1;
+	}
+	offset += __modules.size() * sizeof(leaktracer_report_module_t);
+	header.stringsOffset = offset;
+	for (unsigned int i = 0; i < __modules.size(); i++) {
+		ok = ok && fwrite(__modules.getPath(i), strlen(__modules.getPath(i)) + 1, 1, file) == 1;
+		ok = ok && fwrite(__modules.getBuildId(i), strlen(__modules.getBuildId(i)) + 1, 1, file) == 1;
+	}
+	static const char padding[8] = { 0 };
+	ok = ok && fwrite(padding, 1, (8 - header.stringsSize % 8) % 8, file) == (8 - header.stringsSize % 8) % 8;
+	offset += (header.stringsSize + 7) & ~7;
+
+	// leaks: stackIndexes gives 1 + the index in the report of
+	// each stack ID used (0 if unused yet), stackIds gives
+	// the ID of each stack of the report
+	unsigned long numOfIndexes = __stacks.size() + 1;
+	uint32_t *stackIndexes = static_cast<uint32_t*>(LT_CALLOC(numOfIndexes, sizeof(uint32_t)));
+	stack_id_t *stackIds = NULL;
+	unsigned long stackIdsCapacity = 0;
+	char *record = static_cast<char*>(LT_CALLOC(1, header.leakRecordSize));
+	if (stackIndexes == NULL || record == NULL)
+		ok = false;
+
+	header.leaksOffset = offset;
+	for (unsigned int iShard = 0; ok && iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		allocations_shard_t &shard = __shards[iShard];
+		MutexLock lock(shard.mutex);
+		beginLeaksIteration(shard);
+		while (ok && getNextLeak(shard, &info, &p)) {
+			leaktracer_report_leak_t *leak = reinterpret_cast<leaktracer_report_leak_t*>(record);
+			leak->address = reinterpret_cast<uintptr_t>(p);
+			leak->size = info->size;
+			leak->time = timestampSeconds(info->timestamp, tscPerNanosecond);
+			leak->weight = (__sampleBytes != 0) ? info->weight : 1;
+			leak->flags = info->isArray ? LEAKTRACER_REPORT_LEAK_ARRAY : 0;
+			leak->stack = LEAKTRACER_REPORT_NO_STACK;
+
+			stack_id_t id = info->stackId;
+			if (id != NO_STACK_ID && id >= numOfIndexes) {
+				// added since the report started
+				unsigned long count = __stacks.size() + 1;
+				uint32_t *indexes = static_cast<uint32_t*>(LT_REALLOC(stackIndexes, count * sizeof(uint32_t)));
+				if (indexes == NULL) {
+					ok = false;
+					break;
+				}
+				memset(indexes + numOfIndexes, 0, (count - numOfIndexes) * sizeof(uint32_t));
+				stackIndexes = indexes;
+				numOfIndexes = count;
+			}
+			if (id != NO_STACK_ID && stackIndexes[id] == 0) {
+				if (header.numOfStacks == stackIdsCapacity) {
+					stackIdsCapacity = stackIdsCapacity ? stackIdsCapacity * 2 : 1024;
+					stack_id_t *ids = static_cast<stack_id_t*>(LT_REALLOC(stackIds, stackIdsCapacity * sizeof(stack_id_t)));
+					if (ids == NULL) {
+						ok = false;
+						break;
+					}
+					stackIds = ids;
+				}
+				stackIds[header.numOfStacks++] = id;
+				stackIndexes[id] = header.numOfStacks;
+			}
+			if (id != NO_STACK_ID)
+				leak->stack = stackIndexes[id] - 1;
+
+			leak->dataSize = (info->size < PRINTED_DATA_BUFFER_SIZE) ? info->size : PRINTED_DATA_BUFFER_SIZE;
+			memcpy(record + sizeof(leaktracer_report_leak_t), p, leak->dataSize);
+			// nothing of the previous leak is left in the record
+			memset(record + sizeof(leaktracer_report_leak_t) + leak->dataSize, 0,
+				header.leakRecordSize - sizeof(leaktracer_report_leak_t) - leak->dataSize);
+			ok = fwrite(record, header.leakRecordSize, 1, file) == 1;
+			header.numOfLeaks++;
+		}
+		// may have stopped before the end
+		shard.allocations.endIteration();
+	}
+	offset += header.numOfLeaks * header.leakRecordSize;
+
+	// stacks, then their frames
+	header.stacksOffset = offset;
+	for (unsigned long i = 0; ok && i < header.numOfStacks; i++) {
+		leaktracer_report_stack_t stack;
+		__stacks.getFrames(stackIds[i], &stack.numOfFrames);
+		stack.firstFrame = header.numOfFrames;
+		stack.reserved = 0;
+		header.numOfFrames += stack.numOfFrames;
+		ok = fwrite(&stack, sizeof(stack), 1, file) == 1;
+	}
+	offset += header.numOfStacks * sizeof(leaktracer_report_stack_t);
+	header.framesOffset = offset;
+	for (unsigned long i = 0; ok && i < header.numOfStacks; i++) {
+		unsigned int numOfFrames;
+		void * const *frames = __stacks.getFrames(stackIds[i], &numOfFrames);
+		for (unsigned int j = 0; ok && j < numOfFrames; j++) {
+			leaktracer_report_frame_t frame;
+			unsigned int module;
+			uintptr_t moduleOffset;
+			if (__modules.find(frames[j], &module, &moduleOffset)) {
+				frame.offset = moduleOffset;
+				frame.module = module;
+			} else {
+				frame.offset = reinterpret_cast<uintptr_t>(frames[j]);
+				frame.module = LEAKTRACER_REPORT_NO_MODULE;
+			}
+			frame.reserved = 0;
+			ok = fwrite(&frame, sizeof(frame), 1, file) == 1;
+		}
+	}
+
+	if (stackIndexes != NULL)
+		LT_FREE(stackIndexes);
+	if (stackIds != NULL)
+		LT_FREE(stackIds);
+	if (record != NULL)
+		LT_FREE(record);
+
+	// header again, with the sizes
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+	return ok;
+}
+
+
+// writes a report to given file, in given format, returns false
+// on error. prepareReport() must have been called, __modules mutex
+// must be locked.
+bool MemoryTrace::writeReportFile(const char *reportFilename, int format, unsigned long top, uint64_t snapshotStall)
+{
+	bool ok = false;
+	if (format == REPORT_FORMAT_BINARY || format == REPORT_FORMAT_PPROF) {
+		FILE *file = fopen(reportFilename, "wb");
+		if (format == REPORT_FORMAT_BINARY)
+			ok = (file != NULL && writeBinaryLeaksPrivate(file, snapshotStall));
+		else
+			ok = (file != NULL && writePprofLeaksPrivate(file, snapshotStall));
+		if (file != NULL && fclose(file) != 0)
+			ok = false;
+	} else {
+		std::ofstream oleaks;
+		oleaks.open(reportFilename, std::ios_base::out);
+		if (oleaks.is_open()) {
+			if (format == REPORT_FORMAT_AGGREGATED)
+				writeAggregatedLeaksPrivate(oleaks, top, snapshotStall);
+			else
+				writeLeaksPrivate(oleaks, snapshotStall);
+			oleaks.close();
+			ok = !oleaks.fail();
+		}
+	}
+	if (!ok)
+		std::cerr << "Failed to write to \"" << reportFilename << "\"\n";
+	return ok;
+}
+
+
+// writes the report to given file in a forked child, from its
+// copy-on-write snapshot of the allocations: allocating threads
+// only wait while the shards are locked around fork(), not while
+// the report is written. The calling thread waits for the child,
+// so the report is complete on return. The lock-free map is frozen
+// instead, as its hooks don't lock the shards.
+// Modules and symbols are looked up by prepareReport() before, as
+// the child can't take the dynamic loader lock, which another
+// thread may hold at fork() time. __modules mutex must be locked.
+// fork() runs the pthread_atfork() handlers of the program with
+// the shards locked: a handler taking a lock which a thread holds
+// while it allocates deadlocks (raw clone() would skip them, but
+// also the reset of the malloc locks in the child, which needs
+// them to write the report).
+// Returns false if the child could not be started or failed. A
+// child reaped by the program (SIGCHLD ignored, or a handler
+// waiting for any child) can't report its status: the report is
+// written again in this process, and snapshots are disabled.
+bool MemoryTrace::writeLeaksSnapshot(const char *reportFilename, int format, unsigned long top)
+{
+	uint64_t start = monotonicNanoseconds(CLOCK_MONOTONIC);
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++)
+		pthread_mutex_lock(&__shards[iShard].mutex.__mutex);
+#ifdef USE_LOCKFREE_MAP
+	// the hooks don't lock the shards, the child must not copy
+	// slots they are modifying
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++)
+		__shards[iShard].allocations.freeze();
+#endif
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		// only this thread was copied, with the locks it held
+		uint64_t stall = monotonicNanoseconds(CLOCK_MONOTONIC) - start;
+		for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++)
+			pthread_mutex_init(&__shards[iShard].mutex.__mutex, NULL);
+
+		bool ok = writeReportFile(reportFilename, format, top, stall);
+		// no exit handlers, they would write the exit report
+		_exit(ok ? 0 : 1);
+	}
+
+#ifdef USE_LOCKFREE_MAP
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++)
+		__shards[iShard].allocations.thaw();
+#endif
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++)
+		pthread_mutex_unlock(&__shards[iShard].mutex.__mutex);
+	if (pid < 0)
+		return false;
+	__atomic_store_n(&__lastSnapshotStall, monotonicNanoseconds(CLOCK_MONOTONIC) - start, __ATOMIC_RELAXED);
+
+	int status;
+	pid_t waited;
+	while ((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+		;
+	if (waited < 0) {
+		if (errno == ECHILD) {
+			std::cerr << "LeakTracer: report child reaped by the program, reports are not snapshots anymore\n";
+			__reportSnapshot = false;
+		}
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+// writes a report to given file, in given format
+void MemoryTrace::writeReportToFile(const char *reportFilename, int format, unsigned long top,
+	uint32_t firstGeneration, uint32_t lastGeneration)
 {
-	MutexLock lock(__allocations_mutex);
+	// text and binary reports have the first bytes of the blocks
+	bool readsBlocks = (format == REPORT_FORMAT_TEXT || format == REPORT_FORMAT_BINARY);
+	if (readsBlocks)
+		beginBlockReads();
+	flushEventBuffers();
 	InternalMonitoringDisablerThreadUp();
 
-	std::ofstream oleaks;
-	oleaks.open(reportFilename, std::ios_base::out);
-	if (oleaks.is_open())
+	MutexLock modulesLock(__modules.getMutex());
+	prepareReport(format != REPORT_FORMAT_BINARY, firstGeneration, lastGeneration);
+	if (!__reportSnapshot || !writeLeaksSnapshot(reportFilename, format, top))
+		writeReportFile(reportFilename, format, top, 0);
+	modulesLock.unlock();
+
+	InternalMonitoringDisablerThreadDown();
+	if (readsBlocks)
+		endBlockReads();
+}
+
+
+// writes all memory leaks to given file, in binary format
+void MemoryTrace::writeLeaksToBinaryFile(const char* reportFilename)
+{
+	writeReportToFile(reportFilename, REPORT_FORMAT_BINARY, 0, 0, UINT32_MAX);
+}
+
+
+// writes all memory leaks to given file, as a pprof profile
+void MemoryTrace::writeLeaksToPprofFile(const char* reportFilename)
+{
+	writeReportToFile(reportFilename, REPORT_FORMAT_PPROF, 0, 0, UINT32_MAX);
+}
+
+
+// writes memory leaks aggregated by call stack to given file
+void MemoryTrace::writeAggregatedLeaksToFile(const char* reportFilename, unsigned long top)
+{
+	writeReportToFile(reportFilename, REPORT_FORMAT_AGGREGATED, top, 0, UINT32_MAX);
+}
+
+
+// writes all memory leaks to given file
+void MemoryTrace::writeLeaksToFile(const char* reportFilename)
+{
+	writeReportToFile(reportFilename, __reportFormat, __reportTop, 0, UINT32_MAX);
+}
+
+
+// writes memory leaks of given generations to given file
+void MemoryTrace::writeLeaksToFile(const char* reportFilename, uint32_t firstGeneration, uint32_t lastGeneration)
+{
+	writeReportToFile(reportFilename, __reportFormat, __reportTop, firstGeneration, lastGeneration);
+}
+
+
+// per-thread sampling intervals already drawn are kept, the new
+// rate applies from their next sample
+bool MemoryTrace::setSampleBytes(size_t sampleBytes)
+{
+	if (__sampleBytes == 0 || sampleBytes == 0)
+		return false;
+	__atomic_store_n(&__sampleBytes, sampleBytes, __ATOMIC_RELAXED);
+	return true;
+}
+
+
+void MemoryTrace::writeStats(std::ostream &out)
+{
+	out << "monitoring_all_threads=" << (__monitoringAllThreads ? 1 : 0) << "\n";
+	out << "monitoring_releases=" << (__monitoringReleases ? 1 : 0) << "\n";
+	out << "generation=" << getGeneration() << "\n";
+	out << "sample_bytes=" << __sampleBytes << "\n";
+	out << "stacks=" << __stacks.size() << "\n";
+	out << "last_snapshot_stall_ns=" << getLastSnapshotStall() << "\n";
+
+	stats_t stats;
+	getStats(stats);
+	out << "allocations=" << stats.allocations << "\n";
+	out << "releases=" << stats.releases << "\n";
+	out << "allocated_bytes=" << stats.allocatedBytes << "\n";
+	out << "released_bytes=" << stats.releasedBytes << "\n";
+	out << "tracked_allocations=" << stats.trackedAllocations << "\n";
+	out << "tracked_releases=" << stats.trackedReleases << "\n";
+	out << "untracked_allocations=" << stats.untrackedAllocations << "\n";
+	out << "untracked_releases=" << stats.untrackedReleases << "\n";
+	out << "live_blocks=" << stats.liveBlocks << "\n";
+	out << "live_bytes=" << stats.liveBytes << "\n";
+	out << "metadata_bytes=" << stats.metadataBytes << "\n";
+	out << "map_overflows=" << stats.mapOverflows << "\n";
+	if (__sampleBytes != 0)
+		out << "sample_filter_saturated=" << __sampledAddresses.getSaturated() << "\n";
+	writeHookHistograms(out);
+}
+
+
+// histograms of all threads are merged in a copy, the hooks keep
+// running
+void MemoryTrace::writeHookHistograms(std::ostream &out)
+{
+#ifdef LEAKTRACER_HOOK_HISTOGRAMS
+	InternalMonitoringDisablerThreadUp();
+	LatencyHistogram *histograms = new LatencyHistogram[HOOK_PHASES];
 	{
-		writeLeaksPrivate(oleaks);
-		oleaks.close();
+		MutexLock lock(__threadListMutex);
+		for (int phase = 0; phase < HOOK_PHASES; phase++) {
+			histograms[phase].merge(__sharedHookHistograms[phase]);
+			for (list_monitoring_options_t::iterator it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it)
+				histograms[phase].merge((*it)->hookHistograms[phase]);
+		}
 	}
-	else
+
+#ifdef LEAKTRACER_TSC_TIMESTAMP
+	out << "hook_time_unit=cycles\n";
+#else
+	out << "hook_time_unit=ns\n";
+#endif
+	for (int phase = 0; phase < HOOK_PHASES; phase++) {
+		const char *name = __hookPhaseNames[phase];
+		out << "hook_" << name << "_count=" << histograms[phase].count() << "\n";
+		out << "hook_" << name << "_p50=" << histograms[phase].percentile(0.5) << "\n";
+		out << "hook_" << name << "_p99=" << histograms[phase].percentile(0.99) << "\n";
+		out << "hook_" << name << "_p99.9=" << histograms[phase].percentile(0.999) << "\n";
+		out << "hook_" << name << "_max=" << histograms[phase].max() << "\n";
+	}
+	delete[] histograms;
+	InternalMonitoringDisablerThreadDown();
+#endif
+}
+
+
+// adds the counters of a thread (or __sharedStats) to stats,
+// live ones may be negative
+void MemoryTrace::addStats(stats_t &stats, const thread_stats_t &threadStats)
+{
+	stats.allocations += __atomic_load_n(&threadStats.allocations, __ATOMIC_RELAXED);
+	stats.releases += __atomic_load_n(&threadStats.releases, __ATOMIC_RELAXED);
+	stats.allocatedBytes += __atomic_load_n(&threadStats.allocatedBytes, __ATOMIC_RELAXED);
+	stats.releasedBytes += __atomic_load_n(&threadStats.releasedBytes, __ATOMIC_RELAXED);
+	stats.trackedAllocations += __atomic_load_n(&threadStats.trackedAllocations, __ATOMIC_RELAXED);
+	stats.trackedReleases += __atomic_load_n(&threadStats.trackedReleases, __ATOMIC_RELAXED);
+	stats.liveBlocks += (uint64_t)__atomic_load_n(&threadStats.liveBlocks, __ATOMIC_RELAXED);
+	stats.liveBytes += (uint64_t)__atomic_load_n(&threadStats.liveBytes, __ATOMIC_RELAXED);
+}
+
+
+// sums the counters of all threads, and the memory used for them,
+// __threadListMutex must be locked
+void MemoryTrace::sumStats_unlocked(stats_t &stats)
+{
+	memset(&stats, 0, sizeof(stats));
+	addStats(stats, __sharedStats);
+	stats.releases += __atomic_load_n(&__releasesWithoutOptions, __ATOMIC_RELAXED);
+	for (list_monitoring_options_t::iterator it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it) {
+		addStats(stats, (*it)->stats);
+		stats.metadataBytes += sizeof(ThreadMonitoringOptions);
+		if ((*it)->events != NULL)
+			stats.metadataBytes += (*it)->events->getMemoryUsage();
+	}
+	stats.metadataBytes += __flushOrderCapacity * sizeof(allocation_event_t*);
+}
+
+
+// neither the event buffers nor the shards are locked: operations
+// still queued in event buffers are not counted as tracked yet, and
+// the memory used by the maps is read while they may grow
+void MemoryTrace::getStats(stats_t &stats)
+{
+	InternalMonitoringDisablerThreadUp();
 	{
-		std::cerr << "Failed to write to \"" << reportFilename << "\"\n";
+		MutexLock lock(__threadListMutex);
+		sumStats_unlocked(stats);
 	}
+
+	// a block released by one thread while another one clears
+	// the allocations may be counted twice
+	if ((int64_t)stats.liveBlocks < 0)
+		stats.liveBlocks = 0;
+	if ((int64_t)stats.liveBytes < 0)
+		stats.liveBytes = 0;
+	stats.untrackedAllocations = (stats.allocations > stats.trackedAllocations) ? stats.allocations - stats.trackedAllocations : 0;
+	stats.untrackedReleases = (stats.releases > stats.trackedReleases) ? stats.releases - stats.trackedReleases : 0;
+
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		stats.metadataBytes += __shards[iShard].allocations.getMemoryUsage();
+#ifdef USE_LOCKFREE_MAP
+		stats.mapOverflows += __shards[iShard].allocations.getOverflows();
+#endif
+	}
+#ifndef USE_LOCKFREE_MAP
+	stats.metadataBytes += __nodesPool.getMemoryUsage();
+#endif
+	stats.metadataBytes += __stacks.getMemoryUsage();
+	stats.metadataBytes += __sampledAddresses.getMemoryUsage();
 	InternalMonitoringDisablerThreadDown();
 }
 
+
+// events queued before the new generation starts are applied with
+// the previous one
+uint32_t MemoryTrace::markGeneration(void)
+{
+	flushEventBuffers();
+	return __atomic_add_fetch(&__generation, 1, __ATOMIC_RELAXED);
+}
+
 void MemoryTrace::clearAllocationsInfo(void)
 {
-	MutexLock lock(__allocations_mutex);
-	__allocations.clearAllInfo();
+	// events queued before must not be applied after clearing
+	flushEventBuffers();
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		MutexLock lock(__shards[iShard].mutex);
+		__shards[iShard].allocations.clearAllInfo();
+	}
+	__stacks.clearLiveCounters();
+	// cleared blocks won't be looked up on release anymore, this
+	// also resets the saturated counters
+	if (__sampleBytes != 0)
+		__sampledAddresses.clear();
+
+	// cleared blocks are not live anymore, blocks tracked by
+	// other threads meanwhile may be missed
+	{
+		MutexLock lock(__threadListMutex);
+		for (list_monitoring_options_t::iterator it = __listThreadOptions.begin(); it != __listThreadOptions.end(); ++it)
+			__stacks.discardPendingLive((*it)->stackCounters);
+		stats_t stats;
+		sumStats_unlocked(stats);
+		addToCounter(__sharedStats.liveBlocks, -(int64_t)stats.liveBlocks);
+		addToCounter(__sharedStats.liveBytes, -(int64_t)stats.liveBytes);
+	}
+#ifndef USE_LOCKFREE_MAP
+	// give the nodes back to the system
+	__nodesPool.trim();
+#endif
+}
+
+void MemoryTrace::trimMetadataIfDue(void)
+{
+#ifdef USE_LOCKFREE_MAP
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		if (!__shards[iShard].allocations.cleanUpDue())
+			continue;
+		MutexLock lock(__shards[iShard].mutex);
+		__shards[iShard].allocations.cleanUp();
+	}
+#else
+	__nodesPool.trimIfDue();
+#endif
+}
+
+bool MemoryTrace::allocationsInfoEmpty(void)
+{
+	flushEventBuffers();
+	for (unsigned int iShard = 0; iShard < ALLOCATION_MAP_SHARDS; iShard++) {
+		MutexLock lock(__shards[iShard].mutex);
+		if (!__shards[iShard].allocations.empty())
+			return false;
+	}
+	return true;
 }
 
 
@@ -0,0 +1,309 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <elf.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ModuleTable.hpp"
+#include "PointerHash.hpp"
+
+
+namespace leaktracer {
+
+
+ModuleTable::ModuleTable(void)
+: __modules(NULL), __numOfModules(0), __modulesCapacity(0),
+  __segments(NULL), __numOfSegments(0), __segmentsCapacity(0),
+  __adds(0), __subs(0), __collected(false),
+  __symbols(NULL), __symbolsCapacity(0), __numOfSymbols(0), __report(0)
+{
+}
+
+
+ModuleTable::~ModuleTable(void)
+{
+	clear();
+	if (__modules != NULL)
+		LT_FREE(__modules);
+	if (__segments != NULL)
+		LT_FREE(__segments);
+	if (__symbols != NULL)
+		LT_FREE(__symbols);
+}
+
+
+void ModuleTable::clear(void)
+{
+	for (unsigned int i = 0; i < __numOfModules; i++)
+		LT_FREE(__modules[i].path);
+	__numOfModules = 0;
+	__numOfSegments = 0;
+	clearSymbols();
+}
+
+
+// stops at the first module, the counters are the same in all
+// of them: returns 2 if the modules did not change
+int ModuleTable::changedCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	ModuleTable *table = static_cast<ModuleTable*>(data);
+	if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs) ||
+		!table->__collected || info->dlpi_adds != table->__adds || info->dlpi_subs != table->__subs) {
+		if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+			table->__adds = info->dlpi_adds;
+			table->__subs = info->dlpi_subs;
+		}
+		return 1;
+	}
+	return 2;
+}
+
+
+int ModuleTable::collectCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void)size;
+	ModuleTable *table = static_cast<ModuleTable*>(data);
+	const char *path = info->dlpi_name;
+	char exe[PATH_MAX];
+
+	// the program has no name, libraries found through a relative
+	// LD_LIBRARY_PATH have a relative one
+	if (path == NULL || path[0] == '\0') {
+		ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+		exe[length > 0 ? length : 0] = '\0';
+		path = exe;
+	} else if (path[0] != '/' && realpath(path, exe) != NULL) {
+		path = exe;
+	}
+	if (!table->addModule(path, info->dlpi_addr))
+		return 1;
+
+	module_t &module = table->__modules[table->__numOfModules - 1];
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+		if (phdr.p_type == PT_LOAD) {
+			if (!table->addSegment(info->dlpi_addr + phdr.p_vaddr, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz, phdr.p_offset))
+				return 1;
+		} else if (phdr.p_type == PT_NOTE && module.buildId[0] == '\0') {
+			// notes are 4 bytes aligned
+			const char *note = reinterpret_cast<const char*>(info->dlpi_addr + phdr.p_vaddr);
+			const char *end = note + phdr.p_memsz;
+			while (note + sizeof(ElfW(Nhdr)) <= end) {
+				const ElfW(Nhdr) *nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+				const char *name = note + sizeof(ElfW(Nhdr));
+				const unsigned char *desc = reinterpret_cast<const unsigned char*>(name + ((nhdr->n_namesz + 3) & ~3));
+				if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0 &&
+					nhdr->n_descsz <= 32 && reinterpret_cast<const char*>(desc) + nhdr->n_descsz <= end) {
+					for (unsigned int j = 0; j < nhdr->n_descsz; j++) {
+						module.buildId[2 * j] = "0123456789abcdef"[desc[j] >> 4];
+						module.buildId[2 * j + 1] = "0123456789abcdef"[desc[j] & 0xf];
+					}
+					module.buildId[2 * nhdr->n_descsz] = '\0';
+					break;
+				}
+				note = reinterpret_cast<const char*>(desc) + ((nhdr->n_descsz + 3) & ~3);
+			}
+		}
+	}
+	return 0;
+}
+
+
+bool ModuleTable::addModule(const char *path, uintptr_t base)
+{
+	if (__numOfModules == __modulesCapacity) {
+		unsigned int capacity = __modulesCapacity ? __modulesCapacity * 2 : 64;
+		module_t *modules = static_cast<module_t*>(LT_REALLOC(__modules, capacity * sizeof(module_t)));
+		if (modules == NULL)
+			return false;
+		__modules = modules;
+		__modulesCapacity = capacity;
+	}
+
+	char *copy = static_cast<char*>(LT_MALLOC(strlen(path) + 1));
+	if (copy == NULL)
+		return false;
+	strcpy(copy, path);
+
+	module_t &module = __modules[__numOfModules++];
+	module.path = copy;
+	module.base = base;
+	module.buildId[0] = '\0';
+	return true;
+}
+
+
+// keeps the segments sorted, they are few
+bool ModuleTable::addSegment(uintptr_t start, uintptr_t end, uintptr_t fileOffset)
+{
+	if (__numOfSegments == __segmentsCapacity) {
+		unsigned int capacity = __segmentsCapacity ? __segmentsCapacity * 2 : 256;
+		segment_t *segments = static_cast<segment_t*>(LT_REALLOC(__segments, capacity * sizeof(segment_t)));
+		if (segments == NULL)
+			return false;
+		__segments = segments;
+		__segmentsCapacity = capacity;
+	}
+
+	unsigned int iPos = __numOfSegments;
+	while (iPos > 0 && __segments[iPos - 1].start > start) {
+		__segments[iPos] = __segments[iPos - 1];
+		iPos--;
+	}
+	__segments[iPos].start = start;
+	__segments[iPos].end = end;
+	__segments[iPos].fileOffset = fileOffset;
+	__segments[iPos].module = __numOfModules - 1;
+	__numOfSegments++;
+	return true;
+}
+
+
+void ModuleTable::refresh(void)
+{
+	if (dl_iterate_phdr(changedCallback, this) == 2)
+		return;
+
+	clear();
+	dl_iterate_phdr(collectCallback, this);
+	__collected = true;
+}
+
+
+bool ModuleTable::findSegment(void *addr, unsigned int *pIndex)
+{
+	uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+	unsigned int low = 0, high = __numOfSegments;
+
+	// last segment starting at or before addr
+	while (low < high) {
+		unsigned int middle = (low + high) / 2;
+		if (__segments[middle].start <= a)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low == 0 || a >= __segments[low - 1].end)
+		return false;
+
+	*pIndex = low - 1;
+	return true;
+}
+
+
+bool ModuleTable::find(void *addr, unsigned int *pIndex, uintptr_t *pOffset)
+{
+	unsigned int segment;
+	if (!findSegment(addr, &segment))
+		return false;
+
+	*pIndex = __segments[segment].module;
+	*pOffset = reinterpret_cast<uintptr_t>(addr) - __modules[*pIndex].base;
+	return true;
+}
+
+
+void ModuleTable::clearSymbols(void)
+{
+	if (__symbols != NULL)
+		memset(__symbols, 0, __symbolsCapacity * sizeof(symbol_t));
+	__numOfSymbols = 0;
+}
+
+
+// replaces the cache by a twice bigger one (or allocates the
+// first one)
+bool ModuleTable::growSymbols(void)
+{
+	unsigned long capacity = __symbolsCapacity ? __symbolsCapacity * 2 : MODULE_TABLE_MIN_SYMBOLS;
+	symbol_t *symbols = static_cast<symbol_t*>(LT_CALLOC(capacity, sizeof(symbol_t)));
+	if (symbols == NULL)
+		return false;
+
+	for (unsigned long i = 0; i < __symbolsCapacity; i++) {
+		if (__symbols[i].addr == NULL)
+			continue;
+		unsigned long j = hashPointer(__symbols[i].addr) & (capacity - 1);
+		while (symbols[j].addr != NULL)
+			j = (j + 1) & (capacity - 1);
+		symbols[j] = __symbols[i];
+	}
+	if (__symbols != NULL)
+		LT_FREE(__symbols);
+	__symbols = symbols;
+	__symbolsCapacity = capacity;
+	return true;
+}
+
+
+// returns the slot of addr, or the free slot where it would be
+// added, the cache must be allocated
+inline ModuleTable::symbol_t * ModuleTable::findSymbol(void *addr)
+{
+	unsigned long i = hashPointer(addr) & (__symbolsCapacity - 1);
+	while (__symbols[i].addr != NULL && __symbols[i].addr != addr)
+		i = (i + 1) & (__symbolsCapacity - 1);
+	return &__symbols[i];
+}
+
+
+void ModuleTable::cacheSymbol(void *addr)
+{
+	if (addr == NULL)
+		return;
+	// keep the cache at most half full
+	if ((__numOfSymbols + 1) * 2 > __symbolsCapacity && !growSymbols())
+		return;
+
+	symbol_t *symbol = findSymbol(addr);
+	if (symbol->addr != NULL)
+		return;
+
+	// a return address may be just after the end of
+	// the calling function
+	Dl_info dlInfo;
+	symbol->addr = addr;
+	symbol->name = NULL;
+	symbol->offset = 0;
+	if (dladdr(static_cast<char*>(addr) - 1, &dlInfo) != 0 && dlInfo.dli_sname != NULL) {
+		symbol->name = dlInfo.dli_sname;
+		symbol->offset = static_cast<char*>(addr) - static_cast<char*>(dlInfo.dli_saddr);
+	}
+	__numOfSymbols++;
+}
+
+
+const char * ModuleTable::getSymbol(void *addr, uintptr_t *pOffset, bool *pFirstTime)
+{
+	*pFirstTime = false;
+	if (addr == NULL || __symbols == NULL)
+		return NULL;
+
+	symbol_t *symbol = findSymbol(addr);
+	if (symbol->addr == NULL)
+		return NULL;
+
+	*pFirstTime = (symbol->report != __report);
+	symbol->report = __report;
+	*pOffset = symbol->offset;
+	return symbol->name;
+}
+
+
+}  // end namespace
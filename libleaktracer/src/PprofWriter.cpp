@@ -0,0 +1,394 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#include <string.h>
+#include "PprofWriter.hpp"
+#include "PointerHash.hpp"
+
+
+namespace leaktracer {
+
+
+// field numbers of profile.proto
+enum {
+	PROFILE_SAMPLE_TYPE = 1, PROFILE_SAMPLE = 2, PROFILE_MAPPING = 3, PROFILE_LOCATION = 4,
+	PROFILE_FUNCTION = 5, PROFILE_STRING_TABLE = 6, PROFILE_TIME_NANOS = 9,
+	PROFILE_PERIOD_TYPE = 11, PROFILE_PERIOD = 12, PROFILE_COMMENT = 13, PROFILE_DEFAULT_SAMPLE_TYPE = 14
+};
+enum { VALUE_TYPE_TYPE = 1, VALUE_TYPE_UNIT = 2 };
+enum { SAMPLE_LOCATION_ID = 1, SAMPLE_VALUE = 2 };
+enum {
+	MAPPING_ID = 1, MAPPING_MEMORY_START = 2, MAPPING_MEMORY_LIMIT = 3, MAPPING_FILE_OFFSET = 4,
+	MAPPING_FILENAME = 5, MAPPING_BUILD_ID = 6
+};
+enum { LOCATION_ID = 1, LOCATION_MAPPING_ID = 2, LOCATION_ADDRESS = 3, LOCATION_LINE = 4 };
+enum { LINE_FUNCTION_ID = 1 };
+enum { FUNCTION_ID = 1, FUNCTION_NAME = 2, FUNCTION_SYSTEM_NAME = 3 };
+
+// wire types
+enum { WIRE_VARINT = 0, WIRE_LENGTH_DELIMITED = 2 };
+
+
+// encodes a varint in buffer (10 bytes at most), returns its size
+static inline size_t encodeVarint(unsigned char *buffer, uint64_t value)
+{
+	size_t size = 0;
+	while (value >= 0x80) {
+		buffer[size++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	buffer[size++] = (unsigned char)value;
+	return size;
+}
+
+
+PprofWriter::PprofWriter(FILE *file)
+: __file(file), __ok(true), __numOfStrings(0),
+  __message(NULL), __messageSize(0), __messageCapacity(0),
+  __block(NULL), __blockSize(0), __crc(0xffffffff), __inputSize(0)
+{
+	memset(&__locations, 0, sizeof(__locations));
+	memset(&__functions, 0, sizeof(__functions));
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		__crcTable[i] = c;
+	}
+
+	__block = static_cast<unsigned char*>(LT_MALLOC(PPROF_WRITER_BLOCK_SIZE));
+	if (__block == NULL)
+		__ok = false;
+
+	// gzip header: deflate, no name, no time, from Unix
+	static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	if (fwrite(header, sizeof(header), 1, __file) != 1)
+		__ok = false;
+
+	// first string must be the empty one
+	addString("");
+}
+
+
+PprofWriter::~PprofWriter(void)
+{
+	if (__message != NULL)
+		LT_FREE(__message);
+	if (__block != NULL)
+		LT_FREE(__block);
+	if (__locations.slots != NULL)
+		LT_FREE(__locations.slots);
+	if (__functions.slots != NULL)
+		LT_FREE(__functions.slots);
+}
+
+
+// appends data to the gzip stream
+void PprofWriter::output(const void *data, size_t size)
+{
+	const unsigned char *bytes = static_cast<const unsigned char*>(data);
+
+	if (!__ok)
+		return;
+	for (size_t i = 0; i < size; i++)
+		__crc = __crcTable[(__crc ^ bytes[i]) & 0xff] ^ (__crc >> 8);
+	__inputSize += size;
+
+	while (size > 0) {
+		size_t chunk = PPROF_WRITER_BLOCK_SIZE - __blockSize;
+		if (chunk > size)
+			chunk = size;
+		memcpy(__block + __blockSize, bytes, chunk);
+		__blockSize += chunk;
+		bytes += chunk;
+		size -= chunk;
+		if (__blockSize == PPROF_WRITER_BLOCK_SIZE)
+			writeBlock(false);
+	}
+}
+
+
+// writes the block as a stored deflate block: header byte (last
+// block flag, type 0), length and its complement, data
+void PprofWriter::writeBlock(bool last)
+{
+	unsigned char header[5];
+	header[0] = last ? 1 : 0;
+	header[1] = (unsigned char)__blockSize;
+	header[2] = (unsigned char)(__blockSize >> 8);
+	header[3] = (unsigned char)~header[1];
+	header[4] = (unsigned char)~header[2];
+	if (fwrite(header, sizeof(header), 1, __file) != 1 ||
+		(__blockSize != 0 && fwrite(__block, __blockSize, 1, __file) != 1))
+		__ok = false;
+	__blockSize = 0;
+}
+
+
+bool PprofWriter::close(void)
+{
+	if (!__ok)
+		return false;
+	writeBlock(true);
+
+	// gzip trailer: CRC-32 and size of the data, little endian
+	uint32_t crc = __crc ^ 0xffffffff;
+	unsigned char trailer[8];
+	for (int i = 0; i < 4; i++) {
+		trailer[i] = (unsigned char)(crc >> (8 * i));
+		trailer[4 + i] = (unsigned char)(__inputSize >> (8 * i));
+	}
+	if (fwrite(trailer, sizeof(trailer), 1, __file) != 1)
+		__ok = false;
+	return __ok;
+}
+
+
+void PprofWriter::putByte(unsigned char byte)
+{
+	if (__messageSize == __messageCapacity) {
+		size_t capacity = __messageCapacity ? __messageCapacity * 2 : 256;
+		unsigned char *message = static_cast<unsigned char*>(LT_REALLOC(__message, capacity));
+		if (message == NULL) {
+			__ok = false;
+			return;
+		}
+		__message = message;
+		__messageCapacity = capacity;
+	}
+	__message[__messageSize++] = byte;
+}
+
+
+void PprofWriter::putVarint(uint64_t value)
+{
+	unsigned char buffer[10];
+	size_t size = encodeVarint(buffer, value);
+	for (size_t i = 0; i < size; i++)
+		putByte(buffer[i]);
+}
+
+
+// varint field, not written if 0 (the default value)
+void PprofWriter::putField(unsigned int field, uint64_t value)
+{
+	if (value == 0)
+		return;
+	putVarint(field << 3 | WIRE_VARINT);
+	putVarint(value);
+}
+
+
+// int64 values are encoded as their two's complement
+template <typename T> void PprofWriter::putPacked(unsigned int field, const T *values, unsigned int numOfValues)
+{
+	unsigned char buffer[10];
+	size_t size = 0;
+	for (unsigned int i = 0; i < numOfValues; i++)
+		size += encodeVarint(buffer, (uint64_t)values[i]);
+	putVarint(field << 3 | WIRE_LENGTH_DELIMITED);
+	putVarint(size);
+	for (unsigned int i = 0; i < numOfValues; i++)
+		putVarint((uint64_t)values[i]);
+}
+
+
+void PprofWriter::putMessage(unsigned int field, const unsigned char *message, size_t size)
+{
+	putVarint(field << 3 | WIRE_LENGTH_DELIMITED);
+	putVarint(size);
+	for (size_t i = 0; i < size; i++)
+		putByte(message[i]);
+}
+
+
+// writes the message encoded as given field of the profile
+void PprofWriter::endMessage(unsigned int field)
+{
+	unsigned char buffer[20];
+	size_t size = encodeVarint(buffer, field << 3 | WIRE_LENGTH_DELIMITED);
+	size += encodeVarint(buffer + size, __messageSize);
+	output(buffer, size);
+	output(__message, __messageSize);
+}
+
+
+int64_t PprofWriter::addString(const char *s)
+{
+	size_t length = strlen(s);
+	unsigned char buffer[20];
+	size_t size = encodeVarint(buffer, PROFILE_STRING_TABLE << 3 | WIRE_LENGTH_DELIMITED);
+	size += encodeVarint(buffer + size, length);
+	output(buffer, size);
+	output(s, length);
+	return __numOfStrings++;
+}
+
+
+void PprofWriter::writeValueType(unsigned int field, const char *type, const char *unit)
+{
+	int64_t typeIndex = addString(type);
+	int64_t unitIndex = addString(unit);
+	beginMessage();
+	putField(VALUE_TYPE_TYPE, typeIndex);
+	putField(VALUE_TYPE_UNIT, unitIndex);
+	endMessage(field);
+}
+
+
+void PprofWriter::writeSampleType(const char *type, const char *unit)
+{
+	writeValueType(PROFILE_SAMPLE_TYPE, type, unit);
+}
+
+
+void PprofWriter::writePeriod(const char *type, const char *unit, int64_t period)
+{
+	writeValueType(PROFILE_PERIOD_TYPE, type, unit);
+	beginMessage();
+	putField(PROFILE_PERIOD, period);
+	output(__message, __messageSize);
+}
+
+
+// an int64 field of the profile is written as a one field message
+// without its length: the encoding is the same
+void PprofWriter::writeDefaultSampleType(const char *type)
+{
+	int64_t typeIndex = addString(type);
+	beginMessage();
+	putField(PROFILE_DEFAULT_SAMPLE_TYPE, typeIndex);
+	output(__message, __messageSize);
+}
+
+
+void PprofWriter::writeTime(int64_t timeNanos)
+{
+	beginMessage();
+	putField(PROFILE_TIME_NANOS, timeNanos);
+	output(__message, __messageSize);
+}
+
+
+void PprofWriter::writeComment(const char *comment)
+{
+	int64_t commentIndex = addString(comment);
+	beginMessage();
+	putVarint(PROFILE_COMMENT << 3 | WIRE_VARINT);
+	putVarint(commentIndex);
+	output(__message, __messageSize);
+}
+
+
+void PprofWriter::writeMapping(uint64_t id, uint64_t start, uint64_t limit, uint64_t fileOffset,
+	const char *filename, const char *buildId)
+{
+	int64_t filenameIndex = addString(filename);
+	int64_t buildIdIndex = addString(buildId);
+	beginMessage();
+	putField(MAPPING_ID, id);
+	putField(MAPPING_MEMORY_START, start);
+	putField(MAPPING_MEMORY_LIMIT, limit);
+	putField(MAPPING_FILE_OFFSET, fileOffset);
+	putField(MAPPING_FILENAME, filenameIndex);
+	putField(MAPPING_BUILD_ID, buildIdIndex);
+	endMessage(PROFILE_MAPPING);
+}
+
+
+// returns the slot of key in table, or the free slot where it
+// would be added, NULL if the table could not grow. The table is
+// kept at most half full
+PprofWriter::id_slot_t * PprofWriter::findId(id_table_t &table, uintptr_t key)
+{
+	if ((table.size + 1) * 2 > table.capacity) {
+		unsigned long capacity = table.capacity ? table.capacity * 2 : PPROF_WRITER_MIN_IDS;
+		id_slot_t *slots = static_cast<id_slot_t*>(LT_CALLOC(capacity, sizeof(id_slot_t)));
+		if (slots == NULL) {
+			__ok = false;
+			return NULL;
+		}
+		for (unsigned long i = 0; i < table.capacity; i++) {
+			if (table.slots[i].key == 0)
+				continue;
+			unsigned long j = hashPointer(reinterpret_cast<void*>(table.slots[i].key)) & (capacity - 1);
+			while (slots[j].key != 0)
+				j = (j + 1) & (capacity - 1);
+			slots[j] = table.slots[i];
+		}
+		if (table.slots != NULL)
+			LT_FREE(table.slots);
+		table.slots = slots;
+		table.capacity = capacity;
+	}
+
+	unsigned long i = hashPointer(reinterpret_cast<void*>(key)) & (table.capacity - 1);
+	while (table.slots[i].key != 0 && table.slots[i].key != key)
+		i = (i + 1) & (table.capacity - 1);
+	return &table.slots[i];
+}
+
+
+uint64_t PprofWriter::getLocation(uintptr_t address, uint64_t mappingId, const char *function)
+{
+	// address 0 can't be a key, it has no location
+	id_slot_t *location = (address != 0) ? findId(__locations, address) : NULL;
+	if (location == NULL)
+		return 0;
+	if (location->key != 0)
+		return location->id;
+
+	uint64_t functionId = 0;
+	id_slot_t *slot = (function != NULL) ? findId(__functions, reinterpret_cast<uintptr_t>(function)) : NULL;
+	if (slot != NULL && slot->key != 0) {
+		functionId = slot->id;
+	} else if (slot != NULL) {
+		slot->key = reinterpret_cast<uintptr_t>(function);
+		slot->id = functionId = ++__functions.size;
+		int64_t nameIndex = addString(function);
+		beginMessage();
+		putField(FUNCTION_ID, functionId);
+		putField(FUNCTION_NAME, nameIndex);
+		putField(FUNCTION_SYSTEM_NAME, nameIndex);
+		endMessage(PROFILE_FUNCTION);
+	}
+
+	location->key = address;
+	location->id = ++__locations.size;
+	beginMessage();
+	putField(LOCATION_ID, location->id);
+	putField(LOCATION_MAPPING_ID, mappingId);
+	putField(LOCATION_ADDRESS, address);
+	if (functionId != 0) {
+		unsigned char line[11];
+		line[0] = LINE_FUNCTION_ID << 3 | WIRE_VARINT;
+		size_t size = 1 + encodeVarint(line + 1, functionId);
+		putMessage(LOCATION_LINE, line, size);
+	}
+	endMessage(PROFILE_LOCATION);
+	return location->id;
+}
+
+
+void PprofWriter::writeSample(const uint64_t *locations, unsigned int numOfLocations,
+	const int64_t *values, unsigned int numOfValues)
+{
+	beginMessage();
+	putPacked(SAMPLE_LOCATION_ID, locations, numOfLocations);
+	putPacked(SAMPLE_VALUE, values, numOfValues);
+	endMessage(PROFILE_SAMPLE);
+}
+
+
+}  // end namespace
@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+#include "StackTable.hpp"
+
+
+namespace leaktracer {
+
+
+StackTable::StackTable(void)
+: __arenaChunk(NULL), __arenaUsed(0), __count(0), __index(NULL), __memoryUsage(0)
+{
+	for (unsigned int i = 0; i < STACK_TABLE_MAX_CHUNKS; i++)
+		__entries[i] = NULL;
+}
+
+
+StackTable::~StackTable(void)
+{
+	for (unsigned int i = 0; i < STACK_TABLE_MAX_CHUNKS && __entries[i] != NULL; i++)
+		LT_FREE(__entries[i]);
+	while (__index != NULL) {
+		index_t *previous = __index->previous;
+		LT_FREE(__index);
+		__index = previous;
+	}
+	while (__arenaChunk != NULL) {
+		char *next = *reinterpret_cast<char**>(__arenaChunk);
+		LT_FREE(__arenaChunk);
+		__arenaChunk = next;
+	}
+}
+
+
+// allocates an entry of numOfFrames frames from the arena,
+// mutex must be locked
+inline StackTable::stack_entry_t * StackTable::allocateEntry(unsigned int numOfFrames)
+{
+	size_t size = sizeof(stack_entry_t) + numOfFrames * sizeof(void*) - sizeof(void*);
+
+	if (__arenaChunk == NULL || __arenaUsed + size > STACK_TABLE_ARENA_CHUNK_SIZE) {
+		// entry is bigger than a chunk (very deep stacks),
+		// chunk is sized for it
+		size_t chunkSize = sizeof(char*) + size;
+		if (chunkSize < STACK_TABLE_ARENA_CHUNK_SIZE)
+			chunkSize = STACK_TABLE_ARENA_CHUNK_SIZE;
+		char *chunk = static_cast<char*>(LT_MALLOC(chunkSize));
+		if (chunk == NULL)
+			return NULL;
+		*reinterpret_cast<char**>(chunk) = __arenaChunk;
+		__arenaChunk = chunk;
+		addMemoryUsage(chunkSize);
+		__arenaUsed = sizeof(char*);
+	}
+
+	stack_entry_t *entry = reinterpret_cast<stack_entry_t*>(__arenaChunk + __arenaUsed);
+	__arenaUsed += size;
+	return entry;
+}
+
+
+// replaces the index by a twice bigger one (or allocates the
+// first one), mutex must be locked
+bool StackTable::growIndex(void)
+{
+	unsigned long capacity = (__index != NULL) ? __index->capacity * 2 : STACK_TABLE_MIN_INDEX_CAPACITY;
+	index_t *index = static_cast<index_t*>(LT_CALLOC(1, sizeof(index_t) + (capacity - 1) * sizeof(stack_id_t)));
+	if (index == NULL)
+		return false;
+
+	index->previous = __index;
+	index->capacity = capacity;
+	addMemoryUsage(sizeof(index_t) + (capacity - 1) * sizeof(stack_id_t));
+	for (stack_id_t id = 1; id <= __count; id++)
+		addToIndex(index, id);
+	__atomic_store_n(&__index, index, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+stack_id_t StackTable::intern(void * const *frames, unsigned int numOfFrames)
+{
+	uint64_t h = hash(frames, numOfFrames);
+	stack_id_t id = lookup(frames, numOfFrames, h);
+	if (id != NO_STACK_ID)
+		return id;
+
+	MutexLock lock(__mutex);
+	// may have been added meanwhile
+	id = lookup(frames, numOfFrames, h);
+	if (id != NO_STACK_ID)
+		return id;
+
+	unsigned int iChunk = __count >> STACK_TABLE_CHUNK_BITS;
+	if (iChunk >= STACK_TABLE_MAX_CHUNKS)
+		return NO_STACK_ID;
+	if (__entries[iChunk] == NULL) {
+		stack_entry_t **chunk = static_cast<stack_entry_t**>(LT_MALLOC(STACK_TABLE_CHUNK_SIZE * sizeof(stack_entry_t*)));
+		if (chunk == NULL)
+			return NO_STACK_ID;
+		addMemoryUsage(STACK_TABLE_CHUNK_SIZE * sizeof(stack_entry_t*));
+		__atomic_store_n(&__entries[iChunk], chunk, __ATOMIC_RELEASE);
+	}
+	// keep the index at most half full
+	if ((__index == NULL || (__count + 1) * 2 > __index->capacity) && !growIndex())
+		return NO_STACK_ID;
+
+	stack_entry_t *entry = allocateEntry(numOfFrames);
+	if (entry == NULL)
+		return NO_STACK_ID;
+	entry->hash = h;
+	memset(&entry->counters, 0, sizeof(entry->counters));
+	entry->numOfFrames = numOfFrames;
+	memcpy(entry->frames, frames, numOfFrames * sizeof(void*));
+
+	id = __count + 1;
+	__atomic_store_n(&__entries[iChunk][(id - 1) & (STACK_TABLE_CHUNK_SIZE - 1)], entry, __ATOMIC_RELEASE);
+	__atomic_store_n(&__count, id, __ATOMIC_RELEASE);
+	addToIndex(__index, id);
+	return id;
+}
+
+
+// live counters are decreased by what they count now rather than
+// zeroed, so that the hooks counting meanwhile are not lost
+void StackTable::clearLiveCounters(void)
+{
+	for (stack_id_t id = 1; id <= size(); id++) {
+		stack_counters_t &counters = getEntry(id)->counters;
+		__atomic_sub_fetch(&counters.liveBlocks, __atomic_load_n(&counters.liveBlocks, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&counters.liveBytes, __atomic_load_n(&counters.liveBytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
+}
+
+
+// the live counters of the thread are subtracted from their stacks,
+// as the thread still adds them when they are folded
+void StackTable::discardPendingLive(const thread_counters_t &pending)
+{
+	for (unsigned int iSlot = 0; iSlot < STACK_TABLE_THREAD_SLOTS; iSlot++) {
+		stack_id_t id = __atomic_load_n(&pending.slots[iSlot].id, __ATOMIC_RELAXED);
+		if (id == NO_STACK_ID)
+			continue;
+		const stack_counters_t &from = pending.slots[iSlot].counters;
+		stack_counters_t &counters = getEntry(id)->counters;
+		__atomic_sub_fetch(&counters.liveBlocks, __atomic_load_n(&from.liveBlocks, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&counters.liveBytes, __atomic_load_n(&from.liveBytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
+}
+
+
+void StackTable::fold(thread_counters_t &pending)
+{
+	for (unsigned int iSlot = 0; iSlot < STACK_TABLE_THREAD_SLOTS; iSlot++) {
+		if (pending.slots[iSlot].id != NO_STACK_ID)
+			foldSlot(pending, iSlot);
+	}
+}
+
+
+// a slot taken by another stack while it is read is skipped
+void StackTable::addPending(const thread_counters_t &pending, stack_counters_t *counters, unsigned long numOfStacks)
+{
+	for (unsigned int iSlot = 0; iSlot < STACK_TABLE_THREAD_SLOTS; iSlot++) {
+		stack_id_t id = __atomic_load_n(&pending.slots[iSlot].id, __ATOMIC_ACQUIRE);
+		if (id == NO_STACK_ID || id > numOfStacks)
+			continue;
+		const stack_counters_t &from = pending.slots[iSlot].counters;
+		stack_counters_t slot;
+		slot.liveBlocks = __atomic_load_n(&from.liveBlocks, __ATOMIC_RELAXED);
+		slot.liveBytes = __atomic_load_n(&from.liveBytes, __ATOMIC_RELAXED);
+		slot.allocatedBlocks = __atomic_load_n(&from.allocatedBlocks, __ATOMIC_RELAXED);
+		slot.allocatedBytes = __atomic_load_n(&from.allocatedBytes, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&pending.slots[iSlot].id, __ATOMIC_ACQUIRE) != id)
+			continue;
+		counters[id].liveBlocks += slot.liveBlocks;
+		counters[id].liveBytes += slot.liveBytes;
+		counters[id].allocatedBlocks += slot.allocatedBlocks;
+		counters[id].allocatedBytes += slot.allocatedBytes;
+	}
+}
+
+
+}  // end namespace
@@ -0,0 +1,64 @@
+#!/bin/sh
+# checks the output of a test run with the settings of one TESTSENVS
+# entry, for the features which have their own output. The reports are
+# those written by tests/test.cc and tests/threads.cc, leaks.out always
+# is a text report.
+# usage: check-run.sh <settings> <test binary> <directory> <libleaktracer.so> <helpers directory>
+
+settings=$1
+testbin=$2
+dir=$3
+lib=$4
+helpers=$5
+
+fail() {
+   echo "$settings: $*" >&2
+   exit 1
+}
+
+# sums the values of the field name= of the lines starting with prefix
+# usage: sum <prefix> <name> <file>
+sum() {
+   sed -n "s/^$1.* $2=\([0-9]*\).*/\1/p" $3 | awk '{ sum += $1 } END { print sum + 0 }'
+}
+
+# the lines of a report after its header
+body() {
+   tail -n +2 $1
+}
+
+case "$settings:$testbin" in
+LEAKTRACER_NOBANNER=1:*)
+   # frames are written as <module>:<offset>, each module used has its line
+   grep -q "^# module [0-9]* base=0x[0-9a-f]* .*path=$testbin\$" $dir/leaks.out || fail "no module line for $testbin"
+   for module in `sed -n 's/^leak, .* stack=\([^,]*\),.*/\1/p' $dir/leaks.out | tr ' ' '\n' | cut -d: -f1 | sort -u`; do
+      grep -q "^# module $module " $dir/leaks.out || fail "module $module of a stack has no line"
+   done
+   ;;
+*REPORT_FRAMES=symbol*)
+   grep -q '^# symbol [0-9]*:0x[0-9a-f]* [^ ]*+0x[0-9a-f]*$' $dir/leaks.out || fail "no symbol line"
+   ;;
+*REPORT_SNAPSHOT*:*/threads.bin)
+   # the leaks of the snapshot are those of the report written locked
+   head -n 1 $dir/snapshot.out | grep -q ' snapshot_stall_us=[0-9]' || fail "no snapshot stall in the header"
+   body $dir/snapshot.out > $dir/snapshot.body
+   body $dir/leaks.out > $dir/leaks.body
+   cmp -s $dir/snapshot.body $dir/leaks.body || fail "snapshot differs from the locked report"
+   ;;
+*REPORT_FORMAT=aggregated*:*/test.bin)
+   head -n 1 $dir/report.out | grep -q ' aggregated=1 stacks=[0-9]*/[0-9]*' || fail "no aggregated header"
+   [ "`sum 'leaks,' blocks $dir/report.out`" = "`grep -c '^leak, ' $dir/leaks.out`" ] || fail "aggregated blocks are not the leaks"
+   [ "`sum 'leaks,' bytes $dir/report.out`" = "`sum 'leak,' size $dir/leaks.out`" ] || fail "aggregated bytes are not those of the leaks"
+   ;;
+*HEAP_PROFILE*:*/test.bin)
+   head -n 1 $dir/heap.out | grep -q ' heap_profile=1 stacks=' || fail "no heap profile header"
+   [ "`sum 'heap,' live_bytes $dir/heap.out`" = "`sum 'leak,' size $dir/leaks.out`" ] || fail "live bytes are not those of the leaks"
+   ;;
+*CONTROL_SOCKET*:*/test.bin)
+   `dirname $0`/control-socket.sh $lib $helpers/leak-control $dir || exit 1
+   ;;
+*REPORT_INTERVAL_MS*:*/threads.bin)
+   grep -q '^# LeakTracer report' $dir/interval.out || fail "no periodic report"
+   ;;
+esac
+exit 0
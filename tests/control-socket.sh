@@ -0,0 +1,44 @@
+#!/bin/sh
+# sends commands to a process preloading libleaktracer.so with
+# LEAKTRACER_CONTROL_SOCKET set, through helpers/leak-control, and
+# checks the replies
+# usage: control-socket.sh <libleaktracer.so> <leak-control> <directory>
+
+lib=$1
+control=$2
+dir=$3
+
+fail() {
+   echo "control socket: $*" >&2
+   exit 1
+}
+
+env LEAKTRACER_NOBANNER=1 LD_PRELOAD=$lib LEAKTRACER_CONTROL_SOCKET=leaktracer.%p sleep 30 &
+pid=$!
+trap 'kill $pid 2>/dev/null' EXIT
+
+# the socket is created when the library is loaded
+tries=0
+until $control $pid stats > /dev/null 2>&1; do
+   tries=$((tries + 1))
+   [ $tries -lt 50 ] || fail "no reply from process $pid"
+   sleep 0.1
+done
+
+$control $pid start || fail "start failed"
+$control $pid stats | grep -q '^monitoring_all_threads=1$' || fail "stats don't show monitoring after start"
+$control $pid mark-generation | grep -q '^generation=1$' || fail "mark-generation didn't start generation 1"
+$control $pid report > $dir/control-reply.out
+grep -q '^# LeakTracer report' $dir/control-reply.out || fail "report has no header"
+rm -f $dir/control.out
+$control $pid report $dir/control.out || fail "report to a file failed"
+grep -q '^# LeakTracer report' $dir/control.out || fail "report file has no header"
+# the process doesn't allocate meanwhile, only the headers may differ
+tail -n +2 $dir/control-reply.out > $dir/control-reply.body
+tail -n +2 $dir/control.out > $dir/control.body
+cmp -s $dir/control-reply.body $dir/control.body || fail "report file differs from the report sent"
+$control $pid stop || fail "stop failed"
+$control $pid stats | grep -q '^monitoring_all_threads=0$' || fail "stats don't show monitoring stopped"
+$control $pid no-such-command 2> /dev/null && fail "unknown command succeeded"
+echo "control socket commands are valid"
+exit 0
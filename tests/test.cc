@@ -55,6 +55,14 @@ int main()
 	else
 		std::cerr << "Failed to write to \"leaks.out\"\n";
 
+	// and in the format set by LEAKTRACER_REPORT_FORMAT
+	if (getenv("LEAKTRACER_REPORT_FORMAT") != NULL)
+		leaktracer::MemoryTrace::GetInstance().writeLeaksToFile("report.out");
+
+	// the live counters of the call stacks, see LEAKTRACER_HEAP_PROFILE
+	if (getenv("LEAKTRACER_HEAP_PROFILE") != NULL)
+		leaktracer::MemoryTrace::GetInstance().writeHeapProfileToFile("heap.out", 0);
+
 	return 0;
 }
 
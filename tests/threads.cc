@@ -0,0 +1,227 @@
+////////////////////////////////////////////////////////
+//
+// LeakTracer
+// Contribution to original project by Erwin S. Andreasen
+// site: http://www.andreasen.org/LeakTracer/
+//
+// Added by Michael Gopshtein, 2006
+// mgopshtein@gmail.com
+//
+// Any comments/suggestions are welcome
+//
+////////////////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "MemoryTrace.hpp"
+
+
+#define NUMBER_OF_THREADS		8
+#define ALLOCATIONS_PER_THREAD	2000
+// sizes used to recognize our blocks in the report
+#define LEAKED_SIZE				777
+#define FREED_ELSEWHERE_SIZE	555
+#define FREED_SIZE				333
+// above the mmap threshold set by the tests: freed blocks are unmapped
+#define LARGE_SIZE				(128 * 1024)
+// blocks allocated then released at once by the main thread
+#define BURST_ALLOCATIONS		100000
+
+static char *freedElsewhere[NUMBER_OF_THREADS][ALLOCATIONS_PER_THREAD];
+static int runningThreads = NUMBER_OF_THREADS;
+
+
+// each thread leaks one block every 10 allocations, frees
+// its own blocks, and leaves some for the main thread to free
+static void *allocatingThread(void *arg)
+{
+	long id = (long)arg;
+	char *large = NULL;
+
+	for (int i = 0; i < ALLOCATIONS_PER_THREAD; i++) {
+		char *p = (char*)malloc(FREED_SIZE);
+		char *q = new char[FREED_ELSEWHERE_SIZE];
+		if (i % 10 == 0) {
+			char *leak = (char*)malloc(LEAKED_SIZE);
+			strcpy(leak, "This is a thread memory leak");
+		}
+		free(p);
+		freedElsewhere[id][i] = q;
+		if (i % 4 == 0) {
+			free(large);
+			large = (char*)malloc(LARGE_SIZE);
+			strcpy(large, "This is a large block");
+		}
+	}
+	free(large);
+	__atomic_sub_fetch(&runningThreads, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+// returns the number of leaks of given size, estimated from
+// their weights when allocations are sampled
+static double countLeaksOfSize(const std::string &report, size_t size)
+{
+	std::ostringstream pattern;
+	pattern << ", size=" << size << ", ";
+
+	double count = 0;
+	std::string::size_type pos = 0;
+	while ((pos = report.find(pattern.str(), pos)) != std::string::npos) {
+		pos += pattern.str().size();
+		if (report.compare(pos, 7, "weight=") == 0)
+			count += strtod(report.c_str() + pos + 7, NULL);
+		else
+			count++;
+	}
+	return count;
+}
+
+
+// returns the sum of the values of given field in a report
+static double sumField(const std::string &report, const std::string &field)
+{
+	double sum = 0;
+	std::string::size_type pos = 0;
+	while ((pos = report.find(field, pos)) != std::string::npos) {
+		pos += field.size();
+		sum += strtod(report.c_str() + pos, NULL);
+	}
+	return sum;
+}
+
+
+int main()
+{
+	pthread_t threads[NUMBER_OF_THREADS];
+
+	leaktracer::MemoryTrace::GetInstance().startMonitoringAllThreads();
+
+	// leaked before the generation of the threads
+	char *before = (char*)malloc(LEAKED_SIZE);
+	strcpy(before, "This is a leak before the threads");
+	uint32_t generation = leaktracer::MemoryTrace::GetInstance().markGeneration();
+
+	for (long i = 0; i < NUMBER_OF_THREADS; i++)
+		pthread_create(&threads[i], NULL, allocatingThread, (void*)i);
+	// reports read the blocks while the threads free them
+	while (__atomic_load_n(&runningThreads, __ATOMIC_ACQUIRE) != 0) {
+		std::ostringstream concurrentReport;
+		leaktracer::MemoryTrace::GetInstance().writeLeaks(concurrentReport);
+	}
+	for (long i = 0; i < NUMBER_OF_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	// blocks allocated by other threads are released here
+	for (long i = 0; i < NUMBER_OF_THREADS; i++)
+		for (int j = 0; j < ALLOCATIONS_PER_THREAD; j++)
+			delete[] freedElsewhere[i][j];
+
+	// the memory used for the blocks of a burst is given back
+	// once they are released, without a report or clear
+	leaktracer::MemoryTrace::stats_t beforeBurst, duringBurst, afterBurst;
+	static char *burst[BURST_ALLOCATIONS];
+	leaktracer::MemoryTrace::GetInstance().getStats(beforeBurst);
+	for (int i = 0; i < BURST_ALLOCATIONS; i++)
+		burst[i] = (char*)malloc(FREED_SIZE);
+	leaktracer::MemoryTrace::GetInstance().getStats(duringBurst);
+	for (int i = 0; i < BURST_ALLOCATIONS; i++)
+		free(burst[i]);
+	leaktracer::MemoryTrace::GetInstance().getStats(afterBurst);
+
+	leaktracer::MemoryTrace::GetInstance().stopAllMonitoring();
+
+	std::ostringstream report;
+	leaktracer::MemoryTrace::GetInstance().writeLeaks(report);
+	std::ostringstream generationReport;
+	leaktracer::MemoryTrace::GetInstance().writeLeaks(generationReport, generation, generation);
+
+	std::ostringstream profile;
+	if (getenv("LEAKTRACER_HEAP_PROFILE") != NULL)
+		leaktracer::MemoryTrace::GetInstance().writeHeapProfile(profile, 0);
+
+	// written by a forked child, from its copy of the map
+	std::string snapshot;
+	if (getenv("LEAKTRACER_REPORT_SNAPSHOT") != NULL) {
+		leaktracer::MemoryTrace::GetInstance().writeLeaksToFile("snapshot.out");
+		std::ifstream isnapshot("snapshot.out");
+		std::ostringstream content;
+		content << isnapshot.rdbuf();
+		snapshot = content.str();
+	}
+
+	std::ofstream oleaks;
+	oleaks.open("leaks.out", std::ios_base::out);
+	if (oleaks.is_open())
+		oleaks << report.str();
+	else
+		std::cerr << "Failed to write to \"leaks.out\"\n";
+
+	int expected = NUMBER_OF_THREADS * ALLOCATIONS_PER_THREAD / 10 + 1;
+	double leaked = countLeaksOfSize(report.str(), LEAKED_SIZE);
+	double generationLeaked = countLeaksOfSize(generationReport.str(), LEAKED_SIZE);
+	double freedElsewhereLeaks = countLeaksOfSize(report.str(), FREED_ELSEWHERE_SIZE);
+	double freedLeaks = countLeaksOfSize(report.str(), FREED_SIZE);
+	// with LEAKTRACER_SAMPLE_BYTES, the number of leaks is an estimate
+	bool sampled = (report.str().find(" sample_bytes=") != std::string::npos);
+	double tolerance = sampled ? expected * 0.3 : 0;
+	if (leaked < expected - tolerance || leaked > expected + tolerance || freedElsewhereLeaks != 0 || freedLeaks != 0) {
+		fprintf(stderr, "threads: expected %d leaks, found %.1f (+%.1f, +%.1f wrongly reported)\n",
+			expected, leaked, freedElsewhereLeaks, freedLeaks);
+		return 1;
+	}
+	// the generation report has the same leaks, but the one before
+	if (sampled ? generationLeaked > leaked : generationLeaked != leaked - 1) {
+		fprintf(stderr, "threads: expected %.1f leaks since the generation mark, found %.1f\n",
+			leaked - 1, generationLeaked);
+		return 1;
+	}
+	// a snapshot has the same leaks as a report written with the
+	// map locked, and records the stall, only the headers differ
+	if (getenv("LEAKTRACER_REPORT_SNAPSHOT") != NULL) {
+		std::string::size_type snapshotBody = snapshot.find('\n');
+		std::string::size_type reportBody = report.str().find('\n');
+		if (snapshot.find(" snapshot_stall_us=") >= snapshotBody ||
+			leaktracer::MemoryTrace::GetInstance().getLastSnapshotStall() == 0) {
+			fprintf(stderr, "threads: snapshot stall not recorded\n");
+			return 1;
+		}
+		if (snapshot.compare(snapshotBody, std::string::npos, report.str(), reportBody, std::string::npos) != 0) {
+			fprintf(stderr, "threads: snapshot report differs from the locked one\n");
+			return 1;
+		}
+	}
+#ifdef USE_LOCKFREE_MAP
+	// the burst makes the lock-free map grow rather than overflow,
+	// its tables are kept
+	if (afterBurst.mapOverflows != 0) {
+		fprintf(stderr, "threads: %lu allocations found the map full\n",
+			(unsigned long)afterBurst.mapOverflows);
+		return 1;
+	}
+#else
+	if (!sampled && afterBurst.metadataBytes > beforeBurst.metadataBytes +
+		(duringBurst.metadataBytes - beforeBurst.metadataBytes) / 2) {
+		fprintf(stderr, "threads: %lu bytes of metadata before a burst, %lu during it, still %lu after it\n",
+			(unsigned long)beforeBurst.metadataBytes, (unsigned long)duringBurst.metadataBytes,
+			(unsigned long)afterBurst.metadataBytes);
+		return 1;
+	}
+#endif
+	// the live bytes of the heap profile are those of the leaks
+	if (getenv("LEAKTRACER_HEAP_PROFILE") != NULL && !sampled &&
+		sumField(profile.str(), ", live_bytes=") != sumField(report.str(), ", size=")) {
+		fprintf(stderr, "threads: heap profile has %.0f live bytes, leaks have %.0f bytes\n",
+			sumField(profile.str(), ", live_bytes="), sumField(report.str(), ", size="));
+		return 1;
+	}
+	return 0;
+}